@@ -7,6 +7,8 @@
 #include "ruby.h"
 
 #include "ruby/encoding.h"
+#include "ruby/thread.h"
+#include "ruby/atomic.h"
 #ifdef HAVE_RUBY_VERSION_H
 #include "ruby/version.h"
 #endif
@@ -131,6 +133,8 @@ static ID ID_at_interp;
 
 static ID ID_encoding_name;
 static ID ID_encoding_table;
+static ID ID_at_coalesce_table;
+static ID ID_at_coalesce_queued;
 
 static ID ID_stop_p;
 static ID ID_alive_p;
@@ -139,6 +143,7 @@ static ID ID_join;
 static ID ID_value;
 
 static ID ID_call;
+static ID ID_callback;
 static ID ID_backtrace;
 static ID ID_message;
 
@@ -203,14 +208,43 @@ tcl_global_eval(Tcl_Interp *interp, const char *cmd)
 
 /*---- module TclTkLib ----*/
 
+/*
+ *  Completion status of a request which is queued to the eventloop thread.
+ *  'state' is 0 while queued, 1 while processing and -1 when complete.
+ *  The handler signals 'cond' on completion, so that the caller thread
+ *  can sleep (without the GVL) until then instead of polling.
+ *  'waiting' is the number of the threads which are sleeping on it
+ *  (each one keeps its timeout in an evq_waiter on its stack).
+ *  'owner' is non-zero for an asynchronous request; the owner is kept
+ *  alive by evq_async_table until the handler completes it.
+ *  'result' is set by the handler. Completions are allocated from the
+ *  slabs of evq_pool, which marks the result of the ones in use.
+ */
+struct evq_completion {
+    int state;
+    int waiting;
+    int uncollected;
+    int abandoned;    /* the caller gave up : freed by the handler */
+    Tcl_WideInt queued_at;  /* for eventloop_stats */
+    VALUE owner;      /* future object of an asynchronous request */
+    VALUE result;
+    int in_use;
+    struct evq_completion *next_free;
+#ifdef TCL_THREADS
+    Tcl_Mutex mutex;
+    Tcl_Condition cond;
+#endif
+};
+
 struct invoke_queue {
     Tcl_Event ev;
     int argc;
     Tcl_Obj **argv;
+    int result_mode;  /* RBTK_RESULT_* */
     VALUE interp;
-    int *done;
-    VALUE result;
+    struct evq_completion *done;
     VALUE thread;
+    Tcl_WideInt queued_at;  /* for eventloop_stats (without 'done') */
 };
 
 struct eval_queue {
@@ -218,27 +252,43 @@ struct eval_queue {
     char *str;
     int len;
     VALUE interp;
-    int *done;
-    VALUE result;
+    struct evq_completion *done;
     VALUE thread;
 };
 
+#define CALL_QUEUE_INLINE_ARGC 4
+
 struct call_queue {
     Tcl_Event ev;
     VALUE (*func)(VALUE, int, VALUE *);
     int argc;
     VALUE *argv;
+    VALUE argv_buf[CALL_QUEUE_INLINE_ARGC];  /* argv for small argc */
     VALUE interp;
-    int *done;
-    VALUE result;
+    struct evq_completion *done;
     VALUE thread;
 };
 
+struct coalesce_queue {
+    Tcl_Event ev;
+    VALUE interp;
+    Tcl_WideInt queued_at;  /* for eventloop_stats */
+};
+
+/* all kinds of request events have the same size in the record pool */
+union evq_record {
+    Tcl_Event ev;
+    struct invoke_queue ivq;
+    struct eval_queue evq;
+    struct call_queue callq;
+    struct coalesce_queue cq;
+    union evq_record *next_free;
+};
+
 void
 invoke_queue_mark(struct invoke_queue *q)
 {
     rb_gc_mark(q->interp);
-    rb_gc_mark(q->result);
     rb_gc_mark(q->thread);
 }
 
@@ -246,7 +296,6 @@ void
 eval_queue_mark(struct eval_queue *q)
 {
     rb_gc_mark(q->interp);
-    rb_gc_mark(q->result);
     rb_gc_mark(q->thread);
 }
 
@@ -260,7 +309,6 @@ call_queue_mark(struct call_queue *q)
     }
 
     rb_gc_mark(q->interp);
-    rb_gc_mark(q->result);
     rb_gc_mark(q->thread);
 }
 
@@ -318,6 +366,476 @@ static int loop_counter = 0;
 
 static int check_rootwidget_flag = 0;
 
+/*
+ *  If 'eventloop_nogvl' is true, the eventloop releases the GVL while it
+ *  blocks in Tcl_DoOneEvent, and then the timer ticks are not used.
+ *  'eventloop_nogvl_thread' is the native thread which is blocking now.
+ *  Callbacks from Tcl on the thread must take the GVL again.
+ */
+static int eventloop_nogvl = 0;
+static Tcl_ThreadId eventloop_nogvl_thread = (Tcl_ThreadId)NULL;
+
+/*
+ *  Adaptive weight of the eventloop.
+ *  If 'eventloop_adaptive_target' (usec) is positive, the eventloop tunes
+ *  'event_loop_max' and 'no_event_tick' after each term of thread
+ *  scheduling (AIMD), to keep the term (including callbacks) within the
+ *  target, and to shorten the blocking wait when cross-thread requests
+ *  are pending.
+ */
+#define ADAPTIVE_EVENT_LOOP_MIN        10/*counts*/
+#define ADAPTIVE_EVENT_LOOP_LIMIT   10000/*counts*/
+#define ADAPTIVE_EVENT_LOOP_STEP       50/*counts*/
+static int eventloop_adaptive_target = 0;
+
+/* monotonic clock (usec) */
+static Tcl_WideInt
+rbtk_monotonic_usec(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+        return (Tcl_WideInt)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+#endif
+    {
+        Tcl_Time tcl_time;
+
+        Tcl_GetTime(&tcl_time);
+        return (Tcl_WideInt)tcl_time.sec * 1000000 + tcl_time.usec;
+    }
+}
+
+/*
+ *  Statistics of the eventloop (TclTkLib.eventloop_stats).
+ *  Collected only when 'eventloop_stats_mode' is true.
+ *  A histogram has log2 buckets of usec. The bucket i counts values
+ *  less than 2**(i+1) usec, and the last one counts all larger values.
+ */
+#define RBTK_HIST_BUCKETS 20
+
+struct rbtk_histogram {
+    unsigned long count[RBTK_HIST_BUCKETS];
+};
+
+static int eventloop_stats_mode = 0;
+static struct {
+    unsigned long iterations;         /* passes of the eventloop */
+    unsigned long do_one_event_calls;
+    unsigned long events;             /* calls which processed an event */
+    Tcl_WideInt dispatch_usec;        /* processing in Tcl_DoOneEvent */
+    Tcl_WideInt callback_usec;        /* in Ruby callbacks */
+    Tcl_WideInt dispatch_callback_usec; /* in callbacks of Tcl_DoOneEvent */
+    unsigned long callbacks;
+    unsigned long thread_schedules;
+    unsigned long requests;           /* completed cross-thread requests */
+    int queue_depth_max;              /* of the submission ring */
+    struct rbtk_histogram event_hist;
+    struct rbtk_histogram callback_hist;
+    struct rbtk_histogram request_hist;
+} eventloop_stats;
+static Tcl_WideInt eventloop_stats_wakeup = 0;
+
+/*
+ *  Per thread : callbacks and eventloops of interpreters on other threads
+ *  nest on their own (the GVL passes between them).
+ */
+struct rbtk_thread_data {
+    int callback_depth;   /* nesting of Ruby callbacks */
+    int dispatching;      /* in Tcl_DoOneEvent of DoOneEvent_with_stats */
+};
+static Tcl_ThreadDataKey rbtk_thread_data_key;
+#define RBTK_THREAD_DATA() ((struct rbtk_thread_data *) \
+    Tcl_GetThreadData(&rbtk_thread_data_key, sizeof(struct rbtk_thread_data)))
+
+static int evq_ring_depth(void);
+
+/*
+ *  Tracer of the hot paths (TclTkLib.start_trace).
+ *  Begin/end events are kept in a ring buffer with the GVL, and are
+ *  dumped in the Chrome trace format by TclTkLib.trace_json.
+ *  'detail' keeps the head of the command or the script.
+ */
+#define RBTK_TRACE_DEFAULT_SIZE 65536
+#define RBTK_TRACE_DETAIL_LEN      32
+
+struct rbtk_trace_event {
+    Tcl_WideInt ts;
+    const char *name;
+    Tcl_ThreadId thread;
+    char phase;
+    char detail[RBTK_TRACE_DETAIL_LEN];
+};
+
+static struct rbtk_trace_event *rbtk_trace_buf = NULL;
+static unsigned long rbtk_trace_size = 0;
+static unsigned long rbtk_trace_count = 0;   /* total of recorded events */
+static int rbtk_trace_mode = 0;
+
+static void
+rbtk_trace_add(const char *name, char phase, const char *detail, long len)
+{
+    struct rbtk_trace_event *ev;
+
+    ev = rbtk_trace_buf + (rbtk_trace_count++ % rbtk_trace_size);
+    ev->ts = rbtk_monotonic_usec();
+    ev->name = name;
+    ev->thread = Tcl_GetCurrentThread();
+    ev->phase = phase;
+    if (detail == (const char *)NULL) {
+        ev->detail[0] = '\0';
+    } else {
+        if (len < 0) len = (long)strlen(detail);
+        if (len >= RBTK_TRACE_DETAIL_LEN) {
+            /* don't split a UTF-8 character */
+            len = RBTK_TRACE_DETAIL_LEN - 1;
+            while(len > 0 && (detail[len] & 0xC0) == 0x80) len--;
+        }
+        strncpy(ev->detail, detail, len);
+        ev->detail[len] = '\0';
+    }
+}
+
+#define RBTK_TRACE_BEGIN(name, detail, len) do { \
+    if (rbtk_trace_mode) rbtk_trace_add((name), 'B', (detail), (len)); \
+} while (0)
+
+#define RBTK_TRACE_END(name) do { \
+    if (rbtk_trace_mode) rbtk_trace_add((name), 'E', NULL, 0); \
+} while (0)
+
+static void
+rbtk_histogram_add(struct rbtk_histogram *hist, Tcl_WideInt usec)
+{
+    int i = 0;
+
+    while(usec > 1 && i < RBTK_HIST_BUCKETS - 1) {
+        usec >>= 1;
+        i++;
+    }
+    hist->count[i]++;
+}
+
+
+#define RBTK_NOGVL_P() \
+    (eventloop_nogvl_thread != (Tcl_ThreadId)NULL \
+     && eventloop_nogvl_thread == Tcl_GetCurrentThread())
+
+
+/* completion of cross-thread requests */
+static int evq_completion_uncollected = 0;
+static int evq_completion_in_use = 0;   /* taken from the pool */
+static VALUE evq_async_table;    /* owner of pending async request => true */
+                                 /* (or interp => count for nowait) */
+
+/*
+ *  Pools of the completions and of the request events (with the GVL).
+ *  Completions are never freed to keep their mutex and condition.
+ *  A request event is allocated by ckalloc one by one, because an event
+ *  queued to Tcl directly is freed by Tcl_ServiceEvent. Events which are
+ *  processed by the drain of the submission ring come back to the pool.
+ */
+#ifndef EVQ_POOL_SLAB_SIZE
+#define EVQ_POOL_SLAB_SIZE   64
+#endif
+#ifndef EVQ_RECORD_POOL_MAX
+#define EVQ_RECORD_POOL_MAX 256
+#endif
+
+struct evq_pool_slab {
+    struct evq_pool_slab *next;
+    struct evq_completion c[EVQ_POOL_SLAB_SIZE];
+};
+
+static struct evq_pool_slab *evq_pool_slabs = (struct evq_pool_slab *)NULL;
+static struct evq_completion *evq_pool_free = (struct evq_completion *)NULL;
+static union evq_record *evq_record_free_list = (union evq_record *)NULL;
+static int evq_record_free_count = 0;
+static VALUE evq_pool;           /* marks results of completions in use */
+
+static void
+evq_pool_mark(void *p)
+{
+    struct evq_pool_slab *slab;
+    int i;
+
+    for(slab = evq_pool_slabs; slab; slab = slab->next) {
+        for(i = 0; i < EVQ_POOL_SLAB_SIZE; i++) {
+            if (slab->c[i].in_use) rb_gc_mark(slab->c[i].result);
+        }
+    }
+}
+
+static const rb_data_type_t evq_pool_type = {
+    "TclTkLib/evq_pool",
+    {evq_pool_mark, 0, 0,},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static struct evq_completion *
+evq_completion_new(void)
+{
+    struct evq_completion *c;
+    struct evq_pool_slab *slab;
+    int i;
+
+    if (!evq_pool_free) {
+        slab = RbTk_ALLOC_N(struct evq_pool_slab, 1);
+        memset(slab, 0, sizeof(struct evq_pool_slab));
+        for(i = EVQ_POOL_SLAB_SIZE - 1; i >= 0; i--) {
+            slab->c[i].next_free = evq_pool_free;
+            evq_pool_free = &(slab->c[i]);
+        }
+        slab->next = evq_pool_slabs;
+        evq_pool_slabs = slab;
+    }
+
+    c = evq_pool_free;
+    evq_pool_free = c->next_free;
+
+    c->state = 0;
+    c->waiting = 0;
+    c->uncollected = 0;
+    c->abandoned = 0;
+    c->queued_at = (eventloop_stats_mode)? rbtk_monotonic_usec(): 0;
+    c->owner = (VALUE)0;
+    c->result = Qnil;
+    c->next_free = (struct evq_completion *)NULL;
+    c->in_use = 1;
+    evq_completion_in_use++;
+
+    return c;
+}
+
+static void
+evq_completion_free(struct evq_completion *c)
+{
+    c->in_use = 0;
+    evq_completion_in_use--;
+    c->result = Qnil;
+    c->owner = (VALUE)0;
+    c->next_free = evq_pool_free;
+    evq_pool_free = c;
+}
+
+/*
+ *  a completion which is not complete may be touched by the handler later.
+ *  it is abandoned : the handler frees it (and the arguments of the request).
+ *  returns 1 when the caller may free the arguments.
+ */
+static int
+evq_completion_release(struct evq_completion *c)
+{
+    if (c->state < 0) {
+        evq_completion_free(c);
+        return 1;
+    } else {
+        DUMP1("abandon the incomplete completion");
+        c->abandoned = 1;
+        return 0;
+    }
+}
+
+static Tcl_Event *
+evq_record_alloc(void)
+{
+    union evq_record *rec;
+
+    if (evq_record_free_list) {
+        rec = evq_record_free_list;
+        evq_record_free_list = rec->next_free;
+        evq_record_free_count--;
+    } else {
+        rec = RbTk_ALLOC_N(union evq_record, 1);
+    }
+    memset(rec, 0, sizeof(union evq_record));
+
+    return (Tcl_Event*)rec;
+}
+
+static void
+evq_record_free(Tcl_Event *ev)
+{
+    union evq_record *rec = (union evq_record *)ev;
+
+    if (evq_record_free_count >= EVQ_RECORD_POOL_MAX) {
+        ckfree((char*)rec);
+        return;
+    }
+    rec->next_free = evq_record_free_list;
+    evq_record_free_list = rec;
+    evq_record_free_count++;
+}
+
+/* a request from another thread is done ('queued_at' is 0 if no stats) */
+static void
+evq_stats_request_done(Tcl_WideInt queued_at)
+{
+    if (eventloop_stats_mode && queued_at != 0) {
+        eventloop_stats.requests++;
+        rbtk_histogram_add(&eventloop_stats.request_hist,
+                           rbtk_monotonic_usec() - queued_at);
+    }
+}
+
+/* called by the queue handler (on the eventloop thread, with the GVL) */
+static void
+evq_completion_signal(struct evq_completion *c)
+{
+    volatile VALUE owner = c->owner;
+
+    evq_stats_request_done(c->queued_at);
+
+    /* the caller needs the GVL to collect the result */
+    if (c->waiting) {
+        c->uncollected = 1;
+        evq_completion_uncollected++;
+    }
+
+#ifdef TCL_THREADS
+    Tcl_MutexLock(&(c->mutex));
+    c->state = -1;
+    Tcl_ConditionNotify(&(c->cond));
+    Tcl_MutexUnlock(&(c->mutex));
+#else
+    c->state = -1;
+#endif
+
+    /* asynchronous request : the owner can be collected from now */
+    if (owner) rb_hash_delete(evq_async_table, owner);
+
+    /* nobody collects the result */
+    if (c->abandoned) evq_completion_free(c);
+}
+
+/* a thread sleeping on a completion */
+struct evq_waiter {
+    struct evq_completion *c;
+    long wait_usec;
+    int interrupted;
+};
+
+#ifdef TCL_THREADS
+static void *
+evq_completion_wait_nogvl(void *arg)
+{
+    struct evq_waiter *w = (struct evq_waiter *)arg;
+    struct evq_completion *c = w->c;
+    Tcl_Time timeout;
+
+    timeout.sec  = w->wait_usec / 1000000L;
+    timeout.usec = w->wait_usec % 1000000L;
+
+    Tcl_MutexLock(&(c->mutex));
+    if (c->state >= 0 && !w->interrupted) {
+        Tcl_ConditionWait(&(c->cond), &(c->mutex), &timeout);
+    }
+    Tcl_MutexUnlock(&(c->mutex));
+
+    return NULL;
+}
+
+static void
+evq_completion_unblock(void *arg)
+{
+    struct evq_waiter *w = (struct evq_waiter *)arg;
+    struct evq_completion *c = w->c;
+
+    /* the other waiters of the completion go back to sleep */
+    Tcl_MutexLock(&(c->mutex));
+    w->interrupted = 1;
+    Tcl_ConditionNotify(&(c->cond));
+    Tcl_MutexUnlock(&(c->mutex));
+}
+#endif
+
+/*
+ *  called by the caller thread.
+ *  returns 1 when complete, 0 on timeout or when the eventloop is lost.
+ *  (timeout < 0 : no limit)
+ */
+static int
+evq_completion_wait(struct evq_completion *c, double timeout)
+{
+    struct evq_waiter w;
+    Tcl_Time limit, now;
+    long rest;
+#ifndef TCL_THREADS
+    struct timeval t;
+#endif
+
+    w.c = c;
+
+    if (timeout >= 0.0) {
+        Tcl_GetTime(&limit);
+        limit.sec  += (long)timeout;
+        limit.usec += (long)((timeout - (double)((long)timeout)) * 1000000.0);
+        if (limit.usec >= 1000000L) {
+            limit.sec++;
+            limit.usec -= 1000000L;
+        }
+    }
+
+    c->waiting++;
+    while(c->state >= 0) {
+        /* the default is only a safety net for a lost eventloop thread */
+        w.wait_usec = 1000L * (long)EVENT_HANDLER_TIMEOUT;
+        if (timeout >= 0.0) {
+            Tcl_GetTime(&now);
+            rest = (limit.sec - now.sec) * 1000000L + (limit.usec - now.usec);
+            if (rest <= 0) break;
+            if (rest < w.wait_usec) w.wait_usec = rest;
+        }
+
+#ifdef TCL_THREADS
+        w.interrupted = 0;
+        rb_thread_call_without_gvl(evq_completion_wait_nogvl, (void*)&w,
+                                   evq_completion_unblock, (void*)&w);
+#else
+        t.tv_sec  = w.wait_usec / 1000000L;
+        t.tv_usec = w.wait_usec % 1000000L;
+        rb_thread_wait_for(t);
+#endif
+        if (c->state < 0) break;
+
+        /* an exception may be raised : the result will not be collected */
+        c->waiting--;
+        rb_thread_check_ints();
+        if (NIL_P(eventloop_thread)) {
+            DUMP1("*** lost eventloop thread");
+            return 0;
+        }
+        c->waiting++;
+    }
+    c->waiting--;
+
+    if (c->uncollected) {
+        c->uncollected = 0;
+        evq_completion_uncollected--;
+    }
+
+    return (c->state < 0);
+}
+
+static VALUE
+evq_completion_wait_body(VALUE c)
+{
+    return INT2FIX(evq_completion_wait((struct evq_completion *)c, -1.0));
+}
+
+/*
+ *  wait for a synchronous request.
+ *  *status is the tag of an exception raised while waiting (rb_protect) :
+ *  the caller releases the completion before rb_jump_tag().
+ */
+static void
+evq_completion_wait_sync(struct evq_completion *c, int *status)
+{
+    *status = 0;
+    rb_protect(evq_completion_wait_body, (VALUE)c, status);
+}
+
 
 /* call ruby interpreter */
 static int ip_ruby_eval (ClientData, Tcl_Interp *, int, Tcl_Obj *CONST*);
@@ -424,6 +942,8 @@ struct tcltkip {
     int ref_count;               /* reference count of rbtk_preserve_ip call */
     int allow_ruby_exit;         /* allow exiting ruby by 'exit' function */
     int return_value;            /* return value */
+    Tcl_HashTable *obj_cache;    /* interned arguments (assoc data of ip) */
+    struct rbtk_eval_cache *eval_cache; /* compiled scripts (assoc data) */
 };
 
 static const rb_data_type_t tcltkip_type = {
@@ -756,60 +1276,217 @@ call_original_exit(struct tcltkip *ptr, int state)
     DUMP1("complete original_exit");
 }
 
-/* Tk_ThreadTimer */
-static Tcl_TimerToken timer_token = (Tcl_TimerToken)NULL;
+/*
+ *  Re-entry of Ruby from a callback of Tcl_DoOneEvent which is running
+ *  without the GVL (see 'eventloop_nogvl').
+ *  An exception must not pass through the Tcl's stack.
+ *  So it is kept as the pending exception of the eventloop. Any other
+ *  tag (Thread#kill, throw) is kept in 'rbtk_pending_jump_tag', and
+ *  nogvl_DoOneEvent jumps with it when Tcl_DoOneEvent returns.
+ */
+static int rbtk_pending_jump_tag = 0;
 
-/* timer callback */
-static void
-_timer_for_tcl(ClientData clientData)
+struct rbtk_gvl_call {
+    void (*func)(void *);
+    void *arg;
+};
+
+static VALUE
+rbtk_gvl_call_protected(VALUE arg)
 {
-    /* struct invoke_queue *q, *tmp; */
-    /* VALUE thread; */
+    struct rbtk_gvl_call *call = (struct rbtk_gvl_call *)arg;
 
-    DUMP1("call _timer_for_tcl");
+    (*(call->func))(call->arg);
+    return Qnil;
+}
 
-    Tcl_DeleteTimerHandler(timer_token);
+static void *
+rbtk_gvl_call_body(void *arg)
+{
+    Tcl_ThreadId blocking = eventloop_nogvl_thread;
+    int status;
 
-    run_timer_flag = 1;
+    eventloop_nogvl_thread = (Tcl_ThreadId)NULL;
+    rb_protect(rbtk_gvl_call_protected, (VALUE)arg, &status);
+    if (status) {
+        volatile VALUE exc = rb_errinfo();
 
-    if (timer_tick > 0) {
-        timer_token = Tcl_CreateTimerHandler(timer_tick, _timer_for_tcl,
-                                             (ClientData)0);
-    } else {
-        timer_token = (Tcl_TimerToken)NULL;
+        if (rb_obj_is_kind_of(exc, rb_eException)) {
+            rbtk_pending_exception = exc;
+            rb_set_errinfo(Qnil);
+        } else if (status == TAG_RAISE) {
+            rbtk_pending_exception
+                = rb_exc_new2(rb_eException, "unknown exception");
+        } else if (!rbtk_pending_jump_tag) {
+            /* Thread#kill, throw, ... : passed on by nogvl_DoOneEvent */
+            rbtk_pending_jump_tag = status;
+        }
     }
+    eventloop_nogvl_thread = blocking;
 
-    /* rb_thread_schedule(); */
-    /* tick_counter += event_loop_max; */
+    return NULL;
 }
 
-#if USE_TOGGLE_WINDOW_MODE_FOR_IDLE
-static int
-toggle_eventloop_window_mode_for_idle(void)
+static void
+rbtk_call_with_gvl(void (*func)(void *), void *arg)
 {
-  if (window_event_mode & TCL_IDLE_EVENTS) {
-    /* idle -> event */
-    window_event_mode |= TCL_WINDOW_EVENTS;
-    window_event_mode &= ~TCL_IDLE_EVENTS;
-    return 1;
-  } else {
-    /* event -> idle */
-    window_event_mode |= TCL_IDLE_EVENTS;
-    window_event_mode &= ~TCL_WINDOW_EVENTS;
-    return 0;
-  }
+    struct rbtk_gvl_call call;
+
+    call.func = func;
+    call.arg  = arg;
+    rb_thread_call_with_gvl(rbtk_gvl_call_body, (void *)&call);
 }
-#endif
 
-static VALUE
-set_eventloop_window_mode(VALUE self, VALUE mode)
+/* Tcl command procedure */
+struct rbtk_objcmd_call {
+    Tcl_ObjCmdProc *proc;
+    ClientData clientData;
+    Tcl_Interp *interp;
+    int objc;
+    Tcl_Obj *CONST *objv;
+    int ret;
+};
+
+static void
+rbtk_objcmd_call_func(void *arg)
 {
+    struct rbtk_objcmd_call *call = (struct rbtk_objcmd_call *)arg;
 
-    if (RTEST(mode)) {
-      window_event_mode = ~0;
-    } else {
-      window_event_mode = ~TCL_WINDOW_EVENTS;
-    }
+    call->ret = (*(call->proc))(call->clientData, call->interp,
+                                call->objc, call->objv);
+}
+
+static int
+rbtk_objcmd_with_gvl(Tcl_ObjCmdProc *proc, ClientData clientData,
+                     Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    struct rbtk_objcmd_call call;
+
+    call.proc = proc;
+    call.clientData = clientData;
+    call.interp = interp;
+    call.objc = objc;
+    call.objv = objv;
+    call.ret = TCL_ERROR;
+    rbtk_call_with_gvl(rbtk_objcmd_call_func, (void *)&call);
+
+    return call.ret;
+}
+
+#define RBTK_OBJCMD_WITH_GVL(proc, clientData, interp, objc, objv) do { \
+    if (RBTK_NOGVL_P()) { \
+        return rbtk_objcmd_with_gvl((proc), (clientData), (interp), \
+                                    (objc), (objv)); \
+    } \
+} while (0)
+
+/* Tcl event procedure */
+struct rbtk_eventproc_call {
+    Tcl_EventProc *proc;
+    Tcl_Event *evPtr;
+    int flags;
+    int ret;
+};
+
+static void
+rbtk_eventproc_call_func(void *arg)
+{
+    struct rbtk_eventproc_call *call = (struct rbtk_eventproc_call *)arg;
+
+    call->ret = (*(call->proc))(call->evPtr, call->flags);
+}
+
+static int
+rbtk_eventproc_with_gvl(Tcl_EventProc *proc, Tcl_Event *evPtr, int flags)
+{
+    struct rbtk_eventproc_call call;
+
+    call.proc = proc;
+    call.evPtr = evPtr;
+    call.flags = flags;
+    call.ret = 1;
+    rbtk_call_with_gvl(rbtk_eventproc_call_func, (void *)&call);
+
+    return call.ret;
+}
+
+#define RBTK_EVENTPROC_WITH_GVL(proc, evPtr, flags) do { \
+    if (RBTK_NOGVL_P()) { \
+        return rbtk_eventproc_with_gvl((proc), (evPtr), (flags)); \
+    } \
+} while (0)
+
+/* wakeup of the waiting thread from trace or event handlers */
+static void
+rbtk_thread_wakeup_func(void *arg)
+{
+    rb_thread_wakeup((VALUE)arg);
+}
+
+static void
+rbtk_thread_wakeup(VALUE thread)
+{
+    if (RBTK_NOGVL_P()) {
+        rbtk_call_with_gvl(rbtk_thread_wakeup_func, (void *)thread);
+    } else {
+        rb_thread_wakeup(thread);
+    }
+}
+
+/* Tk_ThreadTimer */
+static Tcl_TimerToken timer_token = (Tcl_TimerToken)NULL;
+
+/* timer callback */
+static void
+_timer_for_tcl(ClientData clientData)
+{
+    /* struct invoke_queue *q, *tmp; */
+    /* VALUE thread; */
+
+    DUMP1("call _timer_for_tcl");
+
+    Tcl_DeleteTimerHandler(timer_token);
+
+    run_timer_flag = 1;
+
+    if (timer_tick > 0 && !eventloop_nogvl) {
+        timer_token = Tcl_CreateTimerHandler(timer_tick, _timer_for_tcl,
+                                             (ClientData)0);
+    } else {
+        timer_token = (Tcl_TimerToken)NULL;
+    }
+
+    /* rb_thread_schedule(); */
+    /* tick_counter += event_loop_max; */
+}
+
+#if USE_TOGGLE_WINDOW_MODE_FOR_IDLE
+static int
+toggle_eventloop_window_mode_for_idle(void)
+{
+  if (window_event_mode & TCL_IDLE_EVENTS) {
+    /* idle -> event */
+    window_event_mode |= TCL_WINDOW_EVENTS;
+    window_event_mode &= ~TCL_IDLE_EVENTS;
+    return 1;
+  } else {
+    /* event -> idle */
+    window_event_mode |= TCL_IDLE_EVENTS;
+    window_event_mode &= ~TCL_WINDOW_EVENTS;
+    return 0;
+  }
+}
+#endif
+
+static VALUE
+set_eventloop_window_mode(VALUE self, VALUE mode)
+{
+
+    if (RTEST(mode)) {
+      window_event_mode = ~0;
+    } else {
+      window_event_mode = ~TCL_WINDOW_EVENTS;
+    }
 
     return mode;
 }
@@ -923,6 +1600,43 @@ ip_get_no_event_wait(VALUE self)
     return get_no_event_wait(self);
 }
 
+static VALUE
+set_eventloop_nogvl(VALUE self, VALUE mode)
+{
+    eventloop_nogvl = RTEST(mode);
+
+    return mode;
+}
+
+static VALUE
+get_eventloop_nogvl(VALUE self)
+{
+    return (eventloop_nogvl)? Qtrue: Qfalse;
+}
+
+static VALUE
+ip_set_eventloop_nogvl(VALUE self, VALUE mode)
+{
+    struct tcltkip *ptr = get_ip(self);
+
+    /* ip is deleted? */
+    if (deleted_ip(ptr)) {
+        return get_eventloop_nogvl(self);
+    }
+
+    if (Tcl_GetMaster(ptr->ip) != (Tcl_Interp*)NULL) {
+        /* slave IP */
+        return get_eventloop_nogvl(self);
+    }
+    return set_eventloop_nogvl(self, mode);
+}
+
+static VALUE
+ip_get_eventloop_nogvl(VALUE self)
+{
+    return get_eventloop_nogvl(self);
+}
+
 static VALUE
 set_eventloop_weight(VALUE self, VALUE loop_max, VALUE no_event)
 {
@@ -969,6 +1683,241 @@ ip_get_eventloop_weight(VALUE self)
     return get_eventloop_weight(self);
 }
 
+static VALUE
+set_eventloop_adaptive(VALUE self, VALUE target)
+{
+    double msec;
+
+    if (!RTEST(target)) {
+        eventloop_adaptive_target = 0;
+        return target;
+    }
+
+    /* 0 is not a target : nil or false stops the tuning */
+    msec = NUM2DBL(target);
+    if (!(msec >= 0.001 && msec <= 1000)) {
+        rb_raise(rb_eArgError,
+                 "target parameter must be a number of 0.001 -- 1000 ms (or nil)");
+    }
+
+    eventloop_adaptive_target = (int)(msec * 1000.0);
+
+    return target;
+}
+
+static VALUE
+get_eventloop_adaptive(VALUE self)
+{
+    if (eventloop_adaptive_target > 0) {
+        return rb_float_new((double)eventloop_adaptive_target / 1000.0);
+    } else {
+        return Qnil;
+    }
+}
+
+static VALUE
+ip_set_eventloop_adaptive(VALUE self, VALUE target)
+{
+    struct tcltkip *ptr = get_ip(self);
+
+    /* ip is deleted? */
+    if (deleted_ip(ptr)) {
+        return get_eventloop_adaptive(self);
+    }
+
+    if (Tcl_GetMaster(ptr->ip) != (Tcl_Interp*)NULL) {
+        /* slave IP */
+        return get_eventloop_adaptive(self);
+    }
+    return set_eventloop_adaptive(self, target);
+}
+
+static VALUE
+ip_get_eventloop_adaptive(VALUE self)
+{
+    return get_eventloop_adaptive(self);
+}
+
+static VALUE
+set_eventloop_stats_mode(VALUE self, VALUE mode)
+{
+    eventloop_stats_mode = RTEST(mode);
+
+    return mode;
+}
+
+static VALUE
+get_eventloop_stats_mode(VALUE self)
+{
+    return (eventloop_stats_mode)? Qtrue: Qfalse;
+}
+
+static VALUE
+reset_eventloop_stats(VALUE self)
+{
+    memset(&eventloop_stats, 0, sizeof(eventloop_stats));
+
+    return Qnil;
+}
+
+static VALUE
+rbtk_histogram_to_ary(struct rbtk_histogram *hist)
+{
+    volatile VALUE ary = rb_ary_new2(RBTK_HIST_BUCKETS);
+    int i;
+
+    for(i = 0; i < RBTK_HIST_BUCKETS; i++) {
+        rb_ary_push(ary, ULONG2NUM(hist->count[i]));
+    }
+    return ary;
+}
+
+#define STATS_SET(hash, key, val) \
+    rb_hash_aset((hash), ID2SYM(rb_intern(key)), (val))
+
+static VALUE
+lib_eventloop_stats(VALUE self)
+{
+    volatile VALUE hash = rb_hash_new();
+    Tcl_WideInt tcl_usec;
+
+    tcl_usec = eventloop_stats.dispatch_usec
+               - eventloop_stats.dispatch_callback_usec;
+    if (tcl_usec < 0) tcl_usec = 0;
+
+    STATS_SET(hash, "iterations", ULONG2NUM(eventloop_stats.iterations));
+    STATS_SET(hash, "do_one_event_calls",
+              ULONG2NUM(eventloop_stats.do_one_event_calls));
+    STATS_SET(hash, "events", ULONG2NUM(eventloop_stats.events));
+    STATS_SET(hash, "events_per_call",
+              rb_float_new((eventloop_stats.do_one_event_calls > 0)?
+                           (double)eventloop_stats.events
+                           / (double)eventloop_stats.do_one_event_calls
+                           : 0.0));
+    STATS_SET(hash, "tcl_time", rb_float_new((double)tcl_usec / 1000000.0));
+    STATS_SET(hash, "ruby_time",
+              rb_float_new((double)eventloop_stats.callback_usec / 1000000.0));
+    STATS_SET(hash, "callbacks", ULONG2NUM(eventloop_stats.callbacks));
+    STATS_SET(hash, "thread_schedules",
+              ULONG2NUM(eventloop_stats.thread_schedules));
+    STATS_SET(hash, "requests", ULONG2NUM(eventloop_stats.requests));
+    STATS_SET(hash, "queue_depth", INT2NUM(evq_ring_depth()));
+    STATS_SET(hash, "queue_depth_max",
+              INT2NUM(eventloop_stats.queue_depth_max));
+    STATS_SET(hash, "completions_in_use", INT2NUM(evq_completion_in_use));
+    STATS_SET(hash, "event_time_histogram",
+              rbtk_histogram_to_ary(&eventloop_stats.event_hist));
+    STATS_SET(hash, "callback_time_histogram",
+              rbtk_histogram_to_ary(&eventloop_stats.callback_hist));
+    STATS_SET(hash, "request_wait_histogram",
+              rbtk_histogram_to_ary(&eventloop_stats.request_hist));
+
+    return hash;
+}
+
+#undef STATS_SET
+
+/* start_trace(size = 65536) */
+static VALUE
+lib_start_trace(int argc, VALUE *argv, VALUE self)
+{
+    VALUE vsize;
+    long size = RBTK_TRACE_DEFAULT_SIZE;
+
+    if (rb_scan_args(argc, argv, "01", &vsize) == 1 && !NIL_P(vsize)) {
+        size = NUM2LONG(vsize);
+        if (size <= 0) {
+            rb_raise(rb_eArgError, "trace size must be positive number");
+        }
+    }
+
+    if (rbtk_trace_buf == NULL || rbtk_trace_size != (unsigned long)size) {
+        rbtk_trace_mode = 0;
+        if (rbtk_trace_buf) xfree(rbtk_trace_buf);
+        rbtk_trace_buf = ALLOC_N(struct rbtk_trace_event, size);
+        rbtk_trace_size = (unsigned long)size;
+    }
+    rbtk_trace_count = 0;
+    rbtk_trace_mode = 1;
+
+    return Qtrue;
+}
+
+static VALUE
+lib_stop_trace(VALUE self)
+{
+    rbtk_trace_mode = 0;
+
+    return Qnil;
+}
+
+static VALUE
+lib_clear_trace(VALUE self)
+{
+    rbtk_trace_count = 0;
+
+    return Qnil;
+}
+
+static void
+rbtk_trace_json_str(VALUE str, const char *p)
+{
+    char buf[8];
+
+    rb_str_cat2(str, "\"");
+    for(; *p; p++) {
+        switch(*p) {
+        case '"':  rb_str_cat2(str, "\\\""); break;
+        case '\\': rb_str_cat2(str, "\\\\"); break;
+        default:
+            if ((unsigned char)*p < 0x20) {
+                snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)*p);
+                rb_str_cat2(str, buf);
+            } else {
+                rb_str_cat(str, p, 1);
+            }
+        }
+    }
+    rb_str_cat2(str, "\"");
+}
+
+/* trace in Chrome trace event format (load it to chrome://tracing) */
+static VALUE
+lib_trace_json(VALUE self)
+{
+    volatile VALUE str = rb_str_new2("{\"traceEvents\":[");
+    unsigned long i, start, count;
+    struct rbtk_trace_event *ev;
+    char buf[128];
+    long pid = (long)getpid();
+
+    if (rbtk_trace_buf != NULL) {
+        count = rbtk_trace_count;
+        start = (count > rbtk_trace_size)? count - rbtk_trace_size: 0;
+        for(i = start; i < count; i++) {
+            ev = rbtk_trace_buf + (i % rbtk_trace_size);
+            if (i != start) rb_str_cat2(str, ",");
+            rb_str_cat2(str, "\n{\"name\":");
+            rbtk_trace_json_str(str, ev->name);
+            snprintf(buf, sizeof(buf),
+                     ",\"ph\":\"%c\",\"ts\":%" TCL_LL_MODIFIER "d,"
+                     "\"pid\":%ld,\"tid\":%lu",
+                     ev->phase, ev->ts, pid,
+                     (unsigned long)(size_t)ev->thread);
+            rb_str_cat2(str, buf);
+            if (ev->detail[0]) {
+                rb_str_cat2(str, ",\"args\":{\"detail\":");
+                rbtk_trace_json_str(str, ev->detail);
+                rb_str_cat2(str, "}");
+            }
+            rb_str_cat2(str, "}");
+        }
+    }
+    rb_str_cat2(str, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+    return str;
+}
+
 static VALUE
 set_max_block_time(VALUE self, VALUE time)
 {
@@ -1081,53 +2030,185 @@ void
 rbtk_EventSetupProc(ClientData clientData, int flag)
 {
     Tcl_Time tcl_time;
+
+    if (RBTK_NOGVL_P()) {
+        /* the GVL is released : block until an event arrives */
+        return;
+    }
+
     tcl_time.sec  = 0;
-    tcl_time.usec = 1000L * (long)no_event_tick;
+    if (evq_completion_uncollected > 0) {
+        /* don't block the GVL : a caller thread is waking up */
+        tcl_time.usec = 0;
+    } else {
+        tcl_time.usec = 1000L * (long)no_event_tick;
+    }
     Tcl_SetMaxBlockTime(&tcl_time);
 }
 
 void
 rbtk_EventCheckProc(ClientData clientData, int flag)
 {
+    /* the end of the wait for events */
+    if (eventloop_stats_mode) eventloop_stats_wakeup = rbtk_monotonic_usec();
+
+    if (RBTK_NOGVL_P()) {
+        /* other threads are running already */
+        return;
+    }
+    if (eventloop_stats_mode) eventloop_stats.thread_schedules++;
     rb_thread_schedule();
 }
 
+struct nogvl_DoOneEvent_param {
+    Tcl_ThreadId thread;
+    int flag;
+    int found;
+};
 
-static VALUE
-call_DoOneEvent_core(VALUE flag_val, RB_UNUSED_VAR(int argc), RB_UNUSED_VAR(VALUE *argv))
+static void *
+call_DoOneEvent_nogvl(void *arg)
 {
-    int flag;
+    struct nogvl_DoOneEvent_param *param
+        = (struct nogvl_DoOneEvent_param *)arg;
 
-    flag = FIX2INT(flag_val);
-    if (Tcl_DoOneEvent(flag)) {
-        return Qtrue;
-    } else {
-        return Qfalse;
-    }
+    param->found = Tcl_DoOneEvent(param->flag);
+    return NULL;
 }
 
-static VALUE
-call_DoOneEvent(VALUE flag_val)
+static int
+eventloop_wakeup_handler(Tcl_Event *evPtr, int flags)
 {
-  return tk_funcall(call_DoOneEvent_core, 0, (VALUE*)NULL, flag_val);
+    /* do nothing : only to return from Tcl_DoOneEvent */
+    return 1;
 }
 
+static void
+call_DoOneEvent_unblock(void *arg)
+{
+    struct nogvl_DoOneEvent_param *param
+        = (struct nogvl_DoOneEvent_param *)arg;
+    Tcl_Event *evPtr;
 
-#define TRAP_CHECK() do { \
-    if (trap_check(check_var) == 0) return 0; \
-} while (0)
+    /* Tcl_ThreadAlert only may not break the waiting loop of
+       Tcl_DoOneEvent. So, queue an event which does nothing. */
+    evPtr = (Tcl_Event *)ckalloc(sizeof(Tcl_Event));
+    evPtr->proc = eventloop_wakeup_handler;
+    Tcl_ThreadQueueEvent(param->thread, evPtr, TCL_QUEUE_HEAD);
+    Tcl_ThreadAlert(param->thread);
+}
 
 static int
-trap_check(int *check_var)
+nogvl_DoOneEvent(int flag)
 {
-    DUMP1("trap check");
+    struct nogvl_DoOneEvent_param param;
+    Tcl_ThreadId blocking = eventloop_nogvl_thread;
 
-#ifdef RUBY_VM
-    if (rb_thread_check_trap_pending()) {
-	if (check_var != (int*)NULL) {
-	    /* wait command */
-	    return 0;
-	}
+    /* at first, process a ready event with the GVL */
+    if (Tcl_DoOneEvent(flag | TCL_DONT_WAIT)) {
+        return 1;
+    }
+
+    param.thread = Tcl_GetCurrentThread();
+    param.flag = flag;
+    param.found = 0;
+
+    /* not rb_thread_call_without_gvl : it may raise before restoring */
+    eventloop_nogvl_thread = param.thread;
+    rb_thread_call_without_gvl2(call_DoOneEvent_nogvl, (void *)&param,
+                                call_DoOneEvent_unblock, (void *)&param);
+    eventloop_nogvl_thread = blocking;
+
+    /* a jump out of a call with the GVL (not across the Tcl frames) */
+    if (rbtk_pending_jump_tag) {
+        int tag = rbtk_pending_jump_tag;
+
+        rbtk_pending_jump_tag = 0;
+        rb_jump_tag(tag);
+    }
+
+    rb_thread_check_ints();
+
+    return param.found;
+}
+
+static int
+DoOneEvent_with_stats(int flag)
+{
+    struct rbtk_thread_data *tsd = RBTK_THREAD_DATA();
+    Tcl_WideInt start, usec;
+    int found;
+
+    start = rbtk_monotonic_usec();
+    eventloop_stats_wakeup = 0;
+
+    tsd->dispatching++;
+    if (eventloop_nogvl && !(flag & TCL_DONT_WAIT)) {
+        found = nogvl_DoOneEvent(flag);
+    } else {
+        found = Tcl_DoOneEvent(flag);
+    }
+    tsd->dispatching--;
+
+    eventloop_stats.do_one_event_calls++;
+    if (found) {
+        /* not include the time waiting for the event */
+        if (eventloop_stats_wakeup > start) start = eventloop_stats_wakeup;
+        usec = rbtk_monotonic_usec() - start;
+        eventloop_stats.events++;
+        eventloop_stats.dispatch_usec += usec;
+        rbtk_histogram_add(&eventloop_stats.event_hist, usec);
+    }
+
+    return found;
+}
+
+static VALUE
+call_DoOneEvent_core(VALUE flag_val, RB_UNUSED_VAR(int argc), RB_UNUSED_VAR(VALUE *argv))
+{
+    int flag;
+    int found;
+
+    flag = FIX2INT(flag_val);
+    RBTK_TRACE_BEGIN("DoOneEvent", NULL, 0);
+    if (eventloop_stats_mode) {
+        found = DoOneEvent_with_stats(flag);
+    } else if (eventloop_nogvl && !(flag & TCL_DONT_WAIT)) {
+        found = nogvl_DoOneEvent(flag);
+    } else {
+        found = Tcl_DoOneEvent(flag);
+    }
+    RBTK_TRACE_END("DoOneEvent");
+
+    if (found) {
+        return Qtrue;
+    } else {
+        return Qfalse;
+    }
+}
+
+static VALUE
+call_DoOneEvent(VALUE flag_val)
+{
+  return tk_funcall(call_DoOneEvent_core, 0, (VALUE*)NULL, flag_val);
+}
+
+
+#define TRAP_CHECK() do { \
+    if (trap_check(check_var) == 0) return 0; \
+} while (0)
+
+static int
+trap_check(int *check_var)
+{
+    DUMP1("trap check");
+
+#ifdef RUBY_VM
+    if (rb_thread_check_trap_pending()) {
+	if (check_var != (int*)NULL) {
+	    /* wait command */
+	    return 0;
+	}
 	else {
 	    rb_thread_check_ints();
 	}
@@ -1160,6 +2241,64 @@ check_eventloop_interp(void)
   return 0;
 }
 
+/*
+ *  Budget of the update loop ('update_within' command).
+ *  'update_deadline' is a time of the monotonic clock (usec).
+ *  If 0, then the update loop processes all events.
+ *  It is one for the process, and is saved and restored by each frame :
+ *  a nested 'update_within' keeps the budget of the outer one, and a
+ *  nested plain 'update' (e.g. in a callback) runs without a budget.
+ */
+static Tcl_WideInt update_deadline = 0;
+static int update_budget_exhausted = 0;
+
+static int
+update_deadline_passed(void)
+{
+    if (update_deadline == 0) return 0;
+
+    if (rbtk_monotonic_usec() < update_deadline) return 0;
+
+    DUMP1("update budget is exhausted");
+    update_budget_exhausted = 1;
+    return 1;
+}
+
+/* feedback of one term of thread scheduling (adaptive weight) */
+static void
+eventloop_adapt(Tcl_WideInt term, int events, int no_events)
+{
+    int target = eventloop_adaptive_target;
+    int pending = evq_ring_depth();
+
+    if (term > target) {
+        /* other threads wait too long : multiplicative decrease */
+        event_loop_max /= 2;
+        if (event_loop_max < ADAPTIVE_EVENT_LOOP_MIN) {
+            event_loop_max = ADAPTIVE_EVENT_LOOP_MIN;
+        }
+    } else if (term < target / 2 && events > no_events) {
+        /* busy and the term is short : additive increase */
+        event_loop_max += ADAPTIVE_EVENT_LOOP_STEP;
+        if (event_loop_max > ADAPTIVE_EVENT_LOOP_LIMIT) {
+            event_loop_max = ADAPTIVE_EVENT_LOOP_LIMIT;
+        }
+    }
+
+    if (pending > 0) {
+        /* requests are waiting : don't block long with the GVL */
+        no_event_tick /= 2;
+        if (no_event_tick < 1) no_event_tick = 1;
+    } else if (no_events > events
+               && (no_event_tick + 1) * 1000 <= target) {
+        /* idle : give other threads the turn sooner */
+        no_event_tick++;
+    }
+
+    DUMP3("adaptive weight : loop_max %d, no_event_tick %d",
+          event_loop_max, no_event_tick);
+}
+
 static int
 lib_eventloop_core(int check_root, int update_flag, int *check_var, Tcl_Interp *interp)
 {
@@ -1173,7 +2312,7 @@ lib_eventloop_core(int check_root, int update_flag, int *check_var, Tcl_Interp *
 
     Tcl_DeleteTimerHandler(timer_token);
     run_timer_flag = 0;
-    if (timer_tick > 0) {
+    if (timer_tick > 0 && !eventloop_nogvl) {
         timer_token = Tcl_CreateTimerHandler(timer_tick, _timer_for_tcl,
                                              (ClientData)0);
     } else {
@@ -1183,6 +2322,8 @@ lib_eventloop_core(int check_root, int update_flag, int *check_var, Tcl_Interp *
     for(;;) {
         if (check_eventloop_interp()) return 0;
 
+        if (eventloop_stats_mode) eventloop_stats.iterations++;
+
         if (rb_thread_alone()) {
             DUMP1("no other thread");
             event_loop_wait_event = 0;
@@ -1195,7 +2336,7 @@ lib_eventloop_core(int check_root, int update_flag, int *check_var, Tcl_Interp *
 	        /* event_flag = TCL_ALL_EVENTS | TCL_DONT_WAIT; */
             }
 
-            if (timer_tick == 0 && update_flag == 0) {
+            if (timer_tick == 0 && update_flag == 0 && !eventloop_nogvl) {
                 timer_tick = NO_THREAD_INTERRUPT_TIME;
                 timer_token = Tcl_CreateTimerHandler(timer_tick,
                                                      _timer_for_tcl,
@@ -1263,6 +2404,7 @@ lib_eventloop_core(int check_root, int update_flag, int *check_var, Tcl_Interp *
 
             if (update_flag != 0) {
               if (found_event) {
+                if (update_deadline_passed()) return 0;
                 DUMP1("next update loop");
                 continue;
               } else {
@@ -1288,6 +2430,8 @@ lib_eventloop_core(int check_root, int update_flag, int *check_var, Tcl_Interp *
 
         } else {
             int tick_counter;
+            int term_events, term_no_events;
+            Tcl_WideInt term_start = 0;
 
             DUMP1("there are other threads");
             event_loop_wait_event = 1;
@@ -1304,6 +2448,10 @@ lib_eventloop_core(int check_root, int update_flag, int *check_var, Tcl_Interp *
 
             timer_tick = req_timer_tick;
             tick_counter = 0;
+            term_events = term_no_events = 0;
+            if (eventloop_adaptive_target > 0) {
+                term_start = rbtk_monotonic_usec();
+            }
             while(tick_counter < event_loop_max) {
                 if (check_var != (int *)NULL) {
                     if (*check_var || !found_event) {
@@ -1399,6 +2547,10 @@ lib_eventloop_core(int check_root, int update_flag, int *check_var, Tcl_Interp *
 
                     if (st) {
                         tick_counter++;
+                        term_events++;
+                        if (update_flag != 0 && update_deadline_passed()) {
+                            return 0;
+                        }
                     } else {
                         if (update_flag != 0) {
                             DUMP1("update complete");
@@ -1406,6 +2558,7 @@ lib_eventloop_core(int check_root, int update_flag, int *check_var, Tcl_Interp *
                         }
 
                         tick_counter += no_event_tick;
+                        term_no_events++;
                     }
 
                 } else {
@@ -1443,7 +2596,13 @@ lib_eventloop_core(int check_root, int update_flag, int *check_var, Tcl_Interp *
                 }
             }
 
+            if (eventloop_adaptive_target > 0 && term_start != 0) {
+                eventloop_adapt(rbtk_monotonic_usec() - term_start,
+                                term_events, term_no_events);
+            }
+
             DUMP1("thread scheduling");
+            if (eventloop_stats_mode) eventloop_stats.thread_schedules++;
             rb_thread_schedule();
         }
 
@@ -1972,15 +3131,259 @@ TkStringValue(VALUE obj)
     return rb_funcallv(obj, ID_inspect, 0, 0);
 }
 
+/*
+ *  Jank detector of Ruby callbacks (TclTkLib.set_callback_jank_threshold).
+ *  A callback which runs longer than the threshold is recorded to the
+ *  jank log (and is passed to the hook). The watchdog thread sleeps
+ *  until a callback starts (tcl_protect_core wakes it), and takes the
+ *  backtrace of the thread when the callback goes over the threshold.
+ *  A watchdog which has seen no callback for JANK_WATCHDOG_IDLE exits,
+ *  so that an idle eventloop goes back to the single thread mode.
+ *  'rbtk_callback_objc/objv' is the command line of the callback and
+ *  'rbtk_callback_id' is its callback id (or NULL), which are set by
+ *  tcl_protect_callback.
+ */
+#define JANK_LOG_MAX 100
+#define JANK_WATCHDOG_IDLE 1000000L /* usec */
+
+static int jank_threshold = 0;      /* usec (0 : not detect) */
+static VALUE jank_log;              /* Array of Hash */
+static VALUE jank_hook;             /* called with the Hash */
+static VALUE jank_watchdog;
+static Tcl_WideInt jank_watchdog_wake_at = 0; /* 0 : until woken */
+static Tcl_WideInt jank_start = 0;  /* of the running callback */
+static VALUE jank_thread;
+static VALUE jank_backtrace;
+static int rbtk_callback_objc = 0;
+static Tcl_Obj *CONST *rbtk_callback_objv = (Tcl_Obj *CONST *)NULL;
+static Tcl_Obj *rbtk_callback_id = (Tcl_Obj *)NULL;
+
+static void
+jank_watchdog_sleep(Tcl_WideInt usec)
+{
+    struct timeval t;
+
+    t.tv_sec  = (long)(usec / 1000000L);
+    t.tv_usec = (long)(usec % 1000000L);
+    rb_thread_wait_for(t);
+}
+
+static VALUE
+jank_watchdog_body(void *arg)
+{
+    Tcl_WideInt start, now, seen = 0;
+    Tcl_WideInt idle_since = rbtk_monotonic_usec();
+
+    while(jank_threshold > 0) {
+        start = jank_start;
+        now = rbtk_monotonic_usec();
+
+        if (start == 0 || start == seen) {
+            /* no callback to watch : sleep until one starts */
+            if (start == 0 && now - idle_since >= JANK_WATCHDOG_IDLE) break;
+            if (start != 0) idle_since = now;
+            jank_watchdog_wake_at = 0;
+            jank_watchdog_sleep(JANK_WATCHDOG_IDLE);
+            continue;
+        }
+
+        idle_since = now;
+        if (now - start < jank_threshold) {
+            jank_watchdog_wake_at = start + jank_threshold;
+            jank_watchdog_sleep(start + jank_threshold - now);
+            continue;
+        }
+
+        if (jank_start == start && NIL_P(jank_backtrace)) {
+            DUMP1("jank watchdog : take backtrace of the slow callback");
+            jank_backtrace = rb_funcall(jank_thread, ID_backtrace, 0);
+        }
+        seen = start;
+    }
+
+    jank_watchdog_wake_at = 0;
+    jank_watchdog = Qnil;
+    return Qnil;
+}
+
+static VALUE
+jank_watchdog_start(VALUE arg)
+{
+    jank_watchdog = rb_thread_create(jank_watchdog_body, (void*)NULL);
+    return Qnil;
+}
+
+/* a callback is started at 'start' (called by tcl_protect_core) */
+static void
+jank_watchdog_wakeup(Tcl_WideInt start)
+{
+    int state;
+
+    if (NIL_P(jank_watchdog) || !RTEST(rb_thread_alive_p(jank_watchdog))) {
+        rb_protect(jank_watchdog_start, Qnil, &state);
+        if (state) {
+            rb_warning("fail to start the callback jank watchdog (ignore)");
+            rb_set_errinfo(Qnil);
+        }
+    } else if (jank_watchdog_wake_at == 0
+               || jank_watchdog_wake_at > start + jank_threshold) {
+        rb_thread_wakeup_alive(jank_watchdog);
+    }
+}
+
+static VALUE
+jank_call_hook(VALUE info)
+{
+    return rb_funcall(jank_hook, ID_call, 1, info);
+}
+
+static void
+jank_report(Tcl_WideInt usec, int objc, Tcl_Obj *CONST objv[], Tcl_Obj *cb_id)
+{
+    volatile VALUE info = rb_hash_new();
+    volatile VALUE id = Qnil;
+    volatile VALUE cmdline = Qnil;
+    int state;
+
+    if (objc > 0) {
+        Tcl_Obj *list = Tcl_NewListObj(objc, objv);
+        Tcl_Size len;
+        char *str;
+
+        Tcl_IncrRefCount(list);
+        str = Tcl_GetStringFromObj(list, &len);
+        cmdline = rb_str_new(str, len);
+        Tcl_DecrRefCount(list);
+    }
+    if (cb_id != (Tcl_Obj *)NULL) {
+        id = rb_str_new2(Tcl_GetString(cb_id));
+    }
+
+    rb_hash_aset(info, ID2SYM(rb_intern("id")), id);
+    rb_hash_aset(info, ID2SYM(rb_intern("command")), cmdline);
+    rb_hash_aset(info, ID2SYM(rb_intern("time")),
+                 rb_float_new((double)usec / 1000000.0));
+    rb_hash_aset(info, ID2SYM(rb_intern("backtrace")), jank_backtrace);
+
+    rb_ary_push(jank_log, info);
+    if (RARRAY_LEN(jank_log) > JANK_LOG_MAX) rb_ary_shift(jank_log);
+
+    if (!NIL_P(jank_hook)) {
+        rb_protect(jank_call_hook, info, &state);
+        if (state) {
+            rb_warning("exception in the callback jank hook (ignore)");
+            rb_set_errinfo(Qnil);
+        }
+    }
+}
+
+static VALUE
+set_callback_jank_threshold(VALUE self, VALUE threshold)
+{
+    double msec;
+
+    if (!RTEST(threshold)) {
+        volatile VALUE watchdog = jank_watchdog;
+
+        jank_threshold = 0;
+        if (!NIL_P(watchdog) && watchdog != rb_thread_current()) {
+            rb_thread_wakeup_alive(watchdog);
+            rb_funcall(watchdog, ID_join, 0);
+        }
+        return threshold;
+    }
+
+    msec = NUM2DBL(threshold);
+    if (msec <= 0) {
+        rb_raise(rb_eArgError, "threshold must be positive number");
+    }
+    jank_threshold = (int)(msec * 1000.0);
+
+    /* the watchdog is started by the next callback */
+    if (!NIL_P(jank_watchdog)) rb_thread_wakeup_alive(jank_watchdog);
+
+    return threshold;
+}
+
+static VALUE
+get_callback_jank_threshold(VALUE self)
+{
+    if (jank_threshold > 0) {
+        return rb_float_new((double)jank_threshold / 1000.0);
+    } else {
+        return Qnil;
+    }
+}
+
+static VALUE
+set_callback_jank_hook(VALUE self, VALUE hook)
+{
+    jank_hook = hook;
+    return hook;
+}
+
+static VALUE
+lib_callback_jank_log(VALUE self)
+{
+    return rb_ary_dup(jank_log);
+}
+
+static VALUE
+lib_clear_callback_jank_log(VALUE self)
+{
+    rb_ary_clear(jank_log);
+    return Qnil;
+}
+
 static int
 tcl_protect_core(Tcl_Interp *interp, VALUE (*proc)(VALUE), VALUE data)  /* should not raise exception */
 {
     volatile VALUE ret, exc = Qnil;
     int status = 0;
+    struct rbtk_thread_data *tsd = RBTK_THREAD_DATA();
+    int outermost = (tsd->callback_depth == 0);
+    /* one callback at a time is watched */
+    int jank = (outermost && jank_threshold > 0 && NIL_P(jank_thread));
+    int objc = rbtk_callback_objc;
+    Tcl_Obj *CONST *objv = rbtk_callback_objv;
+    Tcl_Obj *cb_id = rbtk_callback_id;
+    Tcl_WideInt start = 0;
 
     Tcl_ResetResult(interp);
 
+    /* time of the outermost callback (eventloop_stats, jank detector) */
+    if (outermost && (eventloop_stats_mode || jank)) {
+        start = rbtk_monotonic_usec();
+    }
+    if (jank) {
+        jank_thread = rb_thread_current();
+        jank_backtrace = Qnil;
+        jank_start = start;
+        jank_watchdog_wakeup(start);
+    }
+    tsd->callback_depth++;
+    RBTK_TRACE_BEGIN("callback", NULL, 0);
     ret = rb_protect(proc, data, &status);
+    RBTK_TRACE_END("callback");
+    tsd->callback_depth--;
+    if (start != 0) {
+        Tcl_WideInt usec = rbtk_monotonic_usec() - start;
+
+        if (eventloop_stats_mode) {
+            eventloop_stats.callbacks++;
+            eventloop_stats.callback_usec += usec;
+            if (tsd->dispatching) {
+                eventloop_stats.dispatch_callback_usec += usec;
+            }
+            rbtk_histogram_add(&eventloop_stats.callback_hist, usec);
+        }
+        if (jank) {
+            jank_start = 0;
+            if (usec >= jank_threshold) jank_report(usec, objc, objv, cb_id);
+            jank_thread = Qnil;
+            jank_backtrace = Qnil;
+        }
+    }
     if (status) {
         char *buf;
         volatile VALUE type, str;
@@ -2144,6 +3547,32 @@ tcl_protect(Tcl_Interp *interp, VALUE (*proc)(VALUE), VALUE data)
     return code;
 }
 
+/* tcl_protect of a callback with its command line and callback id */
+static int
+tcl_protect_callback(
+    Tcl_Interp *interp,
+    VALUE (*proc)(VALUE),
+    VALUE data,
+    int objc,
+    Tcl_Obj *CONST objv[],
+    Tcl_Obj *cb_id)
+{
+    int code;
+    int outer_objc = rbtk_callback_objc;
+    Tcl_Obj *CONST *outer_objv = rbtk_callback_objv;
+    Tcl_Obj *outer_id = rbtk_callback_id;
+
+    rbtk_callback_objc = objc;
+    rbtk_callback_objv = objv;
+    rbtk_callback_id = cb_id;
+    code = tcl_protect(interp, proc, data);
+    rbtk_callback_objc = outer_objc;
+    rbtk_callback_objv = outer_objv;
+    rbtk_callback_id = outer_id;
+
+    return code;
+}
+
 static int
 ip_ruby_eval(
     ClientData clientData,
@@ -2154,6 +3583,8 @@ ip_ruby_eval(
     char *arg;
     int code;
 
+    RBTK_OBJCMD_WITH_GVL(ip_ruby_eval, clientData, interp, argc, argv);
+
     if (interp == (Tcl_Interp*)NULL) {
         rbtk_pending_exception = rb_exc_new2(rb_eRuntimeError,
                                              "IP is deleted");
@@ -2187,7 +3618,8 @@ ip_ruby_eval(
     /* evaluate the argument string by ruby */
     DUMP2("rb_eval_string(%s)", arg);
 
-    code = tcl_protect(interp, (VALUE (*)(VALUE))rb_eval_string, (VALUE)arg);
+    code = tcl_protect_callback(interp, (VALUE (*)(VALUE))rb_eval_string,
+                                (VALUE)arg, argc, argv, (Tcl_Obj *)NULL);
 
     xfree(arg);
     /* ckfree(arg); */
@@ -2267,6 +3699,8 @@ ip_ruby_cmd(
     struct cmd_body_arg *arg;
     int code;
 
+    RBTK_OBJCMD_WITH_GVL(ip_ruby_cmd, clientData, interp, argc, argv);
+
     if (interp == (Tcl_Interp*)NULL) {
         rbtk_pending_exception = rb_exc_new2(rb_eRuntimeError,
                                              "IP is deleted");
@@ -2320,7 +3754,11 @@ ip_ruby_cmd(
     arg->args = args;
 
     /* evaluate the argument string by ruby */
-    code = tcl_protect(interp, ip_ruby_cmd_core, (VALUE)arg);
+    /* (ruby_cmd TkCore callback <id> ... : callback of Tk) */
+    code = tcl_protect_callback(interp, ip_ruby_cmd_core, (VALUE)arg,
+                                argc, argv,
+                                (argc > 3 && method == ID_callback)?
+                                argv[3]: (Tcl_Obj *)NULL);
 
     xfree(arg);
     /* ckfree((char*)arg); */
@@ -2331,62 +3769,241 @@ ip_ruby_cmd(
 }
 
 
-/*****************************/
-/* relpace of 'exit' command */
-/*****************************/
-static int
-ip_InterpExitObjCmd(
-    ClientData clientData,
-    Tcl_Interp *interp,
-    int argc,
-    Tcl_Obj *CONST argv[])
+/*******************************************/
+/* native Tcl command of a Ruby callback   */
+/* (TclTkIp#_create_callback_command)      */
+/*******************************************/
+/*
+ *  "<name> <id> args..." calls entry.call(*args) directly. The entry is
+ *  held by the ClientData of the command, and is marked by the GC
+ *  through the list of the commands. When 'callback_dispatcher' is not
+ *  nil (e.g. profiling of TkCore callbacks), it is called with
+ *  (id, *args) instead.
+ */
+struct rbtk_callback_cmd {
+    VALUE entry;
+    struct rbtk_callback_cmd *prev;
+    struct rbtk_callback_cmd *next;
+};
+
+static struct rbtk_callback_cmd rbtk_callback_cmds = {
+    Qnil, &rbtk_callback_cmds, &rbtk_callback_cmds
+};
+static VALUE rbtk_callback_cmds_marker;
+static VALUE callback_dispatcher;
+
+static void
+rbtk_callback_cmds_mark(void *p)
 {
-    DUMP1("start ip_InterpExitCommand");
-    if (interp != (Tcl_Interp*)NULL
-        && !Tcl_InterpDeleted(interp)
-#if TCL_NAMESPACE_DEBUG
-        && !ip_null_namespace(interp)
-#endif
-        ) {
-        Tcl_ResetResult(interp);
-        /* Tcl_Preserve(interp); */
-        /* Tcl_Eval(interp, "interp eval {} {destroy .}; interp delete {}"); */
-	if (!Tcl_InterpDeleted(interp)) {
-	  ip_finalize(interp);
+    struct rbtk_callback_cmd *list = (struct rbtk_callback_cmd *)p;
+    struct rbtk_callback_cmd *cmd;
 
-	  Tcl_DeleteInterp(interp);
-	  Tcl_Release(interp);
-	}
+    for(cmd = list->next; cmd != list;
+        cmd = cmd->next) {
+        rb_gc_mark(cmd->entry);
     }
-    return TCL_OK;
+}
+
+static const rb_data_type_t rbtk_callback_cmds_type = {
+    "tcltklib/callback_commands",
+    {rbtk_callback_cmds_mark, 0, 0,},
+};
+
+static void
+ip_callback_cmd_delete(ClientData clientData)
+{
+    struct rbtk_callback_cmd *cmd = (struct rbtk_callback_cmd *)clientData;
+
+    if (RBTK_NOGVL_P()) {
+        /* the list must not be changed while the GC marks it */
+        rbtk_call_with_gvl(ip_callback_cmd_delete, (void *)clientData);
+        return;
+    }
+
+    DUMP1("delete callback command");
+    /* unlink only (no Ruby object is touched) */
+    cmd->prev->next = cmd->next;
+    cmd->next->prev = cmd->prev;
+    xfree(cmd);
 }
 
 static int
-ip_RubyExitObjCmd(
+ip_callback_cmd(
     ClientData clientData,
     Tcl_Interp *interp,
     int argc,
     Tcl_Obj *CONST argv[])
 {
-    int state;
-    char *cmd, *param;
+    struct rbtk_callback_cmd *cmd = (struct rbtk_callback_cmd *)clientData;
+    struct cmd_body_arg arg;
+    volatile VALUE args;
+    char *str;
+    int i, first;
+    Tcl_Size len;  /* Tcl 9 uses Tcl_Size for string lengths */
 
-    DUMP1("start ip_RubyExitCommand");
+    RBTK_OBJCMD_WITH_GVL(ip_callback_cmd, clientData, interp, argc, argv);
 
-    /* cmd = Tcl_GetString(argv[0]); */
-    cmd = Tcl_GetStringFromObj(argv[0], TCL_SIZE_NULL);
+    if (interp == (Tcl_Interp*)NULL) {
+        rbtk_pending_exception = rb_exc_new2(rb_eRuntimeError,
+                                             "IP is deleted");
+        return TCL_ERROR;
+    }
 
-    if (argc < 1 || argc > 2) {
-        /* argument error */
-        Tcl_AppendResult(interp,
-                         "wrong number of arguments: should be \"",
-                         cmd, " ?returnCode?\"", (char *)NULL);
+    if (argc < 2) {
+        Tcl_ResetResult(interp);
+        Tcl_AppendResult(interp, "too few arguments", (char *)NULL);
+        rbtk_pending_exception = rb_exc_new2(rb_eArgError,
+                                             Tcl_GetStringResult(interp));
         return TCL_ERROR;
     }
 
-    if (interp == (Tcl_Interp*)NULL) return TCL_OK;
+    if (NIL_P(callback_dispatcher)) {
+        arg.receiver = cmd->entry;
+        first = 2;
+    } else {
+        arg.receiver = callback_dispatcher;
+        first = 1;  /* with id */
+    }
+    arg.method = ID_call;
 
-    Tcl_ResetResult(interp);
+    args = rb_ary_new2(argc - first);
+    for(i = first; i < argc; i++) {
+        str = Tcl_GetStringFromObj(argv[i], &len);
+        rb_ary_push(args, rb_str_new(str, len));
+    }
+    arg.args = args;
+
+    return tcl_protect_callback(interp, ip_ruby_cmd_core, (VALUE)&arg,
+                                argc, argv, argv[1]);
+}
+
+static VALUE
+ip_create_callback_command_core(VALUE interp, int argc, VALUE *argv)
+{
+    struct tcltkip *ptr = get_ip(interp);
+    struct rbtk_callback_cmd *cmd;
+
+    if (deleted_ip(ptr)) return Qnil;
+
+    cmd = ALLOC(struct rbtk_callback_cmd);
+    cmd->entry = argv[1];
+    cmd->prev = &rbtk_callback_cmds;
+    cmd->next = rbtk_callback_cmds.next;
+    rbtk_callback_cmds.next->prev = cmd;
+    rbtk_callback_cmds.next = cmd;
+
+    DUMP2("Tcl_CreateObjCommand(\"%s\")", RSTRING_PTR(argv[0]));
+    Tcl_CreateObjCommand(ptr->ip, RSTRING_PTR(argv[0]), ip_callback_cmd,
+                         (ClientData)cmd, ip_callback_cmd_delete);
+
+    return argv[0];
+}
+
+/* _create_callback_command(name, entry) */
+static VALUE
+ip_create_callback_command(VALUE self, VALUE name, VALUE entry)
+{
+    VALUE argv[2];
+
+    StringValueCStr(name);
+    argv[0] = name;
+    argv[1] = entry;
+
+    return tk_funcall(ip_create_callback_command_core, 2, argv, self);
+}
+
+static VALUE
+ip_delete_callback_command_core(VALUE interp, int argc, VALUE *argv)
+{
+    struct tcltkip *ptr = get_ip(interp);
+
+    if (deleted_ip(ptr)) return Qfalse;
+
+    return (Tcl_DeleteCommand(ptr->ip, RSTRING_PTR(argv[0])) == 0)?
+           Qtrue: Qfalse;
+}
+
+/* _delete_callback_command(name) */
+static VALUE
+ip_delete_callback_command(VALUE self, VALUE name)
+{
+    VALUE argv[1];
+
+    StringValueCStr(name);
+    argv[0] = name;
+
+    return tk_funcall(ip_delete_callback_command_core, 1, argv, self);
+}
+
+/* _set_callback_dispatcher(proc) : called with (id, *args) if not nil */
+static VALUE
+lib_set_callback_dispatcher(VALUE self, VALUE dispatcher)
+{
+    callback_dispatcher = dispatcher;
+    return dispatcher;
+}
+
+
+/*****************************/
+/* relpace of 'exit' command */
+/*****************************/
+static int
+ip_InterpExitObjCmd(
+    ClientData clientData,
+    Tcl_Interp *interp,
+    int argc,
+    Tcl_Obj *CONST argv[])
+{
+    RBTK_OBJCMD_WITH_GVL(ip_InterpExitObjCmd, clientData, interp, argc, argv);
+
+    DUMP1("start ip_InterpExitCommand");
+    if (interp != (Tcl_Interp*)NULL
+        && !Tcl_InterpDeleted(interp)
+#if TCL_NAMESPACE_DEBUG
+        && !ip_null_namespace(interp)
+#endif
+        ) {
+        Tcl_ResetResult(interp);
+        /* Tcl_Preserve(interp); */
+        /* Tcl_Eval(interp, "interp eval {} {destroy .}; interp delete {}"); */
+	if (!Tcl_InterpDeleted(interp)) {
+	  ip_finalize(interp);
+
+	  Tcl_DeleteInterp(interp);
+	  Tcl_Release(interp);
+	}
+    }
+    return TCL_OK;
+}
+
+static int
+ip_RubyExitObjCmd(
+    ClientData clientData,
+    Tcl_Interp *interp,
+    int argc,
+    Tcl_Obj *CONST argv[])
+{
+    int state;
+    char *cmd, *param;
+
+    RBTK_OBJCMD_WITH_GVL(ip_RubyExitObjCmd, clientData, interp, argc, argv);
+
+    DUMP1("start ip_RubyExitCommand");
+
+    /* cmd = Tcl_GetString(argv[0]); */
+    cmd = Tcl_GetStringFromObj(argv[0], TCL_SIZE_NULL);
+
+    if (argc < 1 || argc > 2) {
+        /* argument error */
+        Tcl_AppendResult(interp,
+                         "wrong number of arguments: should be \"",
+                         cmd, " ?returnCode?\"", (char *)NULL);
+        return TCL_ERROR;
+    }
+
+    if (interp == (Tcl_Interp*)NULL) return TCL_OK;
+
+    Tcl_ResetResult(interp);
 
     if (Tcl_IsSafe(interp)) {
 	if (!Tcl_InterpDeleted(interp)) {
@@ -2444,6 +4061,53 @@ ip_RubyExitObjCmd(
 /*********************/
 /* replace of update */
 /*********************/
+/* run the update loop and check the result */
+static int
+ip_rbUpdate_eventloop(Tcl_Interp *interp, int flags)
+{
+    Tcl_Preserve(interp);
+
+    /* call eventloop */
+    /* ret = lib_eventloop_core(0, flags, (int *)NULL);*/ /* ignore result */
+    lib_eventloop_launcher(0, flags, (int *)NULL, interp); /* ignore result */
+
+    /* exception check */
+    if (!NIL_P(rbtk_pending_exception)) {
+        Tcl_Release(interp);
+
+        /*
+        if (rb_obj_is_kind_of(rbtk_pending_exception, rb_eSystemExit)) {
+        */
+        if (rb_obj_is_kind_of(rbtk_pending_exception, rb_eSystemExit)
+            || rb_obj_is_kind_of(rbtk_pending_exception, rb_eInterrupt)) {
+            return TCL_RETURN;
+        } else{
+            return TCL_ERROR;
+        }
+    }
+
+    /* trap check */
+    if (rb_thread_check_trap_pending()) {
+        Tcl_Release(interp);
+
+        return TCL_RETURN;
+    }
+
+    /*
+     * Must clear the interpreter's result because event handlers could
+     * have executed commands.
+     */
+
+    DUMP2("last result '%s'", Tcl_GetStringResult(interp));
+    Tcl_ResetResult(interp);
+    Tcl_Release(interp);
+
+    DUMP1("finish Ruby's 'update'");
+    return TCL_OK;
+}
+
+
+
 static int
 ip_rbUpdateObjCmd(
     ClientData clientData,
@@ -2452,9 +4116,13 @@ ip_rbUpdateObjCmd(
     Tcl_Obj *CONST objv[])
 {
     int  flags = 0;
+    int  code;
+    Tcl_WideInt outer_deadline = update_deadline;
     static CONST char *updateOptions[] = {"idletasks", (char *) NULL};
     enum updateOptions {REGEXP_IDLETASKS};
 
+    RBTK_OBJCMD_WITH_GVL(ip_rbUpdateObjCmd, clientData, interp, objc, objv);
+
     DUMP1("Ruby's 'update' is called");
     if (interp == (Tcl_Interp*)NULL) {
         rbtk_pending_exception = rb_exc_new2(rb_eRuntimeError,
@@ -2494,45 +4162,115 @@ ip_rbUpdateObjCmd(
         return TCL_ERROR;
     }
 
-    Tcl_Preserve(interp);
+    /* not limited by the budget of an outer 'update_within' */
+    update_deadline = 0;
+    code = ip_rbUpdate_eventloop(interp, flags);
+    update_deadline = outer_deadline;
 
-    /* call eventloop */
-    /* ret = lib_eventloop_core(0, flags, (int *)NULL);*/ /* ignore result */
-    lib_eventloop_launcher(0, flags, (int *)NULL, interp); /* ignore result */
+    return code;
+}
 
-    /* exception check */
-    if (!NIL_P(rbtk_pending_exception)) {
-        Tcl_Release(interp);
+/*
+ * Tcl command handler for "update_within" - update with a time budget.
+ *
+ * Usage: update_within msec ?idletasks?
+ *   Processes events like "update" until no event remains or 'msec'
+ *   milliseconds (monotonic clock) have passed. The result is a list of
+ *   two elements : 1 if the budget was exhausted (events may remain),
+ *   else 0, and the rest of the budget in milliseconds (negative for an
+ *   overrun by the last event).
+ *
+ * Called from: Tk.update_within
+ */
+static int
+ip_rbUpdateWithinObjCmd(
+    ClientData clientData,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *CONST objv[])
+{
+    int  flags = TCL_DONT_WAIT;
+    double msec;
+    int code, exhausted;
+    Tcl_WideInt deadline;
+    Tcl_Obj *res[2];
+    Tcl_WideInt outer_deadline = update_deadline;
+    int outer_exhausted = update_budget_exhausted;
+    static CONST char *updateOptions[] = {"idletasks", (char *) NULL};
+    enum updateOptions {REGEXP_IDLETASKS};
 
-        /*
-        if (rb_obj_is_kind_of(rbtk_pending_exception, rb_eSystemExit)) {
-        */
-        if (rb_obj_is_kind_of(rbtk_pending_exception, rb_eSystemExit)
-            || rb_obj_is_kind_of(rbtk_pending_exception, rb_eInterrupt)) {
-            return TCL_RETURN;
-        } else{
+    RBTK_OBJCMD_WITH_GVL(ip_rbUpdateWithinObjCmd, clientData, interp,
+                         objc, objv);
+
+    DUMP1("Ruby's 'update_within' is called");
+    if (interp == (Tcl_Interp*)NULL) {
+        rbtk_pending_exception = rb_exc_new2(rb_eRuntimeError,
+                                             "IP is deleted");
+        return TCL_ERROR;
+    }
+
+    if (objc < 2 || objc > 3) {
+#ifdef Tcl_WrongNumArgs
+        Tcl_WrongNumArgs(interp, 1, objv, "msec [ idletasks ]");
+#else
+        Tcl_AppendResult(interp, "wrong number of arguments: should be \"",
+                         Tcl_GetStringFromObj(objv[0], TCL_SIZE_NULL),
+                         " msec [ idletasks ]\"",
+                         (char *) NULL);
+#endif
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetDoubleFromObj(interp, objv[1], &msec) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (msec < 0) {
+        Tcl_AppendResult(interp, "budget must be 0 or positive number",
+                         (char *) NULL);
+        return TCL_ERROR;
+    }
+
+    if (objc == 3) {
+        int  optionIndex;
+        if (Tcl_GetIndexFromObj(interp, objv[2], (CONST84 char **)updateOptions,
+                "option", 0, &optionIndex) != TCL_OK) {
             return TCL_ERROR;
         }
+        switch ((enum updateOptions) optionIndex) {
+            case REGEXP_IDLETASKS: {
+                flags = TCL_IDLE_EVENTS;
+                break;
+            }
+            default: {
+                rb_bug("ip_rbUpdateWithinObjCmd: bad option index to UpdateOptions");
+            }
+        }
     }
 
-    /* trap check */
-    if (rb_thread_check_trap_pending()) {
-        Tcl_Release(interp);
+    Tcl_ResetResult(interp);
 
-        return TCL_RETURN;
+    /* a nested update cannot go over the budget of the outer one */
+    deadline = rbtk_monotonic_usec() + (Tcl_WideInt)(msec * 1000.0);
+    if (deadline == 0) deadline = 1;
+    if (outer_deadline != 0 && outer_deadline < deadline) {
+        deadline = outer_deadline;
     }
+    update_deadline = deadline;
+    update_budget_exhausted = 0;
 
-    /*
-     * Must clear the interpreter's result because event handlers could
-     * have executed commands.
-     */
+    code = ip_rbUpdate_eventloop(interp, flags);
 
-    DUMP2("last result '%s'", Tcl_GetStringResult(interp));
-    Tcl_ResetResult(interp);
-    Tcl_Release(interp);
+    exhausted = update_budget_exhausted;
+    update_deadline = outer_deadline;
+    update_budget_exhausted = outer_exhausted || exhausted;
 
-    DUMP1("finish Ruby's 'update'");
-    return TCL_OK;
+    if (code == TCL_OK) {
+        res[0] = Tcl_NewIntObj(exhausted);
+        res[1] = Tcl_NewDoubleObj((double)(deadline - rbtk_monotonic_usec())
+                                  / 1000.0);
+        Tcl_SetObjResult(interp, Tcl_NewListObj(2, res));
+    }
+    return code;
 }
 
 
@@ -2553,7 +4291,7 @@ rb_threadUpdateProc(
 
     DUMP1("threadUpdateProc is called");
     param->done = 1;
-    rb_thread_wakeup(param->thread);
+    rbtk_thread_wakeup(param->thread);
 
     return;
 }
@@ -2571,9 +4309,14 @@ ip_rb_threadUpdateObjCmd(
     struct th_update_param *param;
     static CONST char *updateOptions[] = {"idletasks", (char *) NULL};
     enum updateOptions {REGEXP_IDLETASKS};
-    volatile VALUE current_thread = rb_thread_current();
+    volatile VALUE current_thread;
     struct timeval t;
 
+    RBTK_OBJCMD_WITH_GVL(ip_rb_threadUpdateObjCmd, clientData, interp,
+                         objc, objv);
+
+    current_thread = rb_thread_current();
+
     DUMP1("Ruby's 'thread_update' is called");
     if (interp == (Tcl_Interp*)NULL) {
         rbtk_pending_exception = rb_exc_new2(rb_eRuntimeError,
@@ -2692,6 +4435,8 @@ ip_rbVwaitObjCmd(
     char *nameString;
     Tcl_Size dummy;  /* Tcl 9 uses Tcl_Size for string lengths */
 
+    RBTK_OBJCMD_WITH_GVL(ip_rbVwaitObjCmd, clientData, interp, objc, objv);
+
     DUMP1("Ruby's 'vwait' is called");
     if (interp == (Tcl_Interp*)NULL) {
         rbtk_pending_exception = rb_exc_new2(rb_eRuntimeError,
@@ -2869,6 +4614,8 @@ ip_rbTkWaitObjCmd(
     int ret;
     Tcl_Size dummy;  /* Tcl 9 uses Tcl_Size for string lengths */
 
+    RBTK_OBJCMD_WITH_GVL(ip_rbTkWaitObjCmd, clientData, interp, objc, objv);
+
     DUMP1("Ruby's 'tkwait' is called");
     if (interp == (Tcl_Interp*)NULL) {
         rbtk_pending_exception = rb_exc_new2(rb_eRuntimeError,
@@ -3110,7 +4857,7 @@ rb_threadVwaitProc(
     } else {
         param->done = 1;
     }
-    if (param->done != 0) rb_thread_wakeup(param->thread);
+    if (param->done != 0) rbtk_thread_wakeup(param->thread);
 
     return (char *)NULL;
 }
@@ -3132,7 +4879,7 @@ rb_threadWaitVisibilityProc(
     if (eventPtr->type == DestroyNotify) {
         param->done = TKWAIT_MODE_DESTROY;
     }
-    if (param->done != 0) rb_thread_wakeup(param->thread);
+    if (param->done != 0) rbtk_thread_wakeup(param->thread);
 }
 
 static void
@@ -3146,7 +4893,7 @@ rb_threadWaitWindowProc(
     if (eventPtr->type == DestroyNotify) {
         param->done = TKWAIT_MODE_DESTROY;
     }
-    if (param->done != 0) rb_thread_wakeup(param->thread);
+    if (param->done != 0) rbtk_thread_wakeup(param->thread);
 }
 
 static int
@@ -3160,9 +4907,14 @@ ip_rb_threadVwaitObjCmd(
     char *nameString;
     int ret;
     Tcl_Size dummy;  /* Tcl 9 uses Tcl_Size for string lengths */
-    volatile VALUE current_thread = rb_thread_current();
+    volatile VALUE current_thread;
     struct timeval t;
 
+    RBTK_OBJCMD_WITH_GVL(ip_rb_threadVwaitObjCmd, clientData, interp,
+                         objc, objv);
+
+    current_thread = rb_thread_current();
+
     DUMP1("Ruby's 'thread_vwait' is called");
     if (interp == (Tcl_Interp*)NULL) {
         rbtk_pending_exception = rb_exc_new2(rb_eRuntimeError,
@@ -3263,9 +5015,14 @@ ip_rb_threadTkWaitObjCmd(
     char *nameString;
     int ret;
     Tcl_Size dummy;  /* Tcl 9 uses Tcl_Size for string lengths */
-    volatile VALUE current_thread = rb_thread_current();
+    volatile VALUE current_thread;
     struct timeval t;
 
+    RBTK_OBJCMD_WITH_GVL(ip_rb_threadTkWaitObjCmd, clientData, interp,
+                         objc, objv);
+
+    current_thread = rb_thread_current();
+
     DUMP1("Ruby's 'thread_tkwait' is called");
     if (interp == (Tcl_Interp*)NULL) {
         rbtk_pending_exception = rb_exc_new2(rb_eRuntimeError,
@@ -3825,6 +5582,11 @@ ip_replace_wait_commands(Tcl_Interp *interp, Tk_Window mainWin)
     DUMP1("Tcl_CreateObjCommand(\"thread_update\")");
     Tcl_CreateObjCommand(interp, "thread_update", ip_rb_threadUpdateObjCmd,
                          (ClientData)mainWin, (Tcl_CmdDeleteProc *)NULL);
+
+    /* add 'update_within' command */
+    DUMP1("Tcl_CreateObjCommand(\"update_within\")");
+    Tcl_CreateObjCommand(interp, "update_within", ip_rbUpdateWithinObjCmd,
+                         (ClientData)mainWin, (Tcl_CmdDeleteProc *)NULL);
 }
 
 
@@ -3839,6 +5601,9 @@ ip_rb_replaceSlaveTkCmdsObjCmd(
     Tcl_Interp *slave;
     Tk_Window mainWin;
 
+    RBTK_OBJCMD_WITH_GVL(ip_rb_replaceSlaveTkCmdsObjCmd, clientData, interp,
+                         objc, objv);
+
     if (objc != 2) {
 #ifdef Tcl_WrongNumArgs
         Tcl_WrongNumArgs(interp, 1, objv, "slave_name");
@@ -3881,6 +5646,8 @@ ip_rbNamespaceObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Ob
     Tcl_CmdInfo info;
     int ret;
 
+    RBTK_OBJCMD_WITH_GVL(ip_rbNamespaceObjCmd, clientData, interp, objc, objv);
+
     DUMP1("call ip_rbNamespaceObjCmd");
     DUMP2("objc = %d", objc);
     DUMP2("objv[0] = '%s'", Tcl_GetString(objv[0]));
@@ -3960,11 +5727,22 @@ ip_wrap_namespace_command(Tcl_Interp *interp)
  * Called from: Tcl internal deletion mechanism (set via Tcl_CallWhenDeleted)
  * Tested by: test/test_multi_interp.rb (interpreter destruction path)
  */
+static void
+ip_finalize_with_gvl(void *ip)
+{
+    ip_finalize((Tcl_Interp *)ip);
+}
+
 static void
 ip_CallWhenDeleted(ClientData clientData, Tcl_Interp *ip)
 {
     /* Tk_Window main_win = (Tk_Window) clientData; */
 
+    if (RBTK_NOGVL_P()) {
+        rbtk_call_with_gvl(ip_finalize_with_gvl, (void *)ip);
+        return;
+    }
+
     DUMP1("start ip_CallWhenDeleted");
 
     ip_finalize(ip);
@@ -3997,6 +5775,8 @@ ip_init(int argc, VALUE *argv, VALUE self)
     ptr->ref_count = 0;
     ptr->allow_ruby_exit = 1;
     ptr->return_value = 0;
+    ptr->obj_cache = (Tcl_HashTable *)NULL;
+    ptr->eval_cache = (struct rbtk_eval_cache *)NULL;
 
     /* from Tk_Main() */
     DUMP1("Tcl_CreateInterp");
@@ -4198,6 +5978,8 @@ ip_create_slave_core(VALUE interp, int argc, VALUE *argv)
     slave->ref_count = 0;
     slave->allow_ruby_exit = 0;
     slave->return_value = 0;
+    slave->obj_cache = (Tcl_HashTable *)NULL;
+    slave->eval_cache = (struct rbtk_eval_cache *)NULL;
 
     slave->ip = Tcl_CreateSlave(master->ip, StringValueCStr(name), safe);
     if (slave->ip == NULL) {
@@ -4577,96 +6359,501 @@ get_obj_from_str(VALUE str)
     }
 }
 
+static void check_list_value(VALUE val);
+
+/*
+ * Integer, Float and Array arguments become typed Tcl_Objs directly,
+ * without a string representation which Tcl would parse again.
+ */
 static VALUE
-ip_get_result_string_obj(Tcl_Interp *interp)
+check_list_value_i(VALUE val, VALUE dummy, int recur)
 {
-    Tcl_Obj *retObj;
-    volatile VALUE strval;
+    long i;
 
-    retObj = Tcl_GetObjResult(interp);
-    Tcl_IncrRefCount(retObj);
-    strval = get_str_from_obj(retObj);
-    Tcl_ResetResult(interp);
-    Tcl_DecrRefCount(retObj);
-    return strval;
-}
+    if (recur) {
+        rb_raise(rb_eArgError, "recursive array");
+    }
 
-static int
-call_queue_handler(Tcl_Event *evPtr, int flags)
-{
-    struct call_queue *q = (struct call_queue *)evPtr;
+    for(i = 0; i < RARRAY_LEN(val); i++) {
+        VALUE elem = RARRAY_AREF(val, i);
+
+        switch(TYPE(elem)) {
+        case T_FIXNUM:
+        case T_BIGNUM:
+        case T_FLOAT:
+        case T_SYMBOL:
+            break;
+        case T_ARRAY:
+            check_list_value(elem);
+            break;
+        default:
+            /* raise before any Tcl_Obj of the list is created */
+            StringValueCStr(elem);
+        }
+    }
+    return Qnil;
+}
+
+static void
+check_list_value(VALUE val)
+{
+    rb_exec_recursive(check_list_value_i, val, 0);
+}
+
+static Tcl_Obj *get_list_obj(VALUE ary);
+
+static Tcl_Obj *
+get_obj_from_value(VALUE val)
+{
+    switch(TYPE(val)) {
+    case T_FIXNUM:
+        return Tcl_NewWideIntObj((Tcl_WideInt)FIX2LONG(val));
+
+    case T_BIGNUM:
+        if (rb_absint_numwords(val, 63, NULL) <= 1) {
+            return Tcl_NewWideIntObj((Tcl_WideInt)NUM2LL(val));
+        }
+        /* Tcl makes a bignum from the string */
+        return get_obj_from_str(rb_big2str(val, 10));
+
+    case T_FLOAT:
+        return Tcl_NewDoubleObj(RFLOAT_VALUE(val));
+
+    case T_ARRAY:
+        check_list_value(val);
+        return get_list_obj(val);
+
+    case T_SYMBOL:
+        return get_obj_from_str(rb_sym2str(val));
+
+    default:
+        return get_obj_from_str(val);
+    }
+}
+
+static Tcl_Obj *
+get_list_obj(VALUE ary)
+{
+    Tcl_Obj *listobj = Tcl_NewListObj(0, NULL);
+    long i;
+
+    for(i = 0; i < RARRAY_LEN(ary); i++) {
+        VALUE elem = RARRAY_AREF(ary, i);
+
+        Tcl_ListObjAppendElement(NULL, listobj,
+                                 RB_TYPE_P(elem, T_ARRAY)
+                                 ? get_list_obj(elem)
+                                 : get_obj_from_value(elem));
+    }
+    return listobj;
+}
+
+static VALUE
+ip_get_result_string_obj(Tcl_Interp *interp)
+{
+    Tcl_Obj *retObj;
+    volatile VALUE strval;
+
+    retObj = Tcl_GetObjResult(interp);
+    Tcl_IncrRefCount(retObj);
+    strval = get_str_from_obj(retObj);
+    Tcl_ResetResult(interp);
+    Tcl_DecrRefCount(retObj);
+    return strval;
+}
+
+/* result modes of TclTkIp#_invoke_typed */
+#define RBTK_RESULT_STRING        0
+#define RBTK_RESULT_INT           1
+#define RBTK_RESULT_FLOAT         2
+#define RBTK_RESULT_LIST          3
+#define RBTK_RESULT_LIST_OF_INT   4
+#define RBTK_RESULT_LIST_OF_FLOAT 5
+#define RBTK_RESULT_DICT          6
+
+static const char * const rbtk_result_mode_names[] = {
+    "string", "int", "float", "list", "list_of_int", "list_of_float", "dict"
+};
+
+static int
+ip_result_mode(VALUE mode)
+{
+    int i;
+
+    if (RB_TYPE_P(mode, T_SYMBOL)) {
+        const char *name = rb_id2name(SYM2ID(mode));
+        for(i = 0; i <= RBTK_RESULT_DICT; i++) {
+            if (strcmp(name, rbtk_result_mode_names[i]) == 0) return i;
+        }
+    }
+    rb_raise(rb_eArgError, "unknown result mode %+"PRIsVALUE, mode);
+
+    UNREACHABLE_RETURN(RBTK_RESULT_STRING);
+}
+
+/* Qundef if the object is not an integer */
+static VALUE
+get_int_from_obj(Tcl_Obj *obj)
+{
+    Tcl_WideInt wide;
+    const char *s;
+    Tcl_Size len;
+
+    if (Tcl_GetWideIntFromObj(NULL, obj, &wide) == TCL_OK) {
+        return LL2NUM(wide);
+    }
+
+    /* too large for a wide int? */
+    s = Tcl_GetStringFromObj(obj, &len);
+    if (len > 0 && (*s == '-' || *s == '+')) {
+        s++; len--;
+    }
+    if (len == 0 || (Tcl_Size)strspn(s, "0123456789") != len) return Qundef;
+
+    return rb_cstr2inum(Tcl_GetString(obj), 10);
+}
+
+/* Qundef if the object is not a number */
+static VALUE
+get_float_from_obj(Tcl_Obj *obj)
+{
+    double d;
+
+    if (Tcl_GetDoubleFromObj(NULL, obj, &d) != TCL_OK) return Qundef;
+    return DBL2NUM(d);
+}
+
+/*
+ * Convert the result by the internal rep of the result object, without
+ * parsing its string form again on the Ruby side.
+ */
+static VALUE
+ip_get_result_typed(VALUE interp, Tcl_Interp *ip, int mode)
+{
+    Tcl_Obj *retObj, **elems, *key, *value;
+    Tcl_Size i, n;
+    Tcl_DictSearch search;
+    int done;
+    volatile VALUE ret, elem;
+
+    if (mode == RBTK_RESULT_STRING) {
+        return ip_get_result_string_obj(ip);
+    }
+
+    retObj = Tcl_GetObjResult(ip);
+    Tcl_IncrRefCount(retObj);
+    Tcl_ResetResult(ip);
+
+    switch(mode) {
+    case RBTK_RESULT_INT:
+        ret = get_int_from_obj(retObj);
+        break;
+
+    case RBTK_RESULT_FLOAT:
+        ret = get_float_from_obj(retObj);
+        break;
+
+    case RBTK_RESULT_LIST:
+    case RBTK_RESULT_LIST_OF_INT:
+    case RBTK_RESULT_LIST_OF_FLOAT:
+        if (Tcl_ListObjGetElements(NULL, retObj, &n, &elems) != TCL_OK) {
+            ret = Qundef;
+            break;
+        }
+        ret = rb_ary_new2(n);
+        for(i = 0; i < n; i++) {
+            if (mode == RBTK_RESULT_LIST) {
+                elem = get_str_from_obj(elems[i]);
+            } else if (mode == RBTK_RESULT_LIST_OF_INT) {
+                elem = get_int_from_obj(elems[i]);
+            } else {
+                elem = get_float_from_obj(elems[i]);
+            }
+            if (elem == Qundef) {
+                ret = Qundef;
+                break;
+            }
+            rb_ary_push(ret, elem);
+        }
+        break;
+
+    case RBTK_RESULT_DICT:
+        if (Tcl_DictObjFirst(NULL, retObj, &search,
+                             &key, &value, &done) != TCL_OK) {
+            ret = Qundef;
+            break;
+        }
+        ret = rb_hash_new();
+        for(; !done; Tcl_DictObjNext(&search, &key, &value, &done)) {
+            rb_hash_aset(ret, get_str_from_obj(key), get_str_from_obj(value));
+        }
+        Tcl_DictObjDone(&search);
+        break;
+
+    default:
+        ret = Qundef;
+    }
+
+    if (ret == Qundef) {
+        ret = create_ip_exc(interp, rb_eTypeError,
+                            "expected %s result but got \"%s\"",
+                            rbtk_result_mode_names[mode],
+                            Tcl_GetString(retObj));
+    }
+
+    Tcl_DecrRefCount(retObj);
+    return ret;
+}
+
+/*
+ *  Submission ring for requests from the other threads.
+ *  A bounded lock-free queue (multi-producer, single-consumer) of the
+ *  request events to the owner thread (the first thread which receives
+ *  requests; usually the Tk thread). Producers queue one drain event
+ *  (and alert the owner) per batch instead of one Tcl event per request.
+ *  The drain event runs the requests in order on the owner thread.
+ */
+#ifndef EVQ_RING_SIZE
+#define EVQ_RING_SIZE 1024  /* must be a power of 2 */
+#endif
+#define EVQ_RING_MASK (EVQ_RING_SIZE - 1)
+#define EVQ_RING_LOAD(var) RUBY_ATOMIC_FETCH_ADD(var, 0)
+
+struct evq_ring_cell {
+    rb_atomic_t seq;
+    Tcl_Event *ev;
+};
+
+static struct evq_ring_cell evq_ring[EVQ_RING_SIZE];
+static rb_atomic_t evq_ring_tail = 0;         /* producer side */
+static rb_atomic_t evq_ring_head = 0;         /* consumer side */
+static rb_atomic_t evq_ring_drain_pending = 0;
+static Tcl_ThreadId evq_ring_owner = (Tcl_ThreadId) 0;
+
+static void
+evq_ring_init(void)
+{
+    int i;
+
+    for(i = 0; i < EVQ_RING_SIZE; i++) {
+        evq_ring[i].seq = (rb_atomic_t)i;
+        evq_ring[i].ev = (Tcl_Event*)NULL;
+    }
+}
+
+static Tcl_Event *
+evq_ring_pop(void)
+{
+    rb_atomic_t pos = evq_ring_head;
+    struct evq_ring_cell *cell = &(evq_ring[pos & EVQ_RING_MASK]);
+    Tcl_Event *ev;
+
+    if (EVQ_RING_LOAD(cell->seq) != pos + 1) {
+        /* empty (or the producer is still writing the cell) */
+        return (Tcl_Event*)NULL;
+    }
+
+    ev = cell->ev;
+    cell->ev = (Tcl_Event*)NULL;
+    RUBY_ATOMIC_SET(cell->seq, pos + EVQ_RING_SIZE);
+    evq_ring_head = pos + 1;
+
+    return ev;
+}
+
+static int
+evq_ring_drain_handler(Tcl_Event *evPtr, int flags)
+{
+    rb_atomic_t last;
+    Tcl_Event *ev;
+
+    RBTK_EVENTPROC_WITH_GVL(evq_ring_drain_handler, evPtr, flags);
+
+    DUMP1("drain the submission ring");
+
+    /* requests pushed from now on are drained by the next drain event */
+    RUBY_ATOMIC_SET(evq_ring_drain_pending, 0);
+    last = EVQ_RING_LOAD(evq_ring_tail);
+
+    if (eventloop_stats_mode
+        && (int)(last - evq_ring_head) > eventloop_stats.queue_depth_max) {
+        eventloop_stats.queue_depth_max = (int)(last - evq_ring_head);
+    }
+
+    RBTK_TRACE_BEGIN("evq_ring_drain_handler", NULL, 0);
+    while((int)(last - evq_ring_head) > 0
+          && (ev = evq_ring_pop()) != (Tcl_Event*)NULL) {
+        if ((ev->proc)(ev, flags)) {
+            evq_record_free(ev);
+        } else {
+            /* not processed : retry later */
+            Tcl_QueueEvent(ev, TCL_QUEUE_TAIL);
+        }
+    }
+    RBTK_TRACE_END("evq_ring_drain_handler");
+
+    /* end of handler : remove it */
+    return 1;
+}
+
+/* returns 0 if the request cannot be pushed (not owner or full) */
+static int
+evq_ring_push(Tcl_ThreadId target, Tcl_Event *evPtr)
+{
+    struct evq_ring_cell *cell;
+    Tcl_Event *drain;
+    rb_atomic_t pos;
+    int diff;
+
+    if (evq_ring_owner == (Tcl_ThreadId) 0) evq_ring_owner = target;
+    if (evq_ring_owner != target) return 0;
+
+    pos = EVQ_RING_LOAD(evq_ring_tail);
+    for(;;) {
+        cell = &(evq_ring[pos & EVQ_RING_MASK]);
+        diff = (int)(EVQ_RING_LOAD(cell->seq) - pos);
+        if (diff == 0) {
+            if (RUBY_ATOMIC_CAS(evq_ring_tail, pos, pos + 1) == pos) break;
+        } else if (diff < 0) {
+            DUMP1("submission ring is full");
+            return 0;
+        }
+        pos = EVQ_RING_LOAD(evq_ring_tail);
+    }
+
+    cell->ev = evPtr;
+    RUBY_ATOMIC_SET(cell->seq, pos + 1);
+
+    if (RUBY_ATOMIC_CAS(evq_ring_drain_pending, 0, 1) == 0) {
+        /* allocate memory (freed by Tcl_ServiceEvent) */
+        drain = RbTk_ALLOC_N(Tcl_Event, 1);
+        drain->proc = evq_ring_drain_handler;
+        Tcl_ThreadQueueEvent(target, drain, TCL_QUEUE_TAIL);
+        Tcl_ThreadAlert(target);
+    }
+
+    return 1;
+}
+
+/* number of requests in the submission ring */
+static int
+evq_ring_depth(void)
+{
+    return (int)(EVQ_RING_LOAD(evq_ring_tail) - evq_ring_head);
+}
+
+/* the thread which processes the requests to the interpreter (or 0) */
+static Tcl_ThreadId
+evq_queue_target(struct tcltkip *ptr)
+{
+    if (ptr && ptr->tk_thread_id) {
+        return ptr->tk_thread_id;
+    } else {
+        return tk_eventloop_thread_id;
+    }
+}
+
+/* queue a request event to the thread of the interpreter */
+static void
+evq_queue_event(struct tcltkip *ptr, Tcl_Event *evPtr,
+                Tcl_QueuePosition position)
+{
+    Tcl_ThreadId target = evq_queue_target(ptr);
+
+    DUMP1("add handler");
+    if (target) {
+      if (position == TCL_QUEUE_TAIL && target != Tcl_GetCurrentThread()
+          && evq_ring_push(target, evPtr)) {
+          return;
+      }
+      Tcl_ThreadQueueEvent(target, evPtr, position);
+      Tcl_ThreadAlert(target);
+    } else {
+      Tcl_QueueEvent(evPtr, position);
+    }
+}
+
+/* the arguments of a call_queue (a 'temp' copy when not inline) */
+static void
+call_queue_free_argv(struct call_queue *q)
+{
+    if (q->argv && q->argv != q->argv_buf) {
+        int i;
+        for(i = 0; i < q->argc; i++) { q->argv[i] = (VALUE)NULL; }
+
+        ckfree((char*)q->argv);
+    }
+    q->argv = (VALUE*)NULL;
+}
+
+static int
+call_queue_handler(Tcl_Event *evPtr, int flags)
+{
+    struct call_queue *q = (struct call_queue *)evPtr;
     volatile VALUE ret;
     volatile VALUE thread = q->thread;
     struct tcltkip *ptr;
 
+    RBTK_EVENTPROC_WITH_GVL(call_queue_handler, evPtr, flags);
+
     DUMP2("do_call_queue_handler : evPtr = %p", evPtr);
     DUMP2("call_queue_handler thread : %"PRIxVALUE, rb_thread_current());
     DUMP2("added by thread : %"PRIxVALUE, thread);
 
-    if (*(q->done)) {
+    if (q->done->state) {
         DUMP1("processed by another event-loop");
         return 0;
     } else {
         DUMP1("process it on current event-loop");
     }
 
-    if (RTEST(rb_thread_alive_p(thread))
-	&& ! RTEST(rb_funcall(thread, ID_stop_p, 0))) {
-      DUMP1("caller is not yet ready to receive the result -> pending");
-      return 0;
-    }
-
     /* process it */
-    *(q->done) = 1;
+    q->done->state = 1;
 
     /* deleted ipterp ? */
     ptr = get_ip(q->interp);
     if (deleted_ip(ptr)) {
-        /* deleted IP --> ignore */
+        /* deleted IP --> ignore (but release the caller) */
+        if (q->done->abandoned) call_queue_free_argv(q);
+        evq_completion_signal(q->done);
         return 1;
     }
 
     /* incr internal handler mark */
     rbtk_internal_eventloop_handler++;
+    RBTK_TRACE_BEGIN("call_queue_handler", NULL, 0);
 
     DUMP2("call function (for caller thread:%"PRIxVALUE")", thread);
     DUMP2("call function (current thread:%"PRIxVALUE")", rb_thread_current());
     ret = (q->func)(q->interp, q->argc, q->argv);
 
+    /* the caller gave up : nobody waits to free the arguments */
+    if (q->done->abandoned) call_queue_free_argv(q);
+
     /* set result */
-    RARRAY_ASET(q->result, 0, ret);
+    q->done->result = ret;
     ret = (VALUE)NULL;
 
     /* decr internal handler mark */
+    RBTK_TRACE_END("call_queue_handler");
     rbtk_internal_eventloop_handler--;
 
-    /* complete */
-    *(q->done) = -1;
-
     /* unlink ruby objects */
     q->argv = (VALUE*)NULL;
     q->interp = (VALUE)NULL;
-    q->result = (VALUE)NULL;
     q->thread = (VALUE)NULL;
 
-    /* back to caller */
-    if (RTEST(rb_thread_alive_p(thread))) {
-      DUMP2("back to caller (caller thread:%"PRIxVALUE")", thread);
-      DUMP2("               (current thread:%"PRIxVALUE")", rb_thread_current());
+    /* complete : back to caller (it is sleeping on the completion) */
+    DUMP2("back to caller (caller thread:%"PRIxVALUE")", thread);
+    DUMP2("               (current thread:%"PRIxVALUE")", rb_thread_current());
 #if CONTROL_BY_STATUS_OF_RB_THREAD_WAITING_FOR_VALUE
-      have_rb_thread_waiting_for_value = 1;
-      rb_thread_wakeup(thread);
-#else
-      rb_thread_run(thread);
+    have_rb_thread_waiting_for_value = 1;
 #endif
-      DUMP1("finish back to caller");
+    evq_completion_signal(q->done);
 #if DO_THREAD_SCHEDULE_AT_CALLBACK_DONE
-      rb_thread_schedule();
+    rb_thread_schedule(); /* pass the GVL to the caller */
 #endif
-    } else {
-      DUMP2("caller is dead (caller thread:%"PRIxVALUE")", thread);
-      DUMP2("               (current thread:%"PRIxVALUE")", rb_thread_current());
-    }
+    DUMP1("finish back to caller");
 
     /* end of handler : remove it */
     return 1;
@@ -4678,17 +6865,19 @@ call_queue_handler(Tcl_Event *evPtr, int flags)
  * Tested by: test/test_threading.rb#test_thread_tcl_eval
  */
 static VALUE
-tk_funcall(VALUE (*func)(VALUE, int, VALUE *), int argc, VALUE *argv, VALUE obj)
+tk_funcall_with_position(VALUE (*func)(VALUE, int, VALUE *),
+                         int argc, VALUE *argv, VALUE obj,
+                         Tcl_QueuePosition position)
 {
     struct call_queue *callq;
     struct tcltkip *ptr;
-    int  *alloc_done;
+    struct evq_completion *alloc_done;
     int  is_tk_evloop_thread;
     volatile VALUE current = rb_thread_current();
     volatile VALUE ip_obj = obj;
     volatile VALUE result;
     volatile VALUE ret;
-    struct timeval t;
+    int status;
 
     if (!NIL_P(ip_obj) && rb_obj_is_kind_of(ip_obj, tcltkip_class)) {
         ptr = get_ip(ip_obj);
@@ -4724,85 +6913,54 @@ tk_funcall(VALUE (*func)(VALUE, int, VALUE *), int argc, VALUE *argv, VALUE obj)
 
     DUMP2("tk_funcall from thread %"PRIxVALUE" (NOT current eventloop)", current);
 
+    /* allocate memory (freed by Tcl_ServiceEvent) */
+    callq = (struct call_queue *)evq_record_alloc();
+
     /* allocate memory (argv cross over thread : must be in heap) */
     if (argv) {
-        /* VALUE *temp = ALLOC_N(VALUE, argc); */
-        VALUE *temp = RbTk_ALLOC_N(VALUE, argc);
-        MEMCPY(temp, argv, VALUE, argc);
-        argv = temp;
+        if (argc <= CALL_QUEUE_INLINE_ARGC) {
+            MEMCPY(callq->argv_buf, argv, VALUE, argc);
+            argv = (VALUE*)NULL;
+            callq->argv = callq->argv_buf;
+        } else {
+            /* VALUE *temp = ALLOC_N(VALUE, argc); */
+            VALUE *temp = RbTk_ALLOC_N(VALUE, argc);
+            MEMCPY(temp, argv, VALUE, argc);
+            argv = temp;
+            callq->argv = argv;
+        }
     }
 
     /* allocate memory (keep result) */
-    /* alloc_done = (int*)ALLOC(int); */
-    alloc_done = RbTk_ALLOC_N(int, 1);
-    *alloc_done = 0;
-
-    /* allocate memory (freed by Tcl_ServiceEvent) */
-    /* callq = (struct call_queue *)Tcl_Alloc(sizeof(struct call_queue)); */
-    callq = RbTk_ALLOC_N(struct call_queue, 1);
-
-    /* allocate result obj */
-    result = rb_ary_new3(1, Qnil);
+    alloc_done = evq_completion_new();
 
     /* construct event data */
     callq->done = alloc_done;
     callq->func = func;
     callq->argc = argc;
-    callq->argv = argv;
     callq->interp = ip_obj;
-    callq->result = result;
     callq->thread = current;
     callq->ev.proc = call_queue_handler;
 
     /* add the handler to Tcl event queue */
-    DUMP1("add handler");
-    if (ptr && ptr->tk_thread_id) {
-      /* Tcl_ThreadQueueEvent(ptr->tk_thread_id,
-			   &(callq->ev), TCL_QUEUE_HEAD); */
-      Tcl_ThreadQueueEvent(ptr->tk_thread_id,
-			   (Tcl_Event*)callq, TCL_QUEUE_HEAD);
-      Tcl_ThreadAlert(ptr->tk_thread_id);
-    } else if (tk_eventloop_thread_id) {
-      /* Tcl_ThreadQueueEvent(tk_eventloop_thread_id,
-			   &(callq->ev), TCL_QUEUE_HEAD); */
-      Tcl_ThreadQueueEvent(tk_eventloop_thread_id,
-			   (Tcl_Event*)callq, TCL_QUEUE_HEAD);
-      Tcl_ThreadAlert(tk_eventloop_thread_id);
-    } else {
-      /* Tcl_QueueEvent(&(callq->ev), TCL_QUEUE_HEAD); */
-      Tcl_QueueEvent((Tcl_Event*)callq, TCL_QUEUE_HEAD);
-    }
+    evq_queue_event(ptr, (Tcl_Event*)callq, position);
 
     /* wait for the handler to be processed */
-    t.tv_sec  = 0;
-    t.tv_usec = (long)((EVENT_HANDLER_TIMEOUT)*1000.0);
-
     DUMP2("callq wait for handler (current thread:%"PRIxVALUE")", current);
-    while(*alloc_done >= 0) {
-      DUMP2("*** callq wait for handler (current thread:%"PRIxVALUE")", current);
-      /* rb_thread_stop(); */
-      /* rb_thread_sleep_forever(); */
-      rb_thread_wait_for(t);
-      DUMP2("*** callq wakeup (current thread:%"PRIxVALUE")", current);
-      DUMP2("***            (eventloop thread:%"PRIxVALUE")", eventloop_thread);
-      if (NIL_P(eventloop_thread)) {
-	DUMP1("*** callq lost eventloop thread");
-	break;
-      }
-    }
+    evq_completion_wait_sync(alloc_done, &status);
     DUMP2("back from handler (current thread:%"PRIxVALUE")", current);
 
     /* get result & free allocated memory */
-    ret = RARRAY_AREF(result, 0);
-    ckfree((char*)alloc_done);
+    ret = alloc_done->result;
     /* if (argv) free(argv); */
-    if (argv) {
+    if (evq_completion_release(alloc_done) && argv) {
       /* if argv != NULL, alloc as 'temp' */
       int i;
       for(i = 0; i < argc; i++) { argv[i] = (VALUE)NULL; }
 
       ckfree((char*)argv);
     }
+    if (status) rb_jump_tag(status);
 
 
     /* exception? */
@@ -4817,41 +6975,241 @@ tk_funcall(VALUE (*func)(VALUE, int, VALUE *), int argc, VALUE *argv, VALUE obj)
     return ret;
 }
 
-
-/* eval string in tcl by Tcl_Eval() */
-struct call_eval_info {
-    struct tcltkip *ptr;
-    Tcl_Obj *cmd;
-};
-
 static VALUE
-call_tcl_eval(VALUE arg)
+tk_funcall(VALUE (*func)(VALUE, int, VALUE *), int argc, VALUE *argv, VALUE obj)
 {
-    struct call_eval_info *inf = (struct call_eval_info *)arg;
-
-    Tcl_AllowExceptions(inf->ptr->ip);
-    inf->ptr->return_value = Tcl_EvalObj(inf->ptr->ip, inf->cmd);
-
-    return Qnil;
+    return tk_funcall_with_position(func, argc, argv, obj, TCL_QUEUE_HEAD);
 }
 
+
 /*
- * Core Tcl command evaluation.
- * Ruby method: TclTkIp#_eval
- * Tested by: test/test_threading.rb (round-trip eval tests)
+ * LRU cache of the script objects of TclTkIp#_eval. Tcl keeps the
+ * bytecode in the internal rep of a script object, so evaluating the
+ * same object again skips the compilation. Entries are keyed by the
+ * hash of the script and checked with its string. Only used on the
+ * thread of the interpreter (ip_eval_real).
  */
-static VALUE
-ip_eval_real(VALUE self, char *cmd_str, int cmd_len)
-{
-    volatile VALUE ret;
-    struct tcltkip *ptr = get_ip(self);
+#define RBTK_EVAL_CACHE_KEY "rbtk_eval_cache"
+#define RBTK_EVAL_CACHE_DEFAULT_SIZE 64
+#define RBTK_EVAL_CACHE_MAXLEN 16384
+
+struct rbtk_eval_entry {
+    Tcl_Obj *script;
+    Tcl_HashEntry *hentry;
+    struct rbtk_eval_entry *prev;   /* more recently used */
+    struct rbtk_eval_entry *next;   /* less recently used */
+};
+
+struct rbtk_eval_cache {
+    Tcl_HashTable table;            /* hash of script -> entry */
+    struct rbtk_eval_entry *head;   /* most recently used */
+    struct rbtk_eval_entry *tail;   /* least recently used */
+    long count;
+};
+
+static long rbtk_eval_cache_size = RBTK_EVAL_CACHE_DEFAULT_SIZE;
+static struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+} rbtk_eval_cache_stats;
+
+static void
+rbtk_eval_cache_unlink(struct rbtk_eval_cache *cache,
+                       struct rbtk_eval_entry *ent)
+{
+    if (ent->prev) ent->prev->next = ent->next; else cache->head = ent->next;
+    if (ent->next) ent->next->prev = ent->prev; else cache->tail = ent->prev;
+    ent->prev = ent->next = (struct rbtk_eval_entry *)NULL;
+}
+
+static void
+rbtk_eval_cache_push(struct rbtk_eval_cache *cache,
+                     struct rbtk_eval_entry *ent)
+{
+    ent->prev = (struct rbtk_eval_entry *)NULL;
+    ent->next = cache->head;
+    if (cache->head) cache->head->prev = ent; else cache->tail = ent;
+    cache->head = ent;
+}
+
+static void
+rbtk_eval_cache_remove(struct rbtk_eval_cache *cache,
+                       struct rbtk_eval_entry *ent)
+{
+    rbtk_eval_cache_unlink(cache, ent);
+    Tcl_DeleteHashEntry(ent->hentry);
+    Tcl_DecrRefCount(ent->script);
+    ckfree((char *)ent);
+    cache->count--;
+}
+
+static void
+rbtk_eval_cache_delete(ClientData clientData, Tcl_Interp *interp)
+{
+    struct rbtk_eval_cache *cache = (struct rbtk_eval_cache *)clientData;
+
+    while (cache->head) {
+        rbtk_eval_cache_remove(cache, cache->head);
+    }
+    Tcl_DeleteHashTable(&cache->table);
+    ckfree((char *)cache);
+}
+
+/* return a new reference of the script object */
+static Tcl_Obj *
+rbtk_eval_cache_get(struct tcltkip *ptr, const char *cmd_str, int cmd_len)
+{
+    struct rbtk_eval_cache *cache;
+    struct rbtk_eval_entry *ent;
+    Tcl_HashEntry *hentry;
+    Tcl_Obj *script;
+    const char *str;
+    Tcl_Size len;
+    int isnew;
+
+    if (rbtk_eval_cache_size <= 0 || cmd_len > RBTK_EVAL_CACHE_MAXLEN
+        || deleted_ip(ptr)) {
+        script = Tcl_NewStringObj(cmd_str, cmd_len);
+        Tcl_IncrRefCount(script);
+        return script;
+    }
+
+    cache = ptr->eval_cache;
+    if (cache == (struct rbtk_eval_cache *)NULL) {
+        cache = (struct rbtk_eval_cache *)Tcl_GetAssocData(ptr->ip,
+                                                       RBTK_EVAL_CACHE_KEY,
+                                                       NULL);
+        if (cache == (struct rbtk_eval_cache *)NULL) {
+            cache = (struct rbtk_eval_cache *)
+                ckalloc(sizeof(struct rbtk_eval_cache));
+            Tcl_InitHashTable(&cache->table, TCL_ONE_WORD_KEYS);
+            cache->head = cache->tail = (struct rbtk_eval_entry *)NULL;
+            cache->count = 0;
+            Tcl_SetAssocData(ptr->ip, RBTK_EVAL_CACHE_KEY,
+                             rbtk_eval_cache_delete, (ClientData)cache);
+        }
+        ptr->eval_cache = cache;
+    }
+
+    hentry = Tcl_CreateHashEntry(&cache->table,
+                                 (const char *)(uintptr_t)
+                                 rb_memhash(cmd_str, cmd_len),
+                                 &isnew);
+    if (!isnew) {
+        ent = (struct rbtk_eval_entry *)Tcl_GetHashValue(hentry);
+        str = Tcl_GetStringFromObj(ent->script, &len);
+        if (len == cmd_len && memcmp(str, cmd_str, cmd_len) == 0) {
+            rbtk_eval_cache_stats.hits++;
+            rbtk_eval_cache_unlink(cache, ent);
+            rbtk_eval_cache_push(cache, ent);
+            Tcl_IncrRefCount(ent->script);
+            return ent->script;
+        }
+
+        /* collision : replace the entry */
+        Tcl_DecrRefCount(ent->script);
+        rbtk_eval_cache_unlink(cache, ent);
+    } else {
+        while (cache->count >= rbtk_eval_cache_size && cache->tail) {
+            rbtk_eval_cache_remove(cache, cache->tail);
+            rbtk_eval_cache_stats.evictions++;
+        }
+        ent = (struct rbtk_eval_entry *)
+            ckalloc(sizeof(struct rbtk_eval_entry));
+        ent->hentry = hentry;
+        Tcl_SetHashValue(hentry, (ClientData)ent);
+        cache->count++;
+    }
+    rbtk_eval_cache_stats.misses++;
+
+    script = Tcl_NewStringObj(cmd_str, cmd_len);
+    Tcl_IncrRefCount(script);       /* for the cache */
+    ent->script = script;
+    rbtk_eval_cache_push(cache, ent);
+
+    Tcl_IncrRefCount(script);
+    return script;
+}
+
+static VALUE
+lib_set_eval_cache_size(VALUE self, VALUE size)
+{
+    long n = NUM2LONG(size);
+
+    if (n < 0) {
+        rb_raise(rb_eArgError, "cache size must not be negative");
+    }
+    rbtk_eval_cache_size = n;
+
+    return size;
+}
+
+static VALUE
+lib_get_eval_cache_size(VALUE self)
+{
+    return LONG2NUM(rbtk_eval_cache_size);
+}
+
+static VALUE
+lib_eval_cache_stats(VALUE self)
+{
+    volatile VALUE hash = rb_hash_new();
+
+    rb_hash_aset(hash, ID2SYM(rb_intern("size")),
+                 LONG2NUM(rbtk_eval_cache_size));
+    rb_hash_aset(hash, ID2SYM(rb_intern("hits")),
+                 ULONG2NUM(rbtk_eval_cache_stats.hits));
+    rb_hash_aset(hash, ID2SYM(rb_intern("misses")),
+                 ULONG2NUM(rbtk_eval_cache_stats.misses));
+    rb_hash_aset(hash, ID2SYM(rb_intern("evictions")),
+                 ULONG2NUM(rbtk_eval_cache_stats.evictions));
+
+    return hash;
+}
+
+static VALUE
+lib_reset_eval_cache_stats(VALUE self)
+{
+    memset(&rbtk_eval_cache_stats, 0, sizeof(rbtk_eval_cache_stats));
+
+    return Qnil;
+}
+
+/* eval string in tcl by Tcl_Eval() */
+struct call_eval_info {
+    struct tcltkip *ptr;
+    Tcl_Obj *cmd;
+};
+
+static VALUE
+call_tcl_eval(VALUE arg)
+{
+    struct call_eval_info *inf = (struct call_eval_info *)arg;
+
+    Tcl_AllowExceptions(inf->ptr->ip);
+    inf->ptr->return_value = Tcl_EvalObj(inf->ptr->ip, inf->cmd);
+
+    return Qnil;
+}
+
+/*
+ * Core Tcl command evaluation.
+ * Ruby method: TclTkIp#_eval
+ * Tested by: test/test_threading.rb (round-trip eval tests)
+ */
+static VALUE
+ip_eval_real(VALUE self, char *cmd_str, int cmd_len)
+{
+    volatile VALUE ret;
+    struct tcltkip *ptr = get_ip(self);
 
     /* call Tcl_EvalObj() */
     {
       Tcl_Obj *cmd;
 
-      cmd = Tcl_NewStringObj(cmd_str, cmd_len);
-      Tcl_IncrRefCount(cmd);
+      /* the compiled script object of the cache, or a new one */
+      cmd = rbtk_eval_cache_get(ptr, cmd_str, cmd_len);
 
       /* ip is deleted? */
       if (deleted_ip(ptr)) {
@@ -4867,7 +7225,9 @@ ip_eval_real(VALUE self, char *cmd_str, int cmd_len)
 
           inf.ptr = ptr;
           inf.cmd = cmd;
+          RBTK_TRACE_BEGIN("ip_eval_real", cmd_str, cmd_len);
           ret = rb_protect(call_tcl_eval, (VALUE)&inf, &status);
+          RBTK_TRACE_END("ip_eval_real");
           switch(status) {
           case TAG_RAISE:
               if (NIL_P(rb_errinfo())) {
@@ -4944,71 +7304,63 @@ eval_queue_handler(Tcl_Event *evPtr, int flags)
     volatile VALUE thread = q->thread;
     struct tcltkip *ptr;
 
+    RBTK_EVENTPROC_WITH_GVL(eval_queue_handler, evPtr, flags);
+
     DUMP2("do_eval_queue_handler : evPtr = %p", evPtr);
     DUMP2("eval_queue_thread : %"PRIxVALUE, rb_thread_current());
     DUMP2("added by thread : %"PRIxVALUE, thread);
 
-    if (*(q->done)) {
+    if (q->done->state) {
         DUMP1("processed by another event-loop");
         return 0;
     } else {
         DUMP1("process it on current event-loop");
     }
 
-    if (RTEST(rb_thread_alive_p(thread))
-	&& ! RTEST(rb_funcall(thread, ID_stop_p, 0))) {
-      DUMP1("caller is not yet ready to receive the result -> pending");
-      return 0;
-    }
-
     /* process it */
-    *(q->done) = 1;
+    q->done->state = 1;
 
     /* deleted ipterp ? */
     ptr = get_ip(q->interp);
     if (deleted_ip(ptr)) {
-        /* deleted IP --> ignore */
+        /* deleted IP --> ignore (but release the caller) */
+        if (q->done->owner || q->done->abandoned) ckfree(q->str);
+        evq_completion_signal(q->done);
         return 1;
     }
 
     /* incr internal handler mark */
     rbtk_internal_eventloop_handler++;
+    RBTK_TRACE_BEGIN("eval_queue_handler", NULL, 0);
 
     ret = ip_eval_real(q->interp, q->str, q->len);
 
+    /* asynchronous or abandoned request : nobody waits to free the string */
+    if (q->done->owner || q->done->abandoned) ckfree(q->str);
+
     /* set result */
-    RARRAY_ASET(q->result, 0, ret);
+    q->done->result = ret;
     ret = (VALUE)NULL;
 
     /* decr internal handler mark */
+    RBTK_TRACE_END("eval_queue_handler");
     rbtk_internal_eventloop_handler--;
 
-    /* complete */
-    *(q->done) = -1;
-
     /* unlink ruby objects */
     q->interp = (VALUE)NULL;
-    q->result = (VALUE)NULL;
     q->thread = (VALUE)NULL;
 
-    /* back to caller */
-    if (RTEST(rb_thread_alive_p(thread))) {
-      DUMP2("back to caller (caller thread:%"PRIxVALUE")", thread);
-      DUMP2("               (current thread:%"PRIxVALUE")", rb_thread_current());
+    /* complete : back to caller (it is sleeping on the completion) */
+    DUMP2("back to caller (caller thread:%"PRIxVALUE")", thread);
+    DUMP2("               (current thread:%"PRIxVALUE")", rb_thread_current());
 #if CONTROL_BY_STATUS_OF_RB_THREAD_WAITING_FOR_VALUE
-      have_rb_thread_waiting_for_value = 1;
-      rb_thread_wakeup(thread);
-#else
-      rb_thread_run(thread);
+    have_rb_thread_waiting_for_value = 1;
 #endif
-      DUMP1("finish back to caller");
+    evq_completion_signal(q->done);
 #if DO_THREAD_SCHEDULE_AT_CALLBACK_DONE
-      rb_thread_schedule();
+    rb_thread_schedule(); /* pass the GVL to the caller */
 #endif
-    } else {
-      DUMP2("caller is dead (caller thread:%"PRIxVALUE")", thread);
-      DUMP2("               (current thread:%"PRIxVALUE")", rb_thread_current());
-    }
+    DUMP1("finish back to caller");
 
     /* end of handler : remove it */
     return 1;
@@ -5025,13 +7377,13 @@ ip_eval(VALUE self, VALUE str)
     struct eval_queue *evq;
     struct tcltkip *ptr;
     char *eval_str;
-    int  *alloc_done;
+    struct evq_completion *alloc_done;
     volatile VALUE current = rb_thread_current();
     volatile VALUE ip_obj = self;
     volatile VALUE result;
     volatile VALUE ret;
     Tcl_QueuePosition position;
-    struct timeval t;
+    int status;
 
     StringValue(str);
 
@@ -5057,9 +7409,7 @@ ip_eval(VALUE self, VALUE str)
     DUMP2("eval from thread %"PRIxVALUE" (NOT current eventloop)", current);
 
     /* allocate memory (keep result) */
-    /* alloc_done = (int*)ALLOC(int); */
-    alloc_done = RbTk_ALLOC_N(int, 1);
-    *alloc_done = 0;
+    alloc_done = evq_completion_new();
 
     /* eval_str = ALLOC_N(char, RSTRING_LEN(str) + 1); */
     eval_str = ckalloc(RSTRING_LENINT(str) + 1);
@@ -5067,59 +7417,31 @@ ip_eval(VALUE self, VALUE str)
     eval_str[RSTRING_LEN(str)] = 0;
 
     /* allocate memory (freed by Tcl_ServiceEvent) */
-    /* evq = (struct eval_queue *)Tcl_Alloc(sizeof(struct eval_queue)); */
-    evq = RbTk_ALLOC_N(struct eval_queue, 1);
-
-    /* allocate result obj */
-    result = rb_ary_new3(1, Qnil);
+    evq = (struct eval_queue *)evq_record_alloc();
 
     /* construct event data */
     evq->done = alloc_done;
     evq->str = eval_str;
     evq->len = RSTRING_LENINT(str);
     evq->interp = ip_obj;
-    evq->result = result;
     evq->thread = current;
     evq->ev.proc = eval_queue_handler;
 
     position = TCL_QUEUE_TAIL;
 
     /* add the handler to Tcl event queue */
-    DUMP1("add handler");
-    if (ptr->tk_thread_id) {
-      Tcl_ThreadQueueEvent(ptr->tk_thread_id, (Tcl_Event*)evq, position);
-      Tcl_ThreadAlert(ptr->tk_thread_id);
-    } else if (tk_eventloop_thread_id) {
-      Tcl_ThreadQueueEvent(tk_eventloop_thread_id, (Tcl_Event*)evq, position);
-      Tcl_ThreadAlert(tk_eventloop_thread_id);
-    } else {
-      Tcl_QueueEvent((Tcl_Event*)evq, position);
-    }
+    evq_queue_event(ptr, (Tcl_Event*)evq, position);
 
     /* wait for the handler to be processed */
-    t.tv_sec  = 0;
-    t.tv_usec = (long)((EVENT_HANDLER_TIMEOUT)*1000.0);
-
     DUMP2("evq wait for handler (current thread:%"PRIxVALUE")", current);
-    while(*alloc_done >= 0) {
-      DUMP2("*** evq wait for handler (current thread:%"PRIxVALUE")", current);
-      /* rb_thread_stop(); */
-      /* rb_thread_sleep_forever(); */
-      rb_thread_wait_for(t);
-      DUMP2("*** evq wakeup (current thread:%"PRIxVALUE")", current);
-      DUMP2("***          (eventloop thread:%"PRIxVALUE")", eventloop_thread);
-      if (NIL_P(eventloop_thread)) {
-	DUMP1("*** evq lost eventloop thread");
-	break;
-      }
-    }
+    evq_completion_wait_sync(alloc_done, &status);
     DUMP2("back from handler (current thread:%"PRIxVALUE")", current);
 
     /* get result & free allocated memory */
-    ret = RARRAY_AREF(result, 0);
+    ret = alloc_done->result;
 
-    ckfree((char*)alloc_done);
-    ckfree(eval_str);
+    if (evq_completion_release(alloc_done)) ckfree(eval_str);
+    if (status) rb_jump_tag(status);
 
     if (rb_obj_is_kind_of(ret, rb_eException)) {
         DUMP1("raise exception");
@@ -5721,7 +8043,7 @@ invoke_tcl_proc(VALUE arg)
 
 
 static VALUE
-ip_invoke_core(VALUE interp, Tcl_Size objc, Tcl_Obj **objv)
+ip_invoke_core(VALUE interp, Tcl_Size objc, Tcl_Obj **objv, int result_mode)
 {
     struct tcltkip *ptr;
     Tcl_CmdInfo info;
@@ -5801,7 +8123,9 @@ ip_invoke_core(VALUE interp, Tcl_Size objc, Tcl_Obj **objv)
 
     /* invoke tcl-proc */
     DUMP1("invoke tcl-proc");
+    RBTK_TRACE_BEGIN("ip_invoke_core", cmd, len);
     rb_protect(invoke_tcl_proc, (VALUE)&inf, &status);
+    RBTK_TRACE_END("ip_invoke_core");
     DUMP2("status of tcl-proc, %d", status);
     switch(status) {
     case TAG_RAISE:
@@ -5861,296 +8185,1110 @@ ip_invoke_core(VALUE interp, Tcl_Size objc, Tcl_Obj **objv)
         }
     }
 
-    /* pass back the result (as string) */
-    return ip_get_result_string_obj(ptr->ip);
+    /* pass back the result (as string, or by result_mode) */
+    return ip_get_result_typed(interp, ptr->ip, result_mode);
+}
+
+
+/*
+ * Interned Tcl_Objs of frozen strings and symbols (subcommands, option
+ * names, widget paths). The same Tcl_Obj is passed on every call, so
+ * the internal rep which Tcl/Tk gave it (e.g. the index into an option
+ * table, or the command of a widget path) is reused. Only used on the
+ * thread of the interpreter; queued requests get fresh objects.
+ */
+#define RBTK_OBJ_CACHE_KEY "rbtk_obj_cache"
+#define RBTK_OBJ_CACHE_MAXLEN 64
+#define RBTK_OBJ_CACHE_SIZE 1024
+
+static void
+rbtk_obj_cache_clear(Tcl_HashTable *tbl)
+{
+    Tcl_HashSearch search;
+    Tcl_HashEntry *entry;
+
+    for(entry = Tcl_FirstHashEntry(tbl, &search); entry != NULL;
+        entry = Tcl_NextHashEntry(&search)) {
+        Tcl_DecrRefCount((Tcl_Obj *)Tcl_GetHashValue(entry));
+        Tcl_DeleteHashEntry(entry);
+    }
+}
+
+static void
+rbtk_obj_cache_delete(ClientData clientData, Tcl_Interp *interp)
+{
+    Tcl_HashTable *tbl = (Tcl_HashTable *)clientData;
+
+    rbtk_obj_cache_clear(tbl);
+    Tcl_DeleteHashTable(tbl);
+    ckfree((char *)tbl);
+}
+
+/* string-keyed hash table kept as the assoc data of the interpreter */
+static Tcl_HashTable *
+rbtk_assoc_hash_table(Tcl_Interp *ip, const char *key,
+                      Tcl_InterpDeleteProc *proc)
+{
+    Tcl_HashTable *tbl;
+
+    tbl = (Tcl_HashTable *)Tcl_GetAssocData(ip, key, NULL);
+    if (tbl == (Tcl_HashTable *)NULL) {
+        tbl = (Tcl_HashTable *)ckalloc(sizeof(Tcl_HashTable));
+        Tcl_InitHashTable(tbl, TCL_STRING_KEYS);
+        Tcl_SetAssocData(ip, key, proc, (ClientData)tbl);
+    }
+    return tbl;
+}
+
+/* return NULL if val is not internable */
+static Tcl_Obj *
+rbtk_get_interned_obj(struct tcltkip *ptr, VALUE val)
+{
+    volatile VALUE str, enc;
+    char key[RBTK_OBJ_CACHE_MAXLEN + 1];
+    Tcl_HashEntry *entry;
+    Tcl_Obj *obj;
+    long len;
+    int isnew;
+
+    if (SYMBOL_P(val)) {
+        str = rb_sym2str(val);
+    } else if (RB_TYPE_P(val, T_STRING) && OBJ_FROZEN(val)) {
+        str = val;
+    } else {
+        return (Tcl_Obj *)NULL;
+    }
+
+    /* text strings only (see get_obj_from_str) */
+    len = RSTRING_LEN(str);
+    if (len == 0 || len > RBTK_OBJ_CACHE_MAXLEN
+        || rb_enc_get_index(str) == ENCODING_INDEX_BINARY
+        || memchr(RSTRING_PTR(str), 0, len)) {
+        return (Tcl_Obj *)NULL;
+    }
+    enc = rb_attr_get(str, ID_at_enc);
+    if (!NIL_P(enc) && (!RB_TYPE_P(enc, T_STRING)
+                        || strcmp(StringValueCStr(enc), "binary") == 0)) {
+        return (Tcl_Obj *)NULL;
+    }
+
+    memcpy(key, RSTRING_PTR(str), len);
+    key[len] = '\0';
+
+    if (ptr->obj_cache == (Tcl_HashTable *)NULL) {
+        ptr->obj_cache = rbtk_assoc_hash_table(ptr->ip, RBTK_OBJ_CACHE_KEY,
+                                               rbtk_obj_cache_delete);
+    }
+
+    entry = Tcl_FindHashEntry(ptr->obj_cache, key);
+    if (entry != NULL) {
+        return (Tcl_Obj *)Tcl_GetHashValue(entry);
+    }
+
+    /* e.g. many generated widget paths : start again */
+    if (ptr->obj_cache->numEntries >= RBTK_OBJ_CACHE_SIZE) {
+        rbtk_obj_cache_clear(ptr->obj_cache);
+    }
+
+    obj = Tcl_NewStringObj(key, (Tcl_Size)len);
+    Tcl_IncrRefCount(obj);
+    entry = Tcl_CreateHashEntry(ptr->obj_cache, key, &isnew);
+    Tcl_SetHashValue(entry, (ClientData)obj);
+
+    return obj;
+}
+
+/* ptr : interpreter for interned arguments, or NULL */
+static Tcl_Obj **
+alloc_invoke_arguments(struct tcltkip *ptr, int argc, VALUE *argv)
+{
+    int i;
+    Tcl_Obj **av;
+
+    /* memory allocation */
+    /* av = ALLOC_N(Tcl_Obj *, argc+1);*/ /* XXXXXXXXXX */
+    av = RbTk_ALLOC_N(Tcl_Obj *, (argc+1));
+    for (i = 0; i < argc; ++i) {
+        av[i] = (ptr)? rbtk_get_interned_obj(ptr, argv[i]): (Tcl_Obj *)NULL;
+        if (av[i] == (Tcl_Obj *)NULL) {
+            av[i] = get_obj_from_value(argv[i]);
+        }
+        Tcl_IncrRefCount(av[i]);
+    }
+    av[argc] = NULL;
+
+    return av;
+}
+
+static void
+free_invoke_arguments(int argc, Tcl_Obj **av)
+{
+    int i;
+
+    for (i = 0; i < argc; ++i) {
+        Tcl_DecrRefCount(av[i]);
+	av[i] = (Tcl_Obj*)NULL;
+    }
+    ckfree((char*)av);
+}
+
+static VALUE
+ip_invoke_real_with_mode(int argc, VALUE *argv, VALUE interp, int result_mode)
+{
+    VALUE v;
+    struct tcltkip *ptr;        /* tcltkip data struct */
+    Tcl_Obj **av = (Tcl_Obj **)NULL;
+
+    DUMP2("invoke_real called by thread:%"PRIxVALUE, rb_thread_current());
+
+    /* get the data struct */
+    ptr = get_ip(interp);
+
+    /* ip is deleted? */
+    if (deleted_ip(ptr)) {
+        return rb_str_new2("");
+    }
+
+    /* allocate memory for arguments */
+    av = alloc_invoke_arguments(ptr, argc, argv);
+
+    /* Invoke the C procedure */
+    Tcl_ResetResult(ptr->ip);
+    v = ip_invoke_core(interp, argc, av, result_mode);
+
+    /* free allocated memory */
+    free_invoke_arguments(argc, av);
+
+    return v;
+}
+
+static VALUE
+ip_invoke_real(int argc, VALUE *argv, VALUE interp)
+{
+    return ip_invoke_real_with_mode(argc, argv, interp, RBTK_RESULT_STRING);
+}
+
+int
+invoke_queue_handler(Tcl_Event *evPtr, int flags)
+{
+    struct invoke_queue *q = (struct invoke_queue *)evPtr;
+    volatile VALUE ret;
+    volatile VALUE thread = q->thread;
+    struct tcltkip *ptr;
+
+    RBTK_EVENTPROC_WITH_GVL(invoke_queue_handler, evPtr, flags);
+
+    DUMP2("do_invoke_queue_handler : evPtr = %p", evPtr);
+    DUMP2("invoke queue_thread : %"PRIxVALUE, rb_thread_current());
+    DUMP2("added by thread : %"PRIxVALUE, thread);
+
+    if (q->done->state) {
+        DUMP1("processed by another event-loop");
+        return 0;
+    } else {
+        DUMP1("process it on current event-loop");
+    }
+
+    /* process it */
+    q->done->state = 1;
+
+    /* deleted ipterp ? */
+    ptr = get_ip(q->interp);
+    if (deleted_ip(ptr)) {
+        /* deleted IP --> ignore (but release the caller) */
+        if (q->done->owner || q->done->abandoned) {
+            free_invoke_arguments(q->argc, q->argv);
+        }
+        evq_completion_signal(q->done);
+        return 1;
+    }
+
+    /* incr internal handler mark */
+    rbtk_internal_eventloop_handler++;
+    RBTK_TRACE_BEGIN("invoke_queue_handler", NULL, 0);
+
+    DUMP2("call invoke_real (for caller thread:%"PRIxVALUE")", thread);
+    DUMP2("call invoke_real (current thread:%"PRIxVALUE")", rb_thread_current());
+    ret = ip_invoke_core(q->interp, q->argc, q->argv, q->result_mode);
+
+    /* asynchronous or abandoned request : nobody waits to free the arguments */
+    if (q->done->owner || q->done->abandoned) {
+        free_invoke_arguments(q->argc, q->argv);
+    }
+
+    /* set result */
+    q->done->result = ret;
+    ret = (VALUE)NULL;
+
+    /* decr internal handler mark */
+    RBTK_TRACE_END("invoke_queue_handler");
+    rbtk_internal_eventloop_handler--;
+
+    /* unlink ruby objects */
+    q->interp = (VALUE)NULL;
+    q->thread = (VALUE)NULL;
+
+    /* complete : back to caller (it is sleeping on the completion) */
+    DUMP2("back to caller (caller thread:%"PRIxVALUE")", thread);
+    DUMP2("               (current thread:%"PRIxVALUE")", rb_thread_current());
+#if CONTROL_BY_STATUS_OF_RB_THREAD_WAITING_FOR_VALUE
+    have_rb_thread_waiting_for_value = 1;
+#endif
+    evq_completion_signal(q->done);
+#if DO_THREAD_SCHEDULE_AT_CALLBACK_DONE
+    rb_thread_schedule(); /* pass the GVL to the caller */
+#endif
+    DUMP1("finish back to caller");
+
+    /* end of handler : remove it */
+    return 1;
+}
+
+/*
+ * Invoke a Tcl command, queuing to the event loop if needed.
+ * Tested by: test/test_threading.rb (cross-thread callback scenarios)
+ */
+static VALUE
+ip_invoke_with_mode(int argc, VALUE *argv, VALUE obj,
+                    Tcl_QueuePosition position, int result_mode)
+{
+    struct invoke_queue *ivq;
+    struct tcltkip *ptr;
+    struct evq_completion *alloc_done;
+    volatile VALUE current = rb_thread_current();
+    volatile VALUE ip_obj = obj;
+    volatile VALUE result;
+    volatile VALUE ret;
+    Tcl_Obj **av = (Tcl_Obj **)NULL;
+    int status;
+
+    if (argc < 1) {
+        rb_raise(rb_eArgError, "command name missing");
+    }
+
+    ptr = get_ip(ip_obj);
+    DUMP2("invoke status: ptr->tk_thread_id %p", ptr->tk_thread_id);
+    DUMP2("invoke status: Tcl_GetCurrentThread %p", Tcl_GetCurrentThread());
+    DUMP2("status: eventloopt_thread %"PRIxVALUE, eventloop_thread);
+
+    if ((ptr->tk_thread_id == 0 || ptr->tk_thread_id == Tcl_GetCurrentThread())
+	&& (NIL_P(eventloop_thread) || current == eventloop_thread)) {
+        if (NIL_P(eventloop_thread)) {
+            DUMP2("invoke from thread:%"PRIxVALUE" but no eventloop", current);
+        } else {
+            DUMP2("invoke from current eventloop %"PRIxVALUE, current);
+        }
+        result = ip_invoke_real_with_mode(argc, argv, ip_obj, result_mode);
+        if (rb_obj_is_kind_of(result, rb_eException)) {
+            rb_exc_raise(result);
+        }
+        return result;
+    }
+
+    DUMP2("invoke from thread %"PRIxVALUE" (NOT current eventloop)", current);
+
+    /* allocate memory (for arguments) */
+    av = alloc_invoke_arguments((struct tcltkip *)NULL, argc, argv);
+
+    /* allocate memory (keep result) */
+    alloc_done = evq_completion_new();
+
+    /* allocate memory (freed by Tcl_ServiceEvent) */
+    ivq = (struct invoke_queue *)evq_record_alloc();
+
+    /* construct event data */
+    ivq->done = alloc_done;
+    ivq->argc = argc;
+    ivq->argv = av;
+    ivq->result_mode = result_mode;
+    ivq->interp = ip_obj;
+    ivq->thread = current;
+    ivq->ev.proc = invoke_queue_handler;
+
+    /* add the handler to Tcl event queue */
+    evq_queue_event(ptr, (Tcl_Event*)ivq, position);
+
+    /* wait for the handler to be processed */
+    DUMP2("ivq wait for handler (current thread:%"PRIxVALUE")", current);
+    evq_completion_wait_sync(alloc_done, &status);
+    DUMP2("back from handler (current thread:%"PRIxVALUE")", current);
+
+    /* get result & free allocated memory */
+    ret = alloc_done->result;
+    if (evq_completion_release(alloc_done)) {
+        /* free allocated memory */
+        free_invoke_arguments(argc, av);
+    }
+    if (status) rb_jump_tag(status);
+
+    /* exception? */
+    if (rb_obj_is_kind_of(ret, rb_eException)) {
+        DUMP1("raise exception");
+        /* rb_exc_raise(ret); */
+	rb_exc_raise(rb_exc_new3(rb_obj_class(ret),
+				 rb_funcallv(ret, ID_to_s, 0, 0)));
+    }
+
+    DUMP1("exit ip_invoke");
+    return ret;
+}
+
+static VALUE
+ip_invoke_with_position(int argc, VALUE *argv, VALUE obj, Tcl_QueuePosition position)
+{
+    return ip_invoke_with_mode(argc, argv, obj, position, RBTK_RESULT_STRING);
+}
+
+
+/* get return code from Tcl_Eval() */
+static VALUE
+ip_retval(VALUE self)
+{
+    struct tcltkip *ptr;        /* tcltkip data struct */
+
+    /* get the data strcut */
+    ptr = get_ip(self);
+
+    /* ip is deleted? */
+    if (deleted_ip(ptr)) {
+        return rb_str_new2("");
+    }
+
+    return (INT2FIX(ptr->return_value));
+}
+
+static VALUE
+ip_invoke(int argc, VALUE *argv, VALUE obj)
+{
+    return ip_invoke_with_position(argc, argv, obj, TCL_QUEUE_TAIL);
+}
+
+static VALUE
+ip_invoke_immediate(int argc, VALUE *argv, VALUE obj)
+{
+    /* POTENTIALY INSECURE : can create infinite loop */
+    return ip_invoke_with_position(argc, argv, obj, TCL_QUEUE_HEAD);
+}
+
+/*
+ * _invoke_typed(mode, *args) : same as _invoke (without encoding
+ * conversion), but returns the result as an Integer, a Float, an Array
+ * or a Hash read directly from the result object.
+ */
+static VALUE
+ip_invoke_typed(int argc, VALUE *argv, VALUE obj)
+{
+    int mode;
+
+    if (argc < 1) {
+        rb_raise(rb_eArgError, "result mode missing");
+    }
+    mode = ip_result_mode(argv[0]);
+
+    return ip_invoke_with_mode(argc - 1, argv + 1, obj, TCL_QUEUE_TAIL, mode);
+}
+
+/* can the interpreter be called directly by the current thread ? */
+static int
+ip_is_on_eventloop(struct tcltkip *ptr)
+{
+    volatile VALUE current = rb_thread_current();
+
+    return ((!ptr || ptr->tk_thread_id == 0
+             || ptr->tk_thread_id == Tcl_GetCurrentThread())
+            && (NIL_P(eventloop_thread) || current == eventloop_thread));
+}
+
+/* run the commands of a batch back to back (on the eventloop thread) */
+static VALUE
+ip_invoke_batch_core(VALUE interp, int argc, VALUE *argv)
+{
+    volatile VALUE cmds = argv[0];
+    volatile VALUE cmd;
+    volatile VALUE results;
+    long i, len = RARRAY_LEN(cmds);
+
+    results = rb_ary_new2(len);
+
+    for(i = 0; i < len; i++) {
+        cmd = RARRAY_AREF(cmds, i);
+        rb_ary_push(results,
+                    ip_invoke_real(RARRAY_LENINT(cmd),
+                                   (VALUE*)RARRAY_CONST_PTR(cmd), interp));
+    }
+
+    return results;
+}
+
+/*
+ * Invoke some Tcl commands by one request to the eventloop thread.
+ * Ruby method: TclTkIp#_invoke_batch([[cmd, arg, ...], ...])
+ * Returns an array of the results. A failed command doesn't stop the
+ * batch; its element is the exception object.
+ */
+static VALUE
+ip_invoke_batch(VALUE self, VALUE list)
+{
+    volatile VALUE cmds;
+    volatile VALUE cmd;
+    long i, len;
+
+    list = rb_convert_type(list, T_ARRAY, "Array", "to_ary");
+    len = RARRAY_LEN(list);
+
+    /* copy : the commands are run on the other thread */
+    cmds = rb_ary_new2(len);
+    for(i = 0; i < len; i++) {
+        cmd = rb_convert_type(RARRAY_AREF(list, i), T_ARRAY, "Array", "to_ary");
+        if (RARRAY_LEN(cmd) < 1) {
+            rb_raise(rb_eArgError, "command name missing (batch index %ld)", i);
+        }
+        rb_ary_push(cmds, rb_ary_dup(cmd));
+    }
+
+    if (len == 0) return rb_ary_new();
+
+    /* keep the order with the other queued _invoke requests */
+    return tk_funcall_with_position(ip_invoke_batch_core,
+                                    1, (VALUE*)&cmds, self, TCL_QUEUE_TAIL);
+}
+
+/* keep the interp object alive while it has queued nowait requests */
+static void
+evq_nowait_hold(VALUE interp)
+{
+    VALUE cnt = rb_hash_lookup2(evq_async_table, interp, INT2FIX(0));
+
+    rb_hash_aset(evq_async_table, interp, INT2FIX(FIX2INT(cnt) + 1));
+}
+
+static void
+evq_nowait_release(VALUE interp)
+{
+    VALUE cnt = rb_hash_lookup2(evq_async_table, interp, INT2FIX(0));
+
+    if (FIX2INT(cnt) > 1) {
+        rb_hash_aset(evq_async_table, interp, INT2FIX(FIX2INT(cnt) - 1));
+    } else {
+        rb_hash_delete(evq_async_table, interp);
+    }
+}
+
+/* nobody receives the result : report an error to 'bgerror' */
+static void
+ip_invoke_nowait_error(struct tcltkip *ptr, VALUE exc)
+{
+    volatile VALUE msg;
+
+    if (deleted_ip(ptr)) return;
+
+    /* the exception has the message of the Tcl error, too */
+    msg = rb_funcallv(exc, ID_to_s, 0, 0);
+    StringValue(msg);
+    Tcl_ResetResult(ptr->ip);
+    Tcl_SetObjResult(ptr->ip, Tcl_NewStringObj(RSTRING_PTR(msg),
+                                               RSTRING_LENINT(msg)));
+    Tcl_BackgroundException(ptr->ip, TCL_ERROR);
+    Tcl_ResetResult(ptr->ip);
+}
+
+static int
+invoke_nowait_handler(Tcl_Event *evPtr, int flags)
+{
+    struct invoke_queue *q = (struct invoke_queue *)evPtr;
+    volatile VALUE ret;
+    struct tcltkip *ptr;
+
+    RBTK_EVENTPROC_WITH_GVL(invoke_nowait_handler, evPtr, flags);
+
+    DUMP2("do_invoke_nowait_handler : evPtr = %p", evPtr);
+
+    /* deleted ipterp ? --> ignore */
+    ptr = get_ip(q->interp);
+    if (!deleted_ip(ptr)) {
+        /* incr internal handler mark */
+        rbtk_internal_eventloop_handler++;
+        RBTK_TRACE_BEGIN("invoke_nowait_handler", NULL, 0);
+
+        ret = ip_invoke_core(q->interp, q->argc, q->argv, RBTK_RESULT_STRING);
+        if (rb_obj_is_kind_of(ret, rb_eException)) {
+            ip_invoke_nowait_error(ptr, ret);
+        }
+        ret = (VALUE)NULL;
+
+        /* decr internal handler mark */
+        RBTK_TRACE_END("invoke_nowait_handler");
+        rbtk_internal_eventloop_handler--;
+    }
+
+    evq_stats_request_done(q->queued_at);
+
+    free_invoke_arguments(q->argc, q->argv);
+    evq_nowait_release(q->interp);
+    q->interp = (VALUE)NULL;
+
+    /* end of handler : remove it */
+    return 1;
+}
+
+/*
+ * Invoke a Tcl command without waiting for (and receiving) the result.
+ * Ruby method: TclTkIp#_invoke_nowait
+ * Requests are done in FIFO order. An error is reported to 'bgerror'.
+ */
+static VALUE
+ip_invoke_nowait(int argc, VALUE *argv, VALUE obj)
+{
+    struct invoke_queue *ivq;
+    struct tcltkip *ptr;
+    volatile VALUE ret;
+
+    if (argc < 1) {
+        rb_raise(rb_eArgError, "command name missing");
+    }
+
+    ptr = get_ip(obj);
+
+    if (ip_is_on_eventloop(ptr)) {
+        DUMP2("invoke_nowait on current thread %"PRIxVALUE,
+              rb_thread_current());
+        ret = ip_invoke_real(argc, argv, obj);
+        if (rb_obj_is_kind_of(ret, rb_eException)) {
+            ip_invoke_nowait_error(ptr, ret);
+        }
+        return Qnil;
+    }
+
+    DUMP2("invoke_nowait from thread %"PRIxVALUE" (NOT current eventloop)",
+          rb_thread_current());
+
+    /* allocate memory (freed by Tcl_ServiceEvent) */
+    ivq = (struct invoke_queue *)evq_record_alloc();
+
+    /* construct event data (arguments are freed by the handler) */
+    ivq->done = (struct evq_completion *)NULL;
+    ivq->argc = argc;
+    ivq->argv = alloc_invoke_arguments((struct tcltkip *)NULL, argc, argv);
+    ivq->interp = obj;
+    ivq->thread = (VALUE)NULL;
+    ivq->queued_at = (eventloop_stats_mode)? rbtk_monotonic_usec(): 0;
+    ivq->ev.proc = invoke_nowait_handler;
+
+    evq_nowait_hold(obj);
+
+    /* add the handler to Tcl event queue */
+    evq_queue_event(ptr, (Tcl_Event*)ivq, TCL_QUEUE_TAIL);
+
+    return Qnil;
+}
+
+/* coalesced requests : only the last one of the same key is invoked */
+static int
+coalesce_invoke_i(VALUE key, VALUE args, VALUE interp)
+{
+    volatile VALUE ret;
+    struct tcltkip *ptr = get_ip(interp);
+
+    if (deleted_ip(ptr)) return ST_STOP;
+
+    ret = ip_invoke_real(RARRAY_LENINT(args),
+                         (VALUE*)RARRAY_CONST_PTR(args), interp);
+    if (rb_obj_is_kind_of(ret, rb_eException)) {
+        ip_invoke_nowait_error(ptr, ret);
+    }
+
+    return ST_CONTINUE;
+}
+
+static int
+coalesce_queue_handler(Tcl_Event *evPtr, int flags)
+{
+    struct coalesce_queue *q = (struct coalesce_queue *)evPtr;
+    volatile VALUE interp = q->interp;
+    volatile VALUE table;
+
+    RBTK_EVENTPROC_WITH_GVL(coalesce_queue_handler, evPtr, flags);
+
+    DUMP2("do_coalesce_queue_handler : evPtr = %p", evPtr);
+
+    /* detach the table : a new request queues a new event */
+    table = rb_attr_get(interp, ID_at_coalesce_table);
+    rb_ivar_set(interp, ID_at_coalesce_table, Qnil);
+
+    if (!NIL_P(table)) {
+        /* incr internal handler mark */
+        rbtk_internal_eventloop_handler++;
+        RBTK_TRACE_BEGIN("coalesce_queue_handler", NULL, 0);
+
+        rb_hash_foreach(table, coalesce_invoke_i, interp);
+
+        /* decr internal handler mark */
+        RBTK_TRACE_END("coalesce_queue_handler");
+        rbtk_internal_eventloop_handler--;
+
+        evq_stats_request_done(q->queued_at);
+    }
+
+    evq_nowait_release(interp);
+    q->interp = (VALUE)NULL;
+
+    /* end of handler : remove it */
+    return 1;
+}
+
+/*
+ * a snapshot of an argument : the same types as _invoke accepts
+ * (get_obj_from_value) are kept, and others are converted to Strings.
+ */
+static VALUE
+coalesce_argument(VALUE val)
+{
+    volatile VALUE ary;
+    long i;
+
+    switch(TYPE(val)) {
+    case T_FIXNUM:
+    case T_BIGNUM:
+    case T_FLOAT:
+    case T_SYMBOL:
+        return val;
+
+    case T_ARRAY:
+        check_list_value(val);
+        ary = rb_ary_new2(RARRAY_LEN(val));
+        for(i = 0; i < RARRAY_LEN(val); i++) {
+            rb_ary_push(ary, coalesce_argument(RARRAY_AREF(val, i)));
+        }
+        return rb_ary_freeze(ary);
+
+    default:
+        return rb_str_new_frozen(StringValue(val));
+    }
+}
+
+/* queue an event to flush the pending table */
+static void
+coalesce_queue_flush(struct tcltkip *ptr, VALUE obj)
+{
+    struct coalesce_queue *cq;
+
+    rb_ivar_set(obj, ID_at_coalesce_queued,
+                LL2NUM((LONG_LONG)rbtk_monotonic_usec()));
+
+    /* allocate memory (freed by Tcl_ServiceEvent) */
+    cq = (struct coalesce_queue *)evq_record_alloc();
+    cq->interp = obj;
+    cq->queued_at = (eventloop_stats_mode)? rbtk_monotonic_usec(): 0;
+    cq->ev.proc = coalesce_queue_handler;
+
+    evq_nowait_hold(obj);
+
+    /* add the handler to Tcl event queue */
+    evq_queue_event(ptr, (Tcl_Event*)cq, TCL_QUEUE_TAIL);
+}
+
+/*
+ * Invoke a Tcl command on the next eventloop pass without waiting.
+ * Ruby method: TclTkIp#_invoke_coalesced(key, *args)
+ * A pending request of the same key is replaced by the new one.
+ */
+static VALUE
+ip_invoke_coalesced(int argc, VALUE *argv, VALUE obj)
+{
+    struct tcltkip *ptr;
+    volatile VALUE table;
+    volatile VALUE args;
+    volatile VALUE queued;
+    volatile VALUE ret;
+    int i;
+
+    if (argc < 2) {
+        rb_raise(rb_eArgError, "command name missing");
+    }
+
+    ptr = get_ip(obj);
+    if (deleted_ip(ptr)) return Qnil;
+
+    table = rb_attr_get(obj, ID_at_coalesce_table);
+
+    if (NIL_P(table) && ip_is_on_eventloop(ptr)) {
+        /* nothing is pending : same as _invoke_nowait */
+        DUMP2("invoke_coalesced on current thread %"PRIxVALUE,
+              rb_thread_current());
+        ret = ip_invoke_real(argc - 1, argv + 1, obj);
+        if (rb_obj_is_kind_of(ret, rb_eException)) {
+            ip_invoke_nowait_error(ptr, ret);
+        }
+        return Qnil;
+    }
+
+    /* the arguments are used later */
+    args = rb_ary_new2(argc - 1);
+    for(i = 1; i < argc; i++) {
+        rb_ary_push(args, coalesce_argument(argv[i]));
+    }
+
+    if (!NIL_P(table)) {
+        rb_hash_aset(table, argv[0], args);
+
+        /*
+         * The flush event is already queued. If it is not processed for
+         * a while, it may be dropped (e.g. the queue of a finished
+         * thread) : queue another one. The table is detached by the
+         * first one, so the others do nothing.
+         */
+        queued = rb_attr_get(obj, ID_at_coalesce_queued);
+        if (NIL_P(queued)
+            || rbtk_monotonic_usec() - (Tcl_WideInt)NUM2LL(queued)
+               > 1000L * (long)EVENT_HANDLER_TIMEOUT) {
+            DUMP1("flush event of coalesced requests is not processed");
+            coalesce_queue_flush(ptr, obj);
+        }
+        return Qnil;
+    }
+
+    table = rb_hash_new();
+    rb_hash_aset(table, argv[0], args);
+    rb_ivar_set(obj, ID_at_coalesce_table, table);
+
+    coalesce_queue_flush(ptr, obj);
+
+    return Qnil;
 }
 
 
-static Tcl_Obj **
-alloc_invoke_arguments(int argc, VALUE *argv)
-{
-    int i;
-    Tcl_Obj **av;
+/* asynchronous request : TclTkIp::Future */
+static VALUE cIpFuture;
 
-    /* memory allocation */
-    /* av = ALLOC_N(Tcl_Obj *, argc+1);*/ /* XXXXXXXXXX */
-    av = RbTk_ALLOC_N(Tcl_Obj *, (argc+1));
-    for (i = 0; i < argc; ++i) {
-        av[i] = get_obj_from_str(argv[i]);
-        Tcl_IncrRefCount(av[i]);
-    }
-    av[argc] = NULL;
+struct evq_future {
+    struct evq_completion *done;    /* has the result */
+    VALUE interp;
+    int   remote;     /* processed by the eventloop thread ? */
+    Tcl_ThreadId target;    /* the thread of the queue (if remote) */
+};
 
-    return av;
+static void
+evq_future_mark(void *p)
+{
+    struct evq_future *fp = (struct evq_future *)p;
+
+    rb_gc_mark(fp->interp);
 }
 
 static void
-free_invoke_arguments(int argc, Tcl_Obj **av)
+evq_future_free(void *p)
 {
-    int i;
+    struct evq_future *fp = (struct evq_future *)p;
 
-    for (i = 0; i < argc; ++i) {
-        Tcl_DecrRefCount(av[i]);
-	av[i] = (Tcl_Obj*)NULL;
-    }
-    ckfree((char*)av);
+    /* a pending future is never collected (kept by evq_async_table) */
+    if (fp->done) evq_completion_free(fp->done);
+    xfree(fp);
 }
 
-static VALUE
-ip_invoke_real(int argc, VALUE *argv, VALUE interp)
+static size_t
+evq_future_memsize(const void *p)
 {
-    VALUE v;
-    struct tcltkip *ptr;        /* tcltkip data struct */
-    Tcl_Obj **av = (Tcl_Obj **)NULL;
-
-    DUMP2("invoke_real called by thread:%"PRIxVALUE, rb_thread_current());
+    return sizeof(struct evq_future) + sizeof(struct evq_completion);
+}
 
-    /* get the data struct */
-    ptr = get_ip(interp);
+static const rb_data_type_t evq_future_type = {
+    "TclTkIp::Future",
+    {
+        evq_future_mark,
+        evq_future_free,
+        evq_future_memsize,
+    },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY,
+};
 
-    /* ip is deleted? */
-    if (deleted_ip(ptr)) {
-        return rb_str_new2("");
-    }
+static VALUE
+evq_future_new(VALUE interp, struct evq_future **fpp)
+{
+    struct evq_future *fp;
+    volatile VALUE future;
 
-    /* allocate memory for arguments */
-    av = alloc_invoke_arguments(argc, argv);
+    future = TypedData_Make_Struct(cIpFuture, struct evq_future,
+                                   &evq_future_type, fp);
+    fp->interp = interp;
+    fp->remote = 0;
+    fp->target = (Tcl_ThreadId)0;
+    fp->done = evq_completion_new();
 
-    /* Invoke the C procedure */
-    Tcl_ResetResult(ptr->ip);
-    v = ip_invoke_core(interp, argc, av);
+    *fpp = fp;
+    return future;
+}
 
-    /* free allocated memory */
-    free_invoke_arguments(argc, av);
+/* the request is processed on the current thread */
+static VALUE
+evq_future_complete(VALUE future, struct evq_future *fp, VALUE ret)
+{
+    fp->done->result = ret;
+    fp->done->state = -1;
+    return future;
+}
 
-    return v;
+/* the request is queued : keep the future alive until completion */
+static void
+evq_future_register(VALUE future, struct evq_future *fp)
+{
+    fp->remote = 1;
+    fp->target = evq_queue_target(get_ip(fp->interp));
+    if (!fp->target) fp->target = Tcl_GetCurrentThread();
+    fp->done->owner = future;
+    rb_hash_aset(evq_async_table, future, Qtrue);
 }
 
-int
-invoke_queue_handler(Tcl_Event *evPtr, int flags)
+/*
+ * Queue a Tcl command without waiting for the result.
+ * Ruby method: TclTkIp#_invoke_async
+ * Returns a TclTkIp::Future.
+ */
+static VALUE
+ip_invoke_async(int argc, VALUE *argv, VALUE obj)
 {
-    struct invoke_queue *q = (struct invoke_queue *)evPtr;
-    volatile VALUE ret;
-    volatile VALUE thread = q->thread;
+    struct invoke_queue *ivq;
     struct tcltkip *ptr;
+    struct evq_future *fp;
+    volatile VALUE future;
 
-    DUMP2("do_invoke_queue_handler : evPtr = %p", evPtr);
-    DUMP2("invoke queue_thread : %"PRIxVALUE, rb_thread_current());
-    DUMP2("added by thread : %"PRIxVALUE, thread);
-
-    if (*(q->done)) {
-        DUMP1("processed by another event-loop");
-        return 0;
-    } else {
-        DUMP1("process it on current event-loop");
-    }
-
-    if (RTEST(rb_thread_alive_p(thread))
-	&& ! RTEST(rb_funcall(thread, ID_stop_p, 0))) {
-      DUMP1("caller is not yet ready to receive the result -> pending");
-      return 0;
+    if (argc < 1) {
+        rb_raise(rb_eArgError, "command name missing");
     }
 
-    /* process it */
-    *(q->done) = 1;
+    ptr = get_ip(obj);
+    future = evq_future_new(obj, &fp);
 
-    /* deleted ipterp ? */
-    ptr = get_ip(q->interp);
-    if (deleted_ip(ptr)) {
-        /* deleted IP --> ignore */
-        return 1;
+    if (ip_is_on_eventloop(ptr)) {
+        DUMP2("invoke_async on current thread %"PRIxVALUE,
+              rb_thread_current());
+        return evq_future_complete(future, fp,
+                                   ip_invoke_real(argc, argv, obj));
     }
 
-    /* incr internal handler mark */
-    rbtk_internal_eventloop_handler++;
-
-    DUMP2("call invoke_real (for caller thread:%"PRIxVALUE")", thread);
-    DUMP2("call invoke_real (current thread:%"PRIxVALUE")", rb_thread_current());
-    ret = ip_invoke_core(q->interp, q->argc, q->argv);
-
-    /* set result */
-    RARRAY_ASET(q->result, 0, ret);
-    ret = (VALUE)NULL;
+    DUMP2("invoke_async from thread %"PRIxVALUE" (NOT current eventloop)",
+          rb_thread_current());
 
-    /* decr internal handler mark */
-    rbtk_internal_eventloop_handler--;
+    /* allocate memory (freed by Tcl_ServiceEvent) */
+    ivq = (struct invoke_queue *)evq_record_alloc();
 
-    /* complete */
-    *(q->done) = -1;
+    /* construct event data (arguments are freed by the handler) */
+    ivq->done = fp->done;
+    ivq->argc = argc;
+    ivq->argv = alloc_invoke_arguments((struct tcltkip *)NULL, argc, argv);
+    ivq->interp = obj;
+    ivq->thread = rb_thread_current();
+    ivq->ev.proc = invoke_queue_handler;
 
-    /* unlink ruby objects */
-    q->interp = (VALUE)NULL;
-    q->result = (VALUE)NULL;
-    q->thread = (VALUE)NULL;
+    evq_future_register(future, fp);
 
-    /* back to caller */
-    if (RTEST(rb_thread_alive_p(thread))) {
-      DUMP2("back to caller (caller thread:%"PRIxVALUE")", thread);
-      DUMP2("               (current thread:%"PRIxVALUE")", rb_thread_current());
-#if CONTROL_BY_STATUS_OF_RB_THREAD_WAITING_FOR_VALUE
-      have_rb_thread_waiting_for_value = 1;
-      rb_thread_wakeup(thread);
-#else
-      rb_thread_run(thread);
-#endif
-      DUMP1("finish back to caller");
-#if DO_THREAD_SCHEDULE_AT_CALLBACK_DONE
-      rb_thread_schedule();
-#endif
-    } else {
-      DUMP2("caller is dead (caller thread:%"PRIxVALUE")", thread);
-      DUMP2("               (current thread:%"PRIxVALUE")", rb_thread_current());
-    }
+    /* add the handler to Tcl event queue */
+    evq_queue_event(ptr, (Tcl_Event*)ivq, TCL_QUEUE_TAIL);
 
-    /* end of handler : remove it */
-    return 1;
+    return future;
 }
 
 /*
- * Invoke a Tcl command, queuing to the event loop if needed.
- * Tested by: test/test_threading.rb (cross-thread callback scenarios)
+ * Queue a Tcl script without waiting for the result.
+ * Ruby method: TclTkIp#_eval_async
+ * Returns a TclTkIp::Future.
  */
 static VALUE
-ip_invoke_with_position(int argc, VALUE *argv, VALUE obj, Tcl_QueuePosition position)
+ip_eval_async(VALUE self, VALUE str)
 {
-    struct invoke_queue *ivq;
+    struct eval_queue *evq;
     struct tcltkip *ptr;
-    int  *alloc_done;
-    volatile VALUE current = rb_thread_current();
-    volatile VALUE ip_obj = obj;
-    volatile VALUE result;
-    volatile VALUE ret;
-    struct timeval t;
-    Tcl_Obj **av = (Tcl_Obj **)NULL;
+    struct evq_future *fp;
+    char *eval_str;
+    volatile VALUE future;
 
-    if (argc < 1) {
-        rb_raise(rb_eArgError, "command name missing");
-    }
+    StringValue(str);
 
-    ptr = get_ip(ip_obj);
-    DUMP2("invoke status: ptr->tk_thread_id %p", ptr->tk_thread_id);
-    DUMP2("invoke status: Tcl_GetCurrentThread %p", Tcl_GetCurrentThread());
-    DUMP2("status: eventloopt_thread %"PRIxVALUE, eventloop_thread);
+    ptr = get_ip(self);
+    future = evq_future_new(self, &fp);
 
-    if ((ptr->tk_thread_id == 0 || ptr->tk_thread_id == Tcl_GetCurrentThread())
-	&& (NIL_P(eventloop_thread) || current == eventloop_thread)) {
-        if (NIL_P(eventloop_thread)) {
-            DUMP2("invoke from thread:%"PRIxVALUE" but no eventloop", current);
-        } else {
-            DUMP2("invoke from current eventloop %"PRIxVALUE, current);
-        }
-        result = ip_invoke_real(argc, argv, ip_obj);
-        if (rb_obj_is_kind_of(result, rb_eException)) {
-            rb_exc_raise(result);
-        }
-        return result;
+    if (ip_is_on_eventloop(ptr)) {
+        DUMP2("eval_async on current thread %"PRIxVALUE, rb_thread_current());
+        return evq_future_complete(future, fp,
+                                   ip_eval_real(self, RSTRING_PTR(str),
+                                                RSTRING_LENINT(str)));
     }
 
-    DUMP2("invoke from thread %"PRIxVALUE" (NOT current eventloop)", current);
-
-    /* allocate memory (for arguments) */
-    av = alloc_invoke_arguments(argc, argv);
+    DUMP2("eval_async from thread %"PRIxVALUE" (NOT current eventloop)",
+          rb_thread_current());
 
-    /* allocate memory (keep result) */
-    /* alloc_done = (int*)ALLOC(int); */
-    alloc_done = RbTk_ALLOC_N(int, 1);
-    *alloc_done = 0;
+    /* freed by the handler */
+    eval_str = ckalloc(RSTRING_LENINT(str) + 1);
+    memcpy(eval_str, RSTRING_PTR(str), RSTRING_LEN(str));
+    eval_str[RSTRING_LEN(str)] = 0;
 
     /* allocate memory (freed by Tcl_ServiceEvent) */
-    /* ivq = (struct invoke_queue *)Tcl_Alloc(sizeof(struct invoke_queue)); */
-    ivq = RbTk_ALLOC_N(struct invoke_queue, 1);
-
-    /* allocate result obj */
-    result = rb_ary_new3(1, Qnil);
+    evq = (struct eval_queue *)evq_record_alloc();
 
     /* construct event data */
-    ivq->done = alloc_done;
-    ivq->argc = argc;
-    ivq->argv = av;
-    ivq->interp = ip_obj;
-    ivq->result = result;
-    ivq->thread = current;
-    ivq->ev.proc = invoke_queue_handler;
+    evq->done = fp->done;
+    evq->str = eval_str;
+    evq->len = RSTRING_LENINT(str);
+    evq->interp = self;
+    evq->thread = rb_thread_current();
+    evq->ev.proc = eval_queue_handler;
+
+    evq_future_register(future, fp);
 
     /* add the handler to Tcl event queue */
-    DUMP1("add handler");
-    if (ptr->tk_thread_id) {
-      Tcl_ThreadQueueEvent(ptr->tk_thread_id, (Tcl_Event*)ivq, position);
-      Tcl_ThreadAlert(ptr->tk_thread_id);
-    } else if (tk_eventloop_thread_id) {
-      Tcl_ThreadQueueEvent(tk_eventloop_thread_id, (Tcl_Event*)ivq, position);
-      Tcl_ThreadAlert(tk_eventloop_thread_id);
-    } else {
-      Tcl_QueueEvent((Tcl_Event*)ivq, position);
+    evq_queue_event(ptr, (Tcl_Event*)evq, TCL_QUEUE_TAIL);
+
+    return future;
+}
+
+static struct evq_future *
+get_future(VALUE self)
+{
+    struct evq_future *fp;
+
+    TypedData_Get_Struct(self, struct evq_future, &evq_future_type, fp);
+    return fp;
+}
+
+/*
+ *  The request of a future is never processed (the eventloop thread is
+ *  lost or the interpreter is deleted). The future is released from
+ *  evq_async_table and gets a completion with the error. The old one is
+ *  abandoned to the handler (in case it still runs), unless other
+ *  threads are sleeping on it; the last of them gives it up.
+ */
+static void
+evq_future_give_up(struct evq_future *fp, const char *msg)
+{
+    struct evq_completion *c = fp->done;
+
+    if (c->state < 0 || c->waiting > 0) {
+        rb_raise(rb_eRuntimeError, "%s", msg);
     }
 
-    /* wait for the handler to be processed */
-    t.tv_sec  = 0;
-    t.tv_usec = (long)((EVENT_HANDLER_TIMEOUT)*1000.0);
+    if (c->owner) rb_hash_delete(evq_async_table, c->owner);
+    c->owner = (VALUE)0;
+    evq_completion_release(c);
 
-    DUMP2("ivq wait for handler (current thread:%"PRIxVALUE")", current);
-    while(*alloc_done >= 0) {
-      /* rb_thread_stop(); */
-      /* rb_thread_sleep_forever(); */
-      rb_thread_wait_for(t);
-      DUMP2("*** ivq wakeup (current thread:%"PRIxVALUE")", current);
-      DUMP2("***          (eventloop thread:%"PRIxVALUE")", eventloop_thread);
-      if (NIL_P(eventloop_thread)) {
-	DUMP1("*** ivq lost eventloop thread");
-	break;
-      }
+    fp->done = evq_completion_new();
+    fp->done->result = rb_exc_new2(rb_eRuntimeError, msg);
+    fp->done->state = -1;
+
+    rb_raise(rb_eRuntimeError, "%s", msg);
+}
+
+/*
+ *  Wait for the request of a future (timeout < 0 : no limit).
+ *  Returns 1 when complete, or 0 on timeout.
+ *  A request is processed by nobody else while the thread of its queue
+ *  waits for it, so that thread processes the events itself. Other
+ *  threads raise RuntimeError (as the synchronous _invoke returns) when
+ *  the eventloop thread is lost or the interpreter is deleted.
+ */
+static int
+evq_future_wait_core(struct evq_future *fp, double timeout)
+{
+    struct evq_completion *c = fp->done;
+    int on_queue = (fp->target == Tcl_GetCurrentThread());
+    Tcl_Time limit, now;
+    double rest = timeout;
+
+    if (c->state < 0) return 1;
+
+    if (timeout >= 0.0) {
+        Tcl_GetTime(&limit);
+        limit.sec  += (long)timeout;
+        limit.usec += (long)((timeout - (double)((long)timeout)) * 1000000.0);
+        if (limit.usec >= 1000000L) {
+            limit.sec++;
+            limit.usec -= 1000000L;
+        }
     }
-    DUMP2("back from handler (current thread:%"PRIxVALUE")", current);
 
-    /* get result & free allocated memory */
-    ret = RARRAY_AREF(result, 0);
-    ckfree((char*)alloc_done);
+    while(c->state >= 0) {
+        if (timeout >= 0.0) {
+            Tcl_GetTime(&now);
+            rest = (double)(limit.sec - now.sec)
+                + (double)(limit.usec - now.usec) / 1000000.0;
+            if (rest <= 0.0) return 0;
+        }
 
+        if (deleted_ip(get_ip(fp->interp))) {
+            evq_future_give_up(fp, "interpreter is deleted");
+        }
 
-    /* free allocated memory */
-    free_invoke_arguments(argc, av);
+        if (on_queue && Tcl_DoOneEvent(TCL_ALL_EVENTS | TCL_DONT_WAIT)) {
+            /* an exception of a callback (kept for an outer eventloop) */
+            pending_exception_check0();
+            continue;
+        }
 
-    /* exception? */
-    if (rb_obj_is_kind_of(ret, rb_eException)) {
-        DUMP1("raise exception");
-        /* rb_exc_raise(ret); */
-	rb_exc_raise(rb_exc_new3(rb_obj_class(ret),
-				 rb_funcallv(ret, ID_to_s, 0, 0)));
+        /* sleep a little while (to check the timeout and the thread) */
+        if (rest < 0.0 || rest > EVENT_HANDLER_TIMEOUT / 1000.0) {
+            rest = EVENT_HANDLER_TIMEOUT / 1000.0;
+        }
+        evq_completion_wait(c, rest);
+
+        if (c->state >= 0 && !on_queue && NIL_P(eventloop_thread)) {
+            evq_future_give_up(fp, "eventloop is not running");
+        }
     }
 
-    DUMP1("exit ip_invoke");
-    return ret;
+    return 1;
 }
 
+/* TclTkIp::Future#done? */
+static VALUE
+evq_future_done_p(VALUE self)
+{
+    return (get_future(self)->done->state < 0)? Qtrue: Qfalse;
+}
 
-/* get return code from Tcl_Eval() */
+/*
+ * TclTkIp::Future#wait(timeout = nil)
+ * Returns self when the request is complete, or nil on timeout.
+ */
 static VALUE
-ip_retval(VALUE self)
+evq_future_wait(int argc, VALUE *argv, VALUE self)
 {
-    struct tcltkip *ptr;        /* tcltkip data struct */
+    struct evq_future *fp = get_future(self);
+    VALUE timeout;
+    double limit = -1.0;
 
-    /* get the data strcut */
-    ptr = get_ip(self);
+    rb_scan_args(argc, argv, "01", &timeout);
 
-    /* ip is deleted? */
-    if (deleted_ip(ptr)) {
-        return rb_str_new2("");
+    if (!NIL_P(timeout)) {
+        limit = NUM2DBL(timeout);
+        if (limit < 0.0) limit = 0.0;
     }
 
-    return (INT2FIX(ptr->return_value));
+    return evq_future_wait_core(fp, limit)? self: Qnil;
 }
 
+/*
+ * TclTkIp::Future#value
+ * Waits for the request and returns its result (or raises its exception).
+ */
 static VALUE
-ip_invoke(int argc, VALUE *argv, VALUE obj)
+evq_future_value(VALUE self)
 {
-    return ip_invoke_with_position(argc, argv, obj, TCL_QUEUE_TAIL);
-}
+    struct evq_future *fp = get_future(self);
+    volatile VALUE ret;
 
-static VALUE
-ip_invoke_immediate(int argc, VALUE *argv, VALUE obj)
-{
-    /* POTENTIALY INSECURE : can create infinite loop */
-    return ip_invoke_with_position(argc, argv, obj, TCL_QUEUE_HEAD);
+    evq_future_wait_core(fp, -1.0);
+
+    ret = fp->done->result;
+
+    if (rb_obj_is_kind_of(ret, rb_eException)) {
+        DUMP1("raise exception");
+        if (fp->remote) {
+            rb_exc_raise(rb_exc_new3(rb_obj_class(ret),
+                                     rb_funcallv(ret, ID_to_s, 0, 0)));
+        } else {
+            rb_exc_raise(ret);
+        }
+    }
+
+    return ret;
 }
 
 
@@ -7062,6 +10200,15 @@ Init_tcltklib(void)
     rb_global_variable(&eventloop_stack);
     rb_global_variable(&watchdog_thread);
 
+    rb_global_variable(&jank_log);
+    rb_global_variable(&jank_hook);
+    rb_global_variable(&jank_watchdog);
+    rb_global_variable(&jank_thread);
+    rb_global_variable(&jank_backtrace);
+
+    rb_global_variable(&callback_dispatcher);
+    rb_global_variable(&rbtk_callback_cmds_marker);
+
     rb_global_variable(&rbtk_pending_exception);
 
    /* --------------------------------------------------------------- */
@@ -7150,6 +10297,8 @@ Init_tcltklib(void)
     ID_at_interp = rb_intern("@interp");
     ID_encoding_name = rb_intern("encoding_name");
     ID_encoding_table = rb_intern("encoding_table");
+    ID_at_coalesce_table = rb_intern("@coalesce_table");
+    ID_at_coalesce_queued = rb_intern("@coalesce_queued");
 
     ID_stop_p = rb_intern("stop?");
     ID_alive_p = rb_intern("alive?");
@@ -7158,6 +10307,7 @@ Init_tcltklib(void)
     ID_value = rb_intern("value");
 
     ID_call = rb_intern("call");
+    ID_callback = rb_intern("callback");
     ID_backtrace = rb_intern("backtrace");
     ID_message = rb_intern("message");
 
@@ -7191,16 +10341,56 @@ Init_tcltklib(void)
     rb_define_module_function(lib, "get_eventloop_tick",get_eventloop_tick,0);
     rb_define_module_function(lib, "set_no_event_wait", set_no_event_wait, 1);
     rb_define_module_function(lib, "get_no_event_wait", get_no_event_wait, 0);
+    rb_define_module_function(lib, "set_eventloop_nogvl",
+                              set_eventloop_nogvl, 1);
+    rb_define_module_function(lib, "get_eventloop_nogvl",
+                              get_eventloop_nogvl, 0);
     rb_define_module_function(lib, "set_eventloop_weight",
                               set_eventloop_weight, 2);
     rb_define_module_function(lib, "set_max_block_time", set_max_block_time,1);
     rb_define_module_function(lib, "get_eventloop_weight",
                               get_eventloop_weight, 0);
+    rb_define_module_function(lib, "set_eventloop_adaptive",
+                              set_eventloop_adaptive, 1);
+    rb_define_module_function(lib, "get_eventloop_adaptive",
+                              get_eventloop_adaptive, 0);
+    rb_define_module_function(lib, "set_eventloop_stats_mode",
+                              set_eventloop_stats_mode, 1);
+    rb_define_module_function(lib, "get_eventloop_stats_mode",
+                              get_eventloop_stats_mode, 0);
+    rb_define_module_function(lib, "eventloop_stats",
+                              lib_eventloop_stats, 0);
+    rb_define_module_function(lib, "reset_eventloop_stats",
+                              reset_eventloop_stats, 0);
+    rb_define_module_function(lib, "start_trace", lib_start_trace, -1);
+    rb_define_module_function(lib, "stop_trace", lib_stop_trace, 0);
+    rb_define_module_function(lib, "clear_trace", lib_clear_trace, 0);
+    rb_define_module_function(lib, "trace_json", lib_trace_json, 0);
+    rb_define_module_function(lib, "set_callback_jank_threshold",
+                              set_callback_jank_threshold, 1);
+    rb_define_module_function(lib, "get_callback_jank_threshold",
+                              get_callback_jank_threshold, 0);
+    rb_define_module_function(lib, "set_callback_jank_hook",
+                              set_callback_jank_hook, 1);
+    rb_define_module_function(lib, "callback_jank_log",
+                              lib_callback_jank_log, 0);
+    rb_define_module_function(lib, "clear_callback_jank_log",
+                              lib_clear_callback_jank_log, 0);
     rb_define_module_function(lib, "num_of_mainwindows",
                               lib_num_of_mainwindows, 0);
 
     /* --------------------------------------------------------------- */
 
+    rb_define_module_function(lib, "_set_callback_dispatcher",
+                              lib_set_callback_dispatcher, 1);
+    rb_define_module_function(lib, "set_eval_cache_size",
+                              lib_set_eval_cache_size, 1);
+    rb_define_module_function(lib, "get_eval_cache_size",
+                              lib_get_eval_cache_size, 0);
+    rb_define_module_function(lib, "eval_cache_stats",
+                              lib_eval_cache_stats, 0);
+    rb_define_module_function(lib, "reset_eval_cache_stats",
+                              lib_reset_eval_cache_stats, 0);
     rb_define_module_function(lib, "_split_tklist", lib_split_tklist, 1);
     rb_define_module_function(lib, "_merge_tklist", lib_merge_tklist, -1);
     rb_define_module_function(lib, "_conv_listelement",
@@ -7243,7 +10433,17 @@ Init_tcltklib(void)
     rb_define_method(ip, "_thread_vwait", ip_thread_vwait, 1);
     rb_define_method(ip, "_thread_tkwait", ip_thread_tkwait, 2);
     rb_define_method(ip, "_invoke", ip_invoke, -1);
+    rb_define_method(ip, "_invoke_typed", ip_invoke_typed, -1);
     rb_define_method(ip, "_immediate_invoke", ip_invoke_immediate, -1);
+    rb_define_method(ip, "_invoke_async", ip_invoke_async, -1);
+    rb_define_method(ip, "_eval_async", ip_eval_async, 1);
+    rb_define_method(ip, "_invoke_batch", ip_invoke_batch, 1);
+    rb_define_method(ip, "_invoke_nowait", ip_invoke_nowait, -1);
+    rb_define_method(ip, "_create_callback_command",
+                     ip_create_callback_command, 2);
+    rb_define_method(ip, "_delete_callback_command",
+                     ip_delete_callback_command, 1);
+    rb_define_method(ip, "_invoke_coalesced", ip_invoke_coalesced, -1);
     rb_define_method(ip, "_return_value", ip_retval, 0);
 
     rb_define_method(ip, "_create_console", ip_create_console, 0);
@@ -7288,13 +10488,37 @@ Init_tcltklib(void)
     rb_define_method(ip, "get_eventloop_tick", ip_get_eventloop_tick, 0);
     rb_define_method(ip, "set_no_event_wait", ip_set_no_event_wait, 1);
     rb_define_method(ip, "get_no_event_wait", ip_get_no_event_wait, 0);
+    rb_define_method(ip, "set_eventloop_nogvl", ip_set_eventloop_nogvl, 1);
+    rb_define_method(ip, "get_eventloop_nogvl", ip_get_eventloop_nogvl, 0);
     rb_define_method(ip, "set_eventloop_weight", ip_set_eventloop_weight, 2);
     rb_define_method(ip, "get_eventloop_weight", ip_get_eventloop_weight, 0);
+    rb_define_method(ip, "set_eventloop_adaptive",
+                     ip_set_eventloop_adaptive, 1);
+    rb_define_method(ip, "get_eventloop_adaptive",
+                     ip_get_eventloop_adaptive, 0);
     rb_define_method(ip, "set_max_block_time", set_max_block_time, 1);
     rb_define_method(ip, "restart", ip_restart, 0);
 
     /* --------------------------------------------------------------- */
 
+    cIpFuture = rb_define_class_under(ip, "Future", rb_cObject);
+    rb_undef_alloc_func(cIpFuture);
+    rb_define_method(cIpFuture, "value", evq_future_value, 0);
+    rb_define_method(cIpFuture, "wait", evq_future_wait, -1);
+    rb_define_method(cIpFuture, "done?", evq_future_done_p, 0);
+
+    evq_ring_init();
+
+    rb_global_variable(&evq_pool);
+    /* (the data pointer must not be NULL to be marked) */
+    evq_pool = TypedData_Wrap_Struct(0, &evq_pool_type, &evq_pool_slabs);
+
+    rb_global_variable(&evq_async_table);
+    evq_async_table = rb_hash_new();
+    rb_funcall(evq_async_table, rb_intern("compare_by_identity"), 0);
+
+    /* --------------------------------------------------------------- */
+
     eventloop_thread = Qnil;
     eventloop_interp = (Tcl_Interp*)NULL;
 
@@ -7305,6 +10529,17 @@ Init_tcltklib(void)
 
     watchdog_thread  = Qnil;
 
+    jank_log = rb_ary_new();
+    jank_hook = Qnil;
+    jank_watchdog = Qnil;
+    jank_thread = Qnil;
+    jank_backtrace = Qnil;
+
+    callback_dispatcher = Qnil;
+    rbtk_callback_cmds_marker =
+        TypedData_Wrap_Struct(0, &rbtk_callback_cmds_type,
+                              &rbtk_callback_cmds);
+
     rbtk_pending_exception = Qnil;
 
     /* --------------------------------------------------------------- */
@@ -31,6 +31,8 @@ extern char *strndup(const char* _ptr, size_t _len);
 
 static VALUE cMethod;
 
+static VALUE mTkUtil;
+
 static VALUE cTclTkLib;
 
 static VALUE cTkObject;
@@ -58,11 +60,31 @@ static ID ID_merge_tklist;
 static ID ID_encoding;
 static ID ID_encoding_system;
 static ID ID_call;
+static ID ID_owner;
+static ID ID_name;
+static ID ID_tk_windows;
 
 static ID ID_SUBST_INFO;
 
-static VALUE CALLBACK_TABLE;
-static unsigned long CALLBACK_ID_NUM = 0;
+/*
+ *  callback slots (TkUtil.install_cmd, ids of TkComm.install_cmd)
+ *  A handle of a callback is (generation << CALLBACK_SLOT_BITS | index).
+ *  'callback_slot_next' links the free slots (a live slot has
+ *  CALLBACK_SLOT_LIVE), so install/uninstall/lookup are O(1) and the
+ *  table does not grow beyond the max number of live callbacks. A free
+ *  slot of CALLBACK_SLOTS holds nil. The generation is incremented when
+ *  the slot is freed, so a stale handle never calls (or frees) the
+ *  callback which reuses the slot.
+ */
+#define CALLBACK_SLOT_BITS 24
+#define CALLBACK_SLOT_MASK ((1UL << CALLBACK_SLOT_BITS) - 1)
+#define CALLBACK_SLOT_LIVE (-2)
+
+static VALUE CALLBACK_SLOTS;
+static unsigned long *callback_slot_gen = (unsigned long *)NULL;
+static long *callback_slot_next = (long *)NULL;
+static long callback_slot_capa = 0;
+static long callback_slot_free = -1;    /* head of the free list */
 
 /*************************************/
 
@@ -153,26 +175,109 @@ tk_eval_cmd(int argc, VALUE *argv, VALUE self)
 #endif
 }
 
+static unsigned long
+callback_slot_install(VALUE cmd)
+{
+    long idx;
+
+    if (callback_slot_free >= 0) {
+        idx = callback_slot_free;
+        callback_slot_free = callback_slot_next[idx];
+    } else {
+        idx = RARRAY_LEN(CALLBACK_SLOTS);
+        if ((unsigned long)idx > CALLBACK_SLOT_MASK) {
+            rb_raise(rb_eRuntimeError, "too many callbacks");
+        }
+        if (idx >= callback_slot_capa) {
+            callback_slot_capa = (callback_slot_capa == 0)?
+                                 64: callback_slot_capa * 2;
+            REALLOC_N(callback_slot_gen, unsigned long, callback_slot_capa);
+            REALLOC_N(callback_slot_next, long, callback_slot_capa);
+        }
+        callback_slot_gen[idx] = 0;
+    }
+    rb_ary_store(CALLBACK_SLOTS, idx, cmd);
+    callback_slot_next[idx] = CALLBACK_SLOT_LIVE;
+
+    return (callback_slot_gen[idx] << CALLBACK_SLOT_BITS) | idx;
+}
+
+static long
+callback_slot_index(unsigned long handle)
+{
+    long idx = (long)(handle & CALLBACK_SLOT_MASK);
+
+    if (idx >= RARRAY_LEN(CALLBACK_SLOTS)
+        || callback_slot_gen[idx] != (handle >> CALLBACK_SLOT_BITS)
+        || callback_slot_next[idx] != CALLBACK_SLOT_LIVE) {
+        return -1;
+    }
+    return idx;
+}
+
 static VALUE
-tk_do_callback(int argc, VALUE *argv, VALUE self)
+callback_slot_uninstall(unsigned long handle)
 {
-    return rb_funcall2(rb_hash_aref(CALLBACK_TABLE, argv[0]),
-                       ID_call, argc - 1, argv + 1);
+    long idx = callback_slot_index(handle);
+    VALUE cmd;
+
+    if (idx < 0) return Qnil;
+
+    cmd = RARRAY_AREF(CALLBACK_SLOTS, idx);
+    rb_ary_store(CALLBACK_SLOTS, idx, Qnil);
+    callback_slot_next[idx] = callback_slot_free;
+    callback_slot_free = idx;
+    callback_slot_gen[idx]++;
+
+    return cmd;
 }
 
 static const char cmd_id_head[] = "ruby_cmd TkUtil callback ";
 static const char cmd_id_prefix[] = "cmd";
 
+/* "cmd<handle>" --> handle */
+static int
+callback_slot_handle(const char *str, unsigned long *handle)
+{
+    size_t prefix_len = strlen(cmd_id_prefix);
+    char *end;
+
+    if (strncmp(cmd_id_prefix, str, prefix_len) != 0) return 0;
+    str += prefix_len;
+    if (*str < '0' || '9' < *str) return 0;
+    *handle = strtoul(str, &end, 10);
+    return (*end == '\0');
+}
+
+static VALUE
+tk_do_callback(int argc, VALUE *argv, VALUE self)
+{
+    unsigned long handle;
+    long idx = -1;
+
+    if (argc < 1) {
+        rb_raise(rb_eArgError, "too few arguments");
+    }
+    if (callback_slot_handle(StringValueCStr(argv[0]), &handle)) {
+        idx = callback_slot_index(handle);
+    }
+    if (idx < 0) {
+        rb_raise(rb_eIndexError, "unknown command ID '%"PRIsVALUE"'",
+                 argv[0]);
+    }
+
+    return rb_funcall2(RARRAY_AREF(CALLBACK_SLOTS, idx),
+                       ID_call, argc - 1, argv + 1);
+}
+
 static VALUE
 tk_install_cmd_core(VALUE cmd)
 {
-    volatile VALUE id_num;
+    char buf[sizeof(cmd_id_head) + sizeof(cmd_id_prefix) + 24];
 
-    id_num = ULONG2NUM(CALLBACK_ID_NUM++);
-    id_num = rb_funcallv(id_num, ID_to_s, 0, 0);
-    id_num = rb_str_append(rb_str_new2(cmd_id_prefix), id_num);
-    rb_hash_aset(CALLBACK_TABLE, id_num, cmd);
-    return rb_str_append(rb_str_new2(cmd_id_head), id_num);
+    snprintf(buf, sizeof(buf), "%s%s%lu", cmd_id_head, cmd_id_prefix,
+             callback_slot_install(cmd));
+    return rb_str_new2(buf);
 }
 
 static VALUE
@@ -192,19 +297,37 @@ static VALUE
 tk_uninstall_cmd(VALUE self, VALUE cmd_id)
 {
     size_t head_len = strlen(cmd_id_head);
-    size_t prefix_len = strlen(cmd_id_prefix);
+    unsigned long handle;
 
-    StringValue(cmd_id);
+    StringValueCStr(cmd_id);
     if (strncmp(cmd_id_head, RSTRING_PTR(cmd_id), head_len) != 0) {
         return Qnil;
     }
-    if (strncmp(cmd_id_prefix,
-                RSTRING_PTR(cmd_id) + head_len, prefix_len) != 0) {
+    if (!callback_slot_handle(RSTRING_PTR(cmd_id) + head_len, &handle)) {
         return Qnil;
     }
 
-    return rb_hash_delete(CALLBACK_TABLE,
-                          rb_str_new2(RSTRING_PTR(cmd_id) + head_len));
+    return callback_slot_uninstall(handle);
+}
+
+/* a slot for the id of TkComm.install_cmd ("c<handle>") */
+static VALUE
+tk_install_slot(VALUE self, VALUE cmd)
+{
+    return ULONG2NUM(callback_slot_install(cmd));
+}
+
+static VALUE
+tk_uninstall_slot(VALUE self, VALUE handle)
+{
+    return callback_slot_uninstall(NUM2ULONG(handle));
+}
+
+/* number of the slots (live and free) of the callback table */
+static VALUE
+tk_callback_slots_size(VALUE self)
+{
+    return LONG2NUM(RARRAY_LEN(CALLBACK_SLOTS));
 }
 
 static VALUE
@@ -873,6 +996,107 @@ tk_conv_args(
     return rb_ary_plus(argv[0], dst);
 }
 
+static int tk_typed_arg_p(VALUE obj);
+
+static VALUE
+tk_typed_ary_p(VALUE ary, VALUE dummy, int recur)
+{
+    long i;
+
+    if (recur) {
+        rb_raise(rb_eArgError, "recursive array");
+    }
+
+    for(i = 0; i < RARRAY_LEN(ary); i++) {
+        if (!tk_typed_arg_p(RARRAY_AREF(ary, i))) return Qfalse;
+    }
+    return Qtrue;
+}
+
+/*
+ * Arguments which TclTkIp#_invoke converts to Tcl_Objs by itself:
+ * Integer, Float and (nested) Arrays of them.
+ */
+static int
+tk_typed_arg_p(VALUE obj)
+{
+    switch(TYPE(obj)) {
+    case T_FIXNUM:
+    case T_BIGNUM:
+    case T_FLOAT:
+        return 1;
+
+    case T_ARRAY:
+        return RTEST(rb_exec_recursive(tk_typed_ary_p, obj, 0));
+
+    default:
+        return 0;
+    }
+}
+
+static int
+push_kv_typed(VALUE key, VALUE val, VALUE args)
+{
+    volatile VALUE ary;
+
+    ary = RARRAY_AREF(args, 0);
+
+    /* frozen and deduplicated : TclTkIp#_invoke interns it */
+    rb_ary_push(ary, rb_str_to_interned_str(key2keyname(key)));
+
+    if (val == TK_None) return ST_CHECK;
+
+    if (tk_typed_arg_p(val)) {
+        rb_ary_push(ary, val);
+    } else {
+        rb_ary_push(ary, get_eval_string_core(val, RARRAY_AREF(args, 2),
+                                              RARRAY_AREF(args, 1)));
+    }
+
+    return ST_CHECK;
+}
+
+/*
+ * Same as _conv_args, but keeps numbers and numeric lists as they are
+ * (for TclTkIp#_invoke, which builds typed Tcl_Objs from them).
+ */
+static VALUE
+tk_conv_invoke_args(
+    int   argc,
+    VALUE *argv, /* [0]:base_array, [1]:enc_mode, [2]..[n]:args */
+    VALUE self
+)
+{
+    int idx;
+    long size;
+    volatile VALUE dst, kv_args;
+
+    if (argc < 2) {
+      rb_raise(rb_eArgError, "too few arguments");
+    }
+
+    for(size = 0, idx = 2; idx < argc; idx++) {
+        if (RB_TYPE_P(argv[idx], T_HASH)) {
+            size += 2 * RHASH_SIZE(argv[idx]);
+        } else {
+            size++;
+        }
+    }
+    dst = rb_ary_new2(size);
+    kv_args = rb_ary_new3(3, dst, self, RTEST(argv[1])? Qtrue: Qnil);
+    for(idx = 2; idx < argc; idx++) {
+        if (RB_TYPE_P(argv[idx], T_HASH)) {
+            rb_hash_foreach(argv[idx], push_kv_typed, kv_args);
+        } else if (tk_typed_arg_p(argv[idx])) {
+            rb_ary_push(dst, argv[idx]);
+        } else if (argv[idx] != TK_None) {
+            rb_ary_push(dst, get_eval_string_core(argv[idx], argv[1], self));
+        }
+    }
+
+    return rb_ary_plus(argv[0], dst);
+}
+
 
 /*************************************/
 
@@ -1005,14 +1229,26 @@ tcl2rb_num_or_nil(VALUE self, VALUE value)
 /*************************************/
 
 #define CBSUBST_TBL_MAX (256)
+
+/* native converters of the procs registered by _setup_subst_table */
+#define CBSUBST_CONV_PROC       0  /* call the proc */
+#define CBSUBST_CONV_NUM_OR_STR 1  /* TkComm.num_or_str */
+#define CBSUBST_CONV_NUMBER     2  /* TkComm.number */
+#define CBSUBST_CONV_NUM_OR_NIL 3  /* TkComm.num_or_nil */
+#define CBSUBST_CONV_STRING     4  /* TkComm.string */
+#define CBSUBST_CONV_BOOL       5  /* TkComm.bool */
+#define CBSUBST_CONV_WINDOW     6  /* TkComm.window */
+
 struct cbsubst_info {
     long  full_subst_length;
     long  keylen[CBSUBST_TBL_MAX];
     char  *key[CBSUBST_TBL_MAX];
     char  type[CBSUBST_TBL_MAX];
+    char  conv[CBSUBST_TBL_MAX];  /* type char --> CBSUBST_CONV_* */
     ID    ivar[CBSUBST_TBL_MAX];
     VALUE proc;
     VALUE aliases;
+    VALUE attrs;  /* attribute name (Symbol) --> subst key char */
 };
 
 static void
@@ -1021,6 +1257,7 @@ subst_mark(void *arg)
     struct cbsubst_info *ptr = (struct cbsubst_info *)arg;
     rb_gc_mark(ptr->proc);
     rb_gc_mark(ptr->aliases);
+    rb_gc_mark(ptr->attrs);
 }
 
 static void
@@ -1061,7 +1298,7 @@ static VALUE
 allocate_cbsubst_info(struct cbsubst_info **inf_ptr)
 {
   struct cbsubst_info *inf;
-  volatile VALUE proc, aliases;
+  volatile VALUE proc, aliases, attrs;
   int idx;
 
   VALUE info = TypedData_Make_Struct(cSUBST_INFO, struct cbsubst_info,
@@ -1073,6 +1310,7 @@ allocate_cbsubst_info(struct cbsubst_info **inf_ptr)
     inf->keylen[idx] = 0;
     inf->key[idx]    = NULL;
     inf->type[idx]   = '\0';
+    inf->conv[idx]   = CBSUBST_CONV_PROC;
     inf->ivar[idx]   = (ID) 0;
   }
 
@@ -1082,6 +1320,9 @@ allocate_cbsubst_info(struct cbsubst_info **inf_ptr)
   aliases = rb_hash_new();
   inf->aliases = aliases;
 
+  attrs = rb_hash_new();
+  inf->attrs = attrs;
+
   if (inf_ptr != (struct cbsubst_info **)NULL) *inf_ptr = inf;
 
   return info;
@@ -1100,6 +1341,335 @@ cbsubst_get_ptr(VALUE klass)
     return rb_check_typeddata(rb_const_get(klass, ID_SUBST_INFO), &cbsubst_info_type);
 }
 
+/*
+ * Native converters.
+ * A plain decimal integer (the common case of %x, %y, %#, ...) is
+ * converted without rb_str_to_inum, and strings which cannot be numbers
+ * (e.g. "??" of a field which is not valid for the event) skip the
+ * exceptions of tkstr_to_number. Others take the original path.
+ */
+#define CBSUBST_FAST_INT_DIGITS \
+    ((long)((sizeof(long) * CHAR_BIT - 1) * 30103UL / 100000UL))
+
+static int
+cbsubst_fast_int(VALUE value, VALUE *ret)
+{
+    const char *ptr = RSTRING_PTR(value);
+    long len = RSTRING_LEN(value);
+    long i = 0, num = 0;
+    int neg = 0;
+
+    if (len == 0) return 0;
+    if (*ptr == '-') {
+      neg = 1;
+      if (++i == len) return 0;
+    }
+    /* digits which never overflow a long (18 for 64bit, 9 for 32bit) */
+    if (len - i > CBSUBST_FAST_INT_DIGITS) return 0;
+    /* "010" is an octal number for rb_str_to_inum */
+    if (ptr[i] == '0' && len - i > 1) return 0;
+    for(; i < len; i++) {
+      if (ptr[i] < '0' || ptr[i] > '9') return 0;
+      num = num * 10 + (ptr[i] - '0');
+    }
+
+    *ret = LONG2NUM(neg ? -num : num);
+    return 1;
+}
+
+static int
+cbsubst_not_number(VALUE value)
+{
+    return (RSTRING_LEN(value) == 0
+	    || ISALPHA(RSTRING_PTR(value)[0]) || RSTRING_PTR(value)[0] == '?');
+}
+
+static VALUE
+cbsubst_window(VALUE value, VALUE proc)
+{
+    static VALUE interp = Qnil;
+    volatile VALUE tbl, win;
+
+    if (RB_TYPE_P(value, T_STRING)
+	&& RSTRING_LEN(value) > 0 && RSTRING_PTR(value)[0] == '.') {
+      if (NIL_P(interp)) {
+	interp = rb_const_get(rb_const_get(rb_cObject, rb_intern("TkCore")),
+			      rb_intern("INTERP"));
+	rb_global_variable(&interp);
+      }
+      tbl = rb_funcall(interp, ID_tk_windows, 0);
+      if (RB_TYPE_P(tbl, T_HASH)) {
+	win = rb_hash_lookup2(tbl, value, Qnil);
+	if (RTEST(win)) return win;
+      }
+    }
+
+    /* not a known widget */
+    return rb_funcall(proc, ID_call, 1, value);
+}
+
+static VALUE
+cbsubst_convert(const struct cbsubst_info *inf, unsigned char type_chr,
+		VALUE value)
+{
+    VALUE ret, proc;
+
+    if (type_chr == 0) return value;
+
+    if (RB_TYPE_P(value, T_STRING)) {
+      switch(inf->conv[type_chr]) {
+      case CBSUBST_CONV_NUM_OR_STR:
+	if (cbsubst_fast_int(value, &ret)) return ret;
+	if (cbsubst_not_number(value)) return tkstr_to_str(value, Qnil);
+	return tcl2rb_num_or_str(Qnil, value);
+
+      case CBSUBST_CONV_NUMBER:
+	if (cbsubst_fast_int(value, &ret)) return ret;
+	return tcl2rb_number(Qnil, value);
+
+      case CBSUBST_CONV_NUM_OR_NIL:
+	if (cbsubst_fast_int(value, &ret)) return ret;
+	return tcl2rb_num_or_nil(Qnil, value);
+
+      case CBSUBST_CONV_STRING:
+	return tcl2rb_string(Qnil, value);
+
+      case CBSUBST_CONV_BOOL:
+	if (RSTRING_LEN(value) == 1) {
+	  if (RSTRING_PTR(value)[0] == '0') return Qfalse;
+	  if (RSTRING_PTR(value)[0] == '1') return Qtrue;
+	}
+	return tcl2rb_bool(Qnil, value);
+      }
+    }
+
+    proc = rb_hash_aref(inf->proc, INT2FIX((int)type_chr));
+    if (NIL_P(proc)) return value;
+
+    if (inf->conv[type_chr] == CBSUBST_CONV_WINDOW) {
+      return cbsubst_window(value, proc);
+    }
+    return rb_funcall(proc, ID_call, 1, value);
+}
+
+/* CBSUBST_CONV_* for a converter proc given to _setup_subst_table */
+static char
+cbsubst_conv_type(VALUE proc)
+{
+    VALUE owner;
+    ID name;
+
+    if (!rb_obj_is_method(proc)) return CBSUBST_CONV_PROC;
+
+    owner = rb_funcall(proc, ID_owner, 0);
+    name = SYM2ID(rb_funcall(proc, ID_name, 0));
+
+    if (owner == mTkUtil) {
+      if (name == rb_intern("num_or_str")) return CBSUBST_CONV_NUM_OR_STR;
+      if (name == rb_intern("number"))     return CBSUBST_CONV_NUMBER;
+      if (name == rb_intern("num_or_nil")) return CBSUBST_CONV_NUM_OR_NIL;
+      if (name == rb_intern("string"))     return CBSUBST_CONV_STRING;
+      if (name == rb_intern("bool"))       return CBSUBST_CONV_BOOL;
+    } else if (name == rb_intern("window")
+	       && rb_const_defined(rb_cObject, rb_intern("TkComm"))) {
+      VALUE mTkComm = rb_const_get(rb_cObject, rb_intern("TkComm"));
+      if (owner == mTkComm || owner == rb_singleton_class(mTkComm)) {
+	return CBSUBST_CONV_WINDOW;
+      }
+    }
+
+    return CBSUBST_CONV_PROC;
+}
+
+/*
+ * Packed fields of a callback argument object.
+ * scan_new keeps the raw substituted strings of a callback and converts
+ * each of them only when its attribute is read for the first time.
+ * Objects created by new() keep their fields in instance variables.
+ */
+struct cbsubst_fields {
+    VALUE info;   /* SUBST_INFO of the class (0 : fields are ivars) */
+    VALUE keys;   /* subst key chars of the raw values */
+    VALUE raw;    /* raw values (Tcl strings) */
+    VALUE *vals;  /* converted values (Qundef : not converted yet) */
+    long  len;
+};
+
+static void
+subst_fields_mark(void *arg)
+{
+    struct cbsubst_fields *ptr = (struct cbsubst_fields *)arg;
+    long idx;
+
+    if (!ptr->info) return;
+
+    rb_gc_mark(ptr->info);
+    rb_gc_mark(ptr->keys);
+    rb_gc_mark(ptr->raw);
+    for(idx = 0; idx < ptr->len; idx++) {
+      if (ptr->vals[idx] != Qundef) rb_gc_mark(ptr->vals[idx]);
+    }
+}
+
+static void
+subst_fields_free(void *arg)
+{
+    struct cbsubst_fields *ptr = (struct cbsubst_fields *)arg;
+
+    if (ptr) {
+      if (ptr->vals) xfree(ptr->vals);
+      xfree(ptr);
+    }
+}
+
+static size_t
+subst_fields_memsize(const void *arg)
+{
+    const struct cbsubst_fields *ptr = (const struct cbsubst_fields *)arg;
+    return sizeof(*ptr) + ptr->len * sizeof(VALUE);
+}
+
+static const rb_data_type_t cbsubst_fields_type = {
+    "TkUtil/CallbackSubst",
+    {
+	subst_fields_mark,
+	subst_fields_free,
+	subst_fields_memsize,
+    },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE
+cbsubst_alloc(VALUE klass)
+{
+    struct cbsubst_fields *fields;
+
+    return TypedData_Make_Struct(klass, struct cbsubst_fields,
+				 &cbsubst_fields_type, fields);
+}
+
+static VALUE
+cbsubst_scan_new(VALUE self, VALUE arg_key, VALUE val_ary)
+{
+    struct cbsubst_fields *fields;
+    volatile VALUE info, obj;
+    long idx, len;
+
+    StringValue(arg_key);
+    Check_Type(val_ary, T_ARRAY);
+
+    info = rb_const_get(self, ID_SUBST_INFO);
+    rb_check_typeddata(info, &cbsubst_info_type);
+
+    obj = rb_obj_alloc(self);
+    TypedData_Get_Struct(obj, struct cbsubst_fields,
+			 &cbsubst_fields_type, fields);
+
+    len = RARRAY_LEN(val_ary);
+    if (len > RSTRING_LEN(arg_key)) len = RSTRING_LEN(arg_key);
+
+    fields->vals = ALLOC_N(VALUE, len);
+    for(idx = 0; idx < len; idx++) {
+      fields->vals[idx] = Qundef;
+    }
+    fields->len  = len;
+    fields->keys = rb_str_new_frozen(arg_key);
+    fields->raw  = val_ary;   /* not copied */
+    fields->info = info;      /* must be the last (see subst_fields_mark) */
+
+    return obj;
+}
+
+static VALUE
+cbsubst_attr_reader(VALUE self)
+{
+    struct cbsubst_fields *fields;
+    struct cbsubst_info *inf;
+    const char *keys, *pos;
+    volatile VALUE chr, val;
+    long idx;
+
+    fields = rb_check_typeddata(self, &cbsubst_fields_type);
+
+    if (!fields->info) {
+      /* created by new() */
+      inf = cbsubst_get_ptr(rb_obj_class(self));
+      chr = rb_hash_aref(inf->attrs, ID2SYM(rb_frame_this_func()));
+      if (NIL_P(chr)) return Qnil;
+      return rb_attr_get(self, inf->ivar[FIX2INT(chr)]);
+    }
+
+    inf = RTYPEDDATA_DATA(fields->info);
+    chr = rb_hash_aref(inf->attrs, ID2SYM(rb_frame_this_func()));
+    if (NIL_P(chr)) return Qnil;
+
+    keys = RSTRING_PTR(fields->keys);
+    pos = memchr(keys, FIX2INT(chr), fields->len);
+    if (pos == NULL) return Qnil;  /* not substituted */
+    idx = pos - keys;
+
+    if (fields->vals[idx] == Qundef) {
+      val = cbsubst_convert(inf, inf->type[FIX2INT(chr)],
+			    rb_ary_entry(fields->raw, idx));
+      fields->vals[idx] = val;
+    }
+
+    return fields->vals[idx];
+}
+
+static VALUE
+cbsubst_init_copy(VALUE self, VALUE orig)
+{
+    struct cbsubst_fields *dst, *src;
+
+    if (self == orig) return self;
+    rb_call_super(1, &orig);
+
+    dst = rb_check_typeddata(self, &cbsubst_fields_type);
+    src = rb_check_typeddata(orig, &cbsubst_fields_type);
+
+    if (src->info) {
+      if (dst->vals) xfree(dst->vals);
+      dst->info = 0;
+      dst->vals = ALLOC_N(VALUE, src->len);
+      MEMCPY(dst->vals, src->vals, VALUE, src->len);
+      dst->len  = src->len;
+      dst->keys = src->keys;
+      dst->raw  = src->raw;
+      dst->info = src->info;
+    }
+
+    return self;
+}
+
+static VALUE
+cbsubst_fields_inspect(VALUE self)
+{
+    struct cbsubst_fields *fields;
+    struct cbsubst_info *inf;
+    const unsigned char *keys;
+    volatile VALUE str;
+    long idx;
+
+    fields = rb_check_typeddata(self, &cbsubst_fields_type);
+    if (!fields->info) return rb_call_super(0, 0);
+
+    inf = RTYPEDDATA_DATA(fields->info);
+    keys = (const unsigned char *)RSTRING_PTR(fields->keys);
+
+    /* raw values only; inspect should not run the converters */
+    str = rb_sprintf("#<%"PRIsVALUE, rb_class_name(rb_obj_class(self)));
+    for(idx = 0; idx < fields->len; idx++) {
+      if (inf->ivar[keys[idx]] == (ID) 0) continue;
+      rb_str_catf(str, " %"PRIsVALUE"=%+"PRIsVALUE,
+		  rb_id2str(inf->ivar[keys[idx]]),
+		  rb_ary_entry(fields->raw, idx));
+    }
+    rb_str_cat2(str, ">");
+
+    return str;
+}
+
 static VALUE
 cbsubst_initialize(int argc, VALUE *argv, VALUE self)
 {
@@ -1418,8 +1988,9 @@ cbsubst_table_setup(int argc, VALUE *argv, VALUE self)
 
     id = SYM2ID(ivar);
     subst_inf->ivar[chr] = rb_intern_str(rb_sprintf("@%"PRIsVALUE, rb_id2str(id)));
+    rb_hash_aset(subst_inf->attrs, ID2SYM(id), INT2FIX((int)chr));
 
-    rb_attr(self, id, 1, 0, Qtrue);
+    rb_define_method_id(self, id, cbsubst_attr_reader, 0);
   }
   RB_GC_GUARD(key_inf);
 
@@ -1450,8 +2021,9 @@ cbsubst_table_setup(int argc, VALUE *argv, VALUE self)
 
     id = SYM2ID(ivar);
     subst_inf->ivar[chr] = rb_intern_str(rb_sprintf("@%"PRIsVALUE, rb_id2str(id)));
+    rb_hash_aset(subst_inf->attrs, ID2SYM(id), INT2FIX((int)chr));
 
-    rb_attr(self, id, 1, 0, Qtrue);
+    rb_define_method_id(self, id, cbsubst_attr_reader, 0);
   }
   RB_GC_GUARD(longkey_inf);
 
@@ -1469,6 +2041,7 @@ cbsubst_table_setup(int argc, VALUE *argv, VALUE self)
     if (RB_TYPE_P(type, T_STRING))
       type = INT2FIX(*(RSTRING_PTR(type)));
     rb_hash_aset(subst_inf->proc, type, proc);
+    subst_inf->conv[(unsigned char)NUM2CHR(type)] = cbsubst_conv_type(proc);
   }
   RB_GC_GUARD(proc_inf);
 
@@ -1493,29 +2066,20 @@ cbsubst_scan_args(VALUE self, VALUE arg_key, VALUE val_ary)
     long vallen = (Check_Type(val_ary, T_ARRAY), RARRAY_LEN(val_ary));
     unsigned char type_chr;
     volatile VALUE dst = rb_ary_new2(vallen);
-    volatile VALUE proc;
 
     inf = cbsubst_get_ptr(self);
 
     for(idx = 0; idx < vallen; idx++) {
       if (idx >= keylen) {
-	proc = Qnil;
+	type_chr = 0;
       } else if (*(keyptr + idx) == ' ') {
-	proc = Qnil;
+	type_chr = 0;
       } else {
-	if ((type_chr = inf->type[*(keyptr + idx)]) != 0) {
-	  proc = rb_hash_aref(inf->proc, INT2FIX((int)type_chr));
-	} else {
-	  proc = Qnil;
-	}
+	type_chr = inf->type[*(keyptr + idx)];
       }
 
-      if (NIL_P(proc)) {
-	rb_ary_push(dst, RARRAY_AREF(val_ary, idx));
-      } else {
-	rb_ary_push(dst, rb_funcall(proc, ID_call, 1,
-				    RARRAY_AREF(val_ary, idx)));
-      }
+      rb_ary_push(dst, cbsubst_convert(inf, type_chr,
+				       RARRAY_AREF(val_ary, idx)));
     }
 
     return dst;
@@ -1560,6 +2124,9 @@ Init_tkutil(void)
     VALUE cTK = rb_define_class("TkKernel", rb_cObject);
     VALUE mTK = rb_define_module("TkUtil");
 
+    rb_global_variable(&mTkUtil);
+    mTkUtil = mTK;
+
     /* --------------------- */
 
     rb_define_const(mTK, "RELEASE_DATE",
@@ -1581,6 +2148,9 @@ Init_tkutil(void)
     ID_encoding = rb_intern("encoding");
     ID_encoding_system = rb_intern("encoding_system");
     ID_call = rb_intern("call");
+    ID_owner = rb_intern("owner");
+    ID_name = rb_intern("name");
+    ID_tk_windows = rb_intern("tk_windows");
 
     /* --------------------- */
     cCB_SUBST = rb_define_class_under(mTK, "CallbackSubst", rb_cObject);
@@ -1593,6 +2163,7 @@ Init_tkutil(void)
     ID_SUBST_INFO = rb_intern("SUBST_INFO");
     rb_define_singleton_method(cCB_SUBST, "ret_val", cbsubst_ret_val, 1);
     rb_define_singleton_method(cCB_SUBST, "scan_args", cbsubst_scan_args, 2);
+    rb_define_singleton_method(cCB_SUBST, "_scan_new", cbsubst_scan_new, 2);
     rb_define_singleton_method(cCB_SUBST, "_sym2subst",
 			       cbsubst_sym_to_subst, 1);
     rb_define_singleton_method(cCB_SUBST, "subst_arg",
@@ -1608,7 +2179,10 @@ Init_tkutil(void)
     rb_define_singleton_method(cCB_SUBST, "_define_attribute_aliases",
                                cbsubst_def_attr_aliases,  1);
 
+    rb_define_alloc_func(cCB_SUBST, cbsubst_alloc);
     rb_define_method(cCB_SUBST, "initialize", cbsubst_initialize, -1);
+    rb_define_method(cCB_SUBST, "initialize_copy", cbsubst_init_copy, 1);
+    rb_define_method(cCB_SUBST, "inspect", cbsubst_fields_inspect, 0);
 
     cbsubst_init();
 
@@ -1642,8 +2216,8 @@ Init_tkutil(void)
     OBJ_FREEZE(TK_None);
 
     /* --------------------- */
-    rb_global_variable(&CALLBACK_TABLE);
-    CALLBACK_TABLE = rb_hash_new();
+    rb_global_variable(&CALLBACK_SLOTS);
+    CALLBACK_SLOTS = rb_ary_new();
 
     /* --------------------- */
     rb_define_singleton_method(mTK, "untrust", tk_obj_untrust, 1);
@@ -1652,6 +2226,10 @@ Init_tkutil(void)
     rb_define_singleton_method(mTK, "callback", tk_do_callback, -1);
     rb_define_singleton_method(mTK, "install_cmd", tk_install_cmd, -1);
     rb_define_singleton_method(mTK, "uninstall_cmd", tk_uninstall_cmd, 1);
+    rb_define_singleton_method(mTK, "_callback_slots_size",
+                               tk_callback_slots_size, 0);
+    rb_define_singleton_method(mTK, "_install_slot", tk_install_slot, 1);
+    rb_define_singleton_method(mTK, "_uninstall_slot", tk_uninstall_slot, 1);
     rb_define_singleton_method(mTK, "_symbolkey2str", tk_symbolkey2str, 1);
     rb_define_singleton_method(mTK, "hash_kv", tk_hash_kv, -1);
     rb_define_singleton_method(mTK, "_get_eval_string",
@@ -1659,6 +2237,8 @@ Init_tkutil(void)
     rb_define_singleton_method(mTK, "_get_eval_enc_str",
                                tk_get_eval_enc_str, 1);
     rb_define_singleton_method(mTK, "_conv_args", tk_conv_args, -1);
+    rb_define_singleton_method(mTK, "_conv_invoke_args",
+                               tk_conv_invoke_args, -1);
 
     rb_define_singleton_method(mTK, "bool", tcl2rb_bool, 1);
     rb_define_singleton_method(mTK, "number", tcl2rb_number, 1);
@@ -1673,6 +2253,7 @@ Init_tkutil(void)
     rb_define_method(mTK, "_get_eval_string", tk_get_eval_string, -1);
     rb_define_method(mTK, "_get_eval_enc_str", tk_get_eval_enc_str, 1);
     rb_define_method(mTK, "_conv_args", tk_conv_args, -1);
+    rb_define_method(mTK, "_conv_invoke_args", tk_conv_invoke_args, -1);
 
     rb_define_method(mTK, "bool", tcl2rb_bool, 1);
     rb_define_method(mTK, "number", tcl2rb_number, 1);
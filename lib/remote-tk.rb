@@ -471,6 +471,18 @@ class RemoteTkIp
   def get_eventloop_weight
     fail RuntimeError, 'not support "get_eventloop_weight" on the remote interpreter'
   end
+  def set_eventloop_nogvl(mode)
+    fail RuntimeError, 'not support "set_eventloop_nogvl" on the remote interpreter'
+  end
+  def get_eventloop_nogvl
+    fail RuntimeError, 'not support "get_eventloop_nogvl" on the remote interpreter'
+  end
+  def set_eventloop_adaptive(target)
+    fail RuntimeError, 'not support "set_eventloop_adaptive" on the remote interpreter'
+  end
+  def get_eventloop_adaptive
+    fail RuntimeError, 'not support "get_eventloop_adaptive" on the remote interpreter'
+  end
 end
 
 class << RemoteTkIp
@@ -507,4 +519,16 @@ class << RemoteTkIp
   def get_eventloop_weight
     fail RuntimeError, 'not support "get_eventloop_weight" on the remote interpreter'
   end
+  def set_eventloop_nogvl(mode)
+    fail RuntimeError, 'not support "set_eventloop_nogvl" on the remote interpreter'
+  end
+  def get_eventloop_nogvl
+    fail RuntimeError, 'not support "get_eventloop_nogvl" on the remote interpreter'
+  end
+  def set_eventloop_adaptive(target)
+    fail RuntimeError, 'not support "set_eventloop_adaptive" on the remote interpreter'
+  end
+  def get_eventloop_adaptive
+    fail RuntimeError, 'not support "get_eventloop_adaptive" on the remote interpreter'
+  end
 end
@@ -63,6 +63,16 @@ module TkComm
     freeze
   }
 
+  # owners of the callbacks installed by _bind_core
+  #   path => { tag (nil for the widget) => { [*what, seq] => [[id, tbl]] } }
+  # The callbacks are released when the binding is replaced or removed,
+  # or when the owner (widget, canvas item, text tag) is destroyed.
+  CALLBACK_OWNER_TBL = {}
+  CALLBACK_OWNER_TBL.instance_eval{
+    @mutex = Mutex.new
+    def mutex; @mutex; end
+  }
+
   # for backward compatibility
   Tk_CMDTBL = Object.new
   def Tk_CMDTBL.method_missing(id, *args)
@@ -75,10 +85,6 @@ module TkComm
   end
   Tk_WINDOWS.freeze
 
-  self.instance_eval{
-    @cmdtbl = []
-  }
-
   unless const_defined?(:GET_CONFIGINFO_AS_ARRAY)
     # GET_CONFIGINFO_AS_ARRAY = false => returns a Hash { opt =>val, ... }
     #                           true  => returns an Array [[opt,val], ... ]
@@ -840,15 +846,20 @@ end
       # probably, Tcl7.6
       ns = nil
     end
-    id = _next_cmd_id
-    #Tk_CMDTBL[id] = cmd
-    if cmd.kind_of?(TkCallbackEntry)
-      TkCore::INTERP.tk_cmd_tbl[id] = cmd
-    else
-      TkCore::INTERP.tk_cmd_tbl[id] = TkCore::INTERP.get_cb_entry(cmd)
+    #id = _next_cmd_id
+    unless cmd.kind_of?(TkCallbackEntry)
+      cmd = TkCore::INTERP.get_cb_entry(cmd)
+    end
+    # the id is a handle of the slot table of TkUtil (freed by uninstall_cmd).
+    # The handle has the generation of the slot, so a stale or repeated
+    # uninstall_cmd does not find the callback which reuses the slot.
+    id = "c" + TkCore::INTERP._ip_id_ + TkUtil._install_slot(cmd).to_s
+    if (bind_info = Thread.current[:__tk_bind_info__])
+      # installed by _bind_core (callback_profile)
+      TkCore::CALLBACK_BIND_INFO[id] = bind_info
     end
-    @cmdtbl = [] unless defined? @cmdtbl
-    @cmdtbl.push id
+    #Tk_CMDTBL[id] = cmd
+    TkCore::INTERP.tk_cmd_tbl[id] = cmd
 
     if local_cmdtbl && local_cmdtbl.kind_of?(Array)
       begin
@@ -861,13 +872,24 @@ end
     #return Kernel.format("rb_out %s", id);
     if ns
       'rb_out' << TkCore::INTERP._ip_id_ << ' ' << ns << ' ' << id
+    elsif TkCore::INTERP.kind_of?(TclTkIp)
+      # native command which calls the entry directly
+      cmd_name = _callback_cmd_name(id)
+      TkCore::INTERP._create_callback_command(cmd_name,
+                                              TkCore::INTERP.tk_cmd_tbl[id])
+      cmd_name << ' ' << id
     else
       'rb_out' << TkCore::INTERP._ip_id_ << ' ' << id
     end
   end
+  def TkComm._callback_cmd_name(id)
+    'rb_out' << TkCore::INTERP._ip_id_ << '_' << id
+  end
   def TkComm.uninstall_cmd(id, local_cmdtbl=nil)
     #id = $1 if /rb_out\S* (c(_\d+_)?\d+)/ =~ id
-    id = $4 if id =~ /rb_out\S*(?:\s+(::\S*|[{](::.*)[}]|["](::.*)["]))? (c(_\d+_)?(\d+))/
+    if id.start_with?('rb_out')
+      id = $4 if id =~ /rb_out\S*(?:\s+(::\S*|[{](::.*)[}]|["](::.*)["]))? (c(_\d+_)?(\d+))/
+    end
 
     if local_cmdtbl && local_cmdtbl.kind_of?(Array)
       begin
@@ -876,10 +898,16 @@ end
         # ignore
       end
     end
-    @cmdtbl.delete(id)
 
     #Tk_CMDTBL.delete(id)
-    TkCore::INTERP.tk_cmd_tbl.delete(id)
+    if TkCore::INTERP.tk_cmd_tbl.delete(id)
+      TkUtil._uninstall_slot(id[/\d+\z/].to_i)
+    end
+    TkCore::CALLBACK_BIND_INFO.delete(id)
+    TkCore._release_callback_profile(id)
+    if TkCore::INTERP.kind_of?(TclTkIp)
+      TkCore::INTERP._delete_callback_command(_callback_cmd_name(id))
+    end
   end
   # private :install_cmd, :uninstall_cmd
   # module_function :install_cmd, :uninstall_cmd
@@ -977,15 +1005,89 @@ module TkComm
     end
   end
 
+  def _bind_info_for_profile(what, seq)
+    # widget path and event sequence of the callbacks which are installed
+    # in the block (callback_profile)
+    path = (what[0] == 'bind')? what[1]: what[0]
+    Thread.current[:__tk_bind_info__] = [_get_eval_string(path), seq]
+    yield
+  ensure
+    Thread.current[:__tk_bind_info__] = nil
+  end
+  private :_bind_info_for_profile
+
+  def _bind_owner(what)
+    what = what.collect{|w| _get_eval_string(w)}
+    if what[0] == 'bind'
+      [what[1], nil, what]
+    else
+      idx = what.index('bind')
+      [what[0], (idx)? what[idx + 1]: nil, what]
+    end
+  end
+  private :_bind_owner
+
+  # install_bind installs a callback unless cmd is a script (String)
+  def _bind_installed?(cmd)
+    cmd && !cmd.kind_of?(String)
+  end
+  private :_bind_installed?
+
+  def _bind_owner_entry(mode, what, seq, id)
+    path, tag, what = _bind_owner(what)
+    tbl = (defined?(@cmdtbl))? @cmdtbl: nil
+    key = what + [seq]
+    released = nil
+    CALLBACK_OWNER_TBL.mutex.synchronize{
+      seqs = ((CALLBACK_OWNER_TBL[path] ||= {})[tag] ||= {})
+      released = seqs.delete(key) unless mode == '+'
+      (seqs[key] ||= []) << [id, tbl] if id
+    }
+    released.each{|cb_id, cb_tbl| TkComm.uninstall_cmd(cb_id, cb_tbl)} if released
+  end
+  private :_bind_owner_entry
+
+  # release the callbacks bound to the widget 'path' (tags == nil) or
+  # to the items/tags of the widget. If unbind is true, the bindings on
+  # the Tcl side are removed too.
+  def TkComm._release_bind_callbacks(path, tags=nil, unbind=false)
+    entries = nil
+    CALLBACK_OWNER_TBL.mutex.synchronize{
+      if tags
+        if (owners = CALLBACK_OWNER_TBL[path])
+          entries = tags.collect{|tag| owners.delete(tag)}.compact
+          CALLBACK_OWNER_TBL.delete(path) if owners.empty?
+        end
+      elsif (owners = CALLBACK_OWNER_TBL.delete(path))
+        entries = owners.values
+      end
+    }
+    return unless entries
+    entries.each{|seqs|
+      seqs.each{|key, ids|
+        if unbind
+          begin
+            TkCore::INTERP._invoke_without_enc(*(key + ['']))
+          rescue
+            # the owner has gone
+          end
+        end
+        ids.each{|cb_id, cb_tbl| TkComm.uninstall_cmd(cb_id, cb_tbl)}
+      }
+    }
+  end
+
   def _bind_core(mode, what, context, cmd, *args)
-    id = install_bind(cmd, *args) if cmd
+    seq = "<#{tk_event_sequence(context)}>"
+    id = _bind_info_for_profile(what, seq){ install_bind(cmd, *args) } if cmd
     begin
-      tk_call_without_enc(*(what + ["<#{tk_event_sequence(context)}>",
-                              mode + id]))
+      ret = tk_call_without_enc(*(what + [seq, mode + id]))
     rescue
-      uninstall_cmd(id) if cmd
+      uninstall_cmd(id) if _bind_installed?(cmd)
       fail
     end
+    _bind_owner_entry(mode, what, seq, (_bind_installed?(cmd))? id: nil)
+    ret
   end
 
   def _bind(what, context, cmd, *args)
@@ -997,7 +1099,10 @@ module TkComm
   end
 
   def _bind_remove(what, context)
-    tk_call_without_enc(*(what + ["<#{tk_event_sequence(context)}>", '']))
+    seq = "<#{tk_event_sequence(context)}>"
+    ret = tk_call_without_enc(*(what + [seq, '']))
+    _bind_owner_entry('', what, seq, nil)
+    ret
   end
 
   def _bindinfo(what, context=nil)
@@ -1037,14 +1142,20 @@ module TkComm
   end
 
   def _bind_core_for_event_class(klass, mode, what, context, cmd, *args)
-    id = install_bind_for_event_class(klass, cmd, *args) if cmd
+    seq = "<#{tk_event_sequence(context)}>"
+    if cmd
+      id = _bind_info_for_profile(what, seq){
+        install_bind_for_event_class(klass, cmd, *args)
+      }
+    end
     begin
-      tk_call_without_enc(*(what + ["<#{tk_event_sequence(context)}>",
-                              mode + id]))
+      ret = tk_call_without_enc(*(what + [seq, mode + id]))
     rescue
-      uninstall_cmd(id) if cmd
+      uninstall_cmd(id) if _bind_installed?(cmd)
       fail
     end
+    _bind_owner_entry(mode, what, seq, (_bind_installed?(cmd))? id: nil)
+    ret
   end
 
   def _bind_for_event_class(klass, what, context, cmd, *args)
@@ -1442,7 +1553,15 @@ EOS
                                       if widget.respond_to?(:__destroy_hook__)
                                         widget.__destroy_hook__
                                       end
+                                      widget.instance_eval{
+                                        if defined?(@cmdtbl) && @cmdtbl
+                                          @cmdtbl.dup.each{|id|
+                                            uninstall_cmd(id)
+                                          }
+                                        end
+                                      }
                                     end
+                                    TkComm._release_bind_callbacks(path)
                                   rescue Exception=>e
                                       p e if $DEBUG
                                   end
@@ -1544,7 +1663,14 @@ EOS
         #TkCore::INTERP.tk_cmd_tbl[arg.shift].call(*arg)
         normal_ret = false
         ret = catch(:IRB_EXIT) do  # IRB hack
-          retval = TkCore::INTERP.tk_cmd_tbl[arg.shift].call(*arg)
+          id = arg.shift
+          if @callback_profile_mode
+            retval = TkCore._profile_callback(id){
+              TkCore::INTERP.tk_cmd_tbl[id].call(*arg)
+            }
+          else
+            retval = TkCore::INTERP.tk_cmd_tbl[id].call(*arg)
+          end
           normal_ret = true
           retval
         end
@@ -1581,6 +1707,92 @@ EOS
       fail(e, msg)
     end
   end
+
+  # profile of callbacks (TkCore.set_callback_profile_mode)
+  CALLBACK_PROFILE = {}    # id => [count, total, max, allocs, path, seq]
+  CALLBACK_BIND_INFO = {}  # id => [path, seq] (set by _bind_core)
+  # released callbacks : [path, seq] => [count, total, max, allocs, path, seq]
+  CALLBACK_PROFILE_RELEASED = {}
+  CALLBACK_PROFILE_RELEASED_MAX = 1000  # the others are merged to [nil, nil]
+  @callback_profile_mode = false
+  CALLBACK_PROFILE_DISPATCHER = proc{|id, *args|
+    TkCore._profile_callback(id){ TkCore::INTERP.tk_cmd_tbl[id].call(*args) }
+  }
+
+  def TkCore.set_callback_profile_mode(mode)
+    @callback_profile_mode = (mode)? true: false
+    # native callback commands call the dispatcher with (id, *args)
+    TclTkLib._set_callback_dispatcher((mode)? CALLBACK_PROFILE_DISPATCHER: nil)
+    @callback_profile_mode
+  end
+
+  def TkCore.get_callback_profile_mode
+    @callback_profile_mode
+  end
+
+  def TkCore._profile_callback(id)
+    bind_info = CALLBACK_BIND_INFO[id]
+    allocs = GC.stat(:total_allocated_objects)
+    start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    begin
+      yield
+    ensure
+      time = Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+      allocs = GC.stat(:total_allocated_objects) - allocs
+      if TkCore::INTERP.tk_cmd_tbl.key?(id)
+        prof = (CALLBACK_PROFILE[id] ||= [0, 0.0, 0.0, 0, *bind_info])
+      else
+        # released by itself (e.g. a callback of 'after')
+        prof = _released_callback_profile(*bind_info)
+      end
+      _add_callback_profile(prof, 1, time, time, allocs)
+    end
+  end
+
+  def TkCore._add_callback_profile(prof, count, total, max, allocs)
+    prof[0] += count
+    prof[1] += total
+    prof[2] = max if max > prof[2]
+    prof[3] += allocs
+  end
+
+  def TkCore._released_callback_profile(path=nil, seq=nil)
+    key = [path, seq]
+    unless CALLBACK_PROFILE_RELEASED.key?(key)
+      if CALLBACK_PROFILE_RELEASED.size >= CALLBACK_PROFILE_RELEASED_MAX
+        key = [nil, nil]
+      end
+    end
+    CALLBACK_PROFILE_RELEASED[key] ||= [0, 0.0, 0.0, 0, *key]
+  end
+
+  # called by TkComm.uninstall_cmd : the id may be used again
+  def TkCore._release_callback_profile(id)
+    return unless (prof = CALLBACK_PROFILE.delete(id))
+    _add_callback_profile(_released_callback_profile(prof[4], prof[5]),
+                          *prof[0, 4])
+  end
+
+  # id => {:count, :total, :max, :allocations, :path, :sequence}, sorted
+  # by total time. Callbacks which are already released are merged by
+  # their binding : the key is [path, sequence] ([nil, nil] for the
+  # others).
+  def TkCore.callback_profile
+    CALLBACK_PROFILE.merge(CALLBACK_PROFILE_RELEASED).sort_by{|id, prof|
+      -prof[1]
+    }.each_with_object({}){
+      |(id, (count, total, max, allocs, path, seq)), h|
+      h[id] = {:count=>count, :total=>total, :max=>max,
+               :allocations=>allocs, :path=>path, :sequence=>seq}
+    }
+  end
+
+  def TkCore.reset_callback_profile
+    CALLBACK_PROFILE.clear
+    CALLBACK_PROFILE_RELEASED.clear
+    nil
+  end
+
 =begin
   def TkCore.callback(arg_str)
     # arg = tk_split_list(arg_str)
@@ -1858,6 +2070,22 @@ EOS
     TclTkLib.get_eventloop_weight
   end
 
+  def set_eventloop_nogvl(mode)
+    TclTkLib.set_eventloop_nogvl(mode)
+  end
+
+  def get_eventloop_nogvl()
+    TclTkLib.get_eventloop_nogvl
+  end
+
+  def set_eventloop_adaptive(target_ms)
+    TclTkLib.set_eventloop_adaptive(target_ms)
+  end
+
+  def get_eventloop_adaptive()
+    TclTkLib.get_eventloop_adaptive
+  end
+
   def restart(app_name = nil, keys = {})
     TkCore::INTERP.init_ip_internal
 
@@ -1970,7 +2198,8 @@ EOS
     #args.collect! {|x|ruby2tcl(x, enc_mode)}
     #args.compact!
     #args.flatten!
-    args = _conv_args([], enc_mode, *args)
+    # numbers and numeric lists are passed as they are (typed Tcl_Objs)
+    args = _conv_invoke_args([], enc_mode, *args)
     puts 'invoke args => ' + args.inspect if $DEBUG
     ### print "=> ", args.join(" ").inspect, "\n" if $DEBUG
     begin
@@ -2010,7 +2239,7 @@ EOS
   end
 
   def _tk_call_to_list_core(depth, arg_enc, val_enc, *args)
-    args = _conv_args([], arg_enc, *args)
+    args = _conv_invoke_args([], arg_enc, *args)
     val = _tk_call_core(false, *args)
     if !depth.kind_of?(Integer) || depth == 0
       tk_split_simplelist(val, false, val_enc)
@@ -2043,6 +2272,45 @@ EOS
   def tk_call_to_simplelist_with_enc(*args)
     _tk_call_to_list_core(0, true, true, *args)
   end
+
+  # mode : :string, :int, :float, :list, :list_of_int, :list_of_float
+  #        or :dict
+  # The result is read from the Tcl result object (TclTkIp#_invoke_typed)
+  # instead of being parsed from its string. No encoding conversion.
+  def tk_call_typed(mode, *args)
+    args = _conv_invoke_args([], false, *args)
+    unless INTERP.respond_to?(:_invoke_typed)
+      # e.g. MultiTkIp
+      return _tk_call_result_by_mode(mode, _tk_call_core(false, *args))
+    end
+    res = INTERP._invoke_typed(mode, *args)
+    if INTERP._return_value() != 0
+      fail RuntimeError, res, error_at
+    end
+    res
+  end
+
+  def _tk_call_result_by_mode(mode, val)
+    case mode
+    when :string
+      val
+    when :int
+      Integer(val, 10)
+    when :float
+      Float(val)
+    when :list
+      tk_split_simplelist(val, false, false)
+    when :list_of_int
+      tk_split_simplelist(val, false, false).collect!{|v| Integer(v, 10)}
+    when :list_of_float
+      tk_split_simplelist(val, false, false).collect!{|v| Float(v)}
+    when :dict
+      Hash[*tk_split_simplelist(val, false, false)]
+    else
+      fail ArgumentError, "unknown result mode #{mode.inspect}"
+    end
+  end
+  private :_tk_call_result_by_mode
 end
 
 
@@ -2335,6 +2603,22 @@ module Tk
   def Tk.update_idletasks
     update(true)
   end
+
+  # Process events like Tk.update, but stop when 'msec' milliseconds
+  # have passed. Returns [exhausted, rest] : exhausted is true if the
+  # budget was exhausted (events may remain), or false if all events were
+  # processed; rest is the rest of the budget in milliseconds (negative
+  # for an overrun by the last event).
+  # A plain Tk.update in a callback is not limited by the budget.
+  def Tk.update_within(msec, idle=nil)
+    if idle
+      ret = tk_call_without_enc('update_within', msec, 'idletasks')
+    else
+      ret = tk_call_without_enc('update_within', msec)
+    end
+    exhausted, rest = simplelist(ret)
+    [bool(exhausted), number(rest)]
+  end
   def update(idle=nil)
     # only for backward compatibility (This never be recommended to use)
     Tk.update(idle)
@@ -2897,7 +3181,16 @@ if (/^(8\.[1-9]|9\.|[1-9][0-9])/ =~ Tk::TCL_VERSION && !Tk::JAPANIZED_TK)
     end
 
     def _invoke(*cmds)
-      _fromUTF8(__invoke(*(cmds.collect{|cmd| _toUTF8(cmd)})))
+      # frozen ASCII strings (option names, widget paths) are the same
+      # in UTF-8 and are kept as they are, so that __invoke interns them
+      _fromUTF8(__invoke(*(cmds.collect{|cmd|
+                             if cmd.kind_of?(String) &&
+                                 !(cmd.frozen? && cmd.ascii_only?)
+                               _toUTF8(cmd)
+                             else
+                               cmd
+                             end
+                           })))
     end
 
     alias _eval_with_enc _eval
@@ -4845,6 +5138,9 @@ class TkObject<TkKernel
   def tk_send_to_simplelist_with_enc(cmd, *rest)
     tk_call_to_simplelist_with_enc(path, cmd, *rest)
   end
+  def tk_send_typed(mode, cmd, *rest)
+    tk_call_typed(mode, path, cmd, *rest)
+  end
 
   def method_missing(id, *args)
     name = id.id2name
@@ -5496,7 +5792,8 @@ class TkWindow<TkObject
       children << [path, obj] if path =~ rexp
     }
     if defined?(@cmdtbl)
-      for id in @cmdtbl
+      # uninstall_cmd deletes the id from @cmdtbl
+      for id in @cmdtbl.dup
         uninstall_cmd id
       end
     end
@@ -5504,7 +5801,7 @@ class TkWindow<TkObject
     children.each{|path, obj|
       obj.instance_eval{
         if defined?(@cmdtbl)
-          for id in @cmdtbl
+          for id in @cmdtbl.dup
             uninstall_cmd id
           end
         end
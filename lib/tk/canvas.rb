@@ -127,8 +127,8 @@ class Tk::Canvas<TkWindow
   end
 
   def bbox(tagOrId, *tags)
-    list(tk_send_without_enc('bbox', tagid(tagOrId),
-                             *tags.collect{|t| tagid(t)}))
+    tk_send_typed(:list_of_int, 'bbox', tagid(tagOrId),
+                  *tags.collect{|t| tagid(t)})
   end
 
   def itembind(tag, context, *args, &block)
@@ -175,7 +175,7 @@ class Tk::Canvas<TkWindow
 
   def coords(tag, *args)
     if args.empty?
-      tk_split_list(tk_send_without_enc('coords', tagid(tag)))
+      tk_send_typed(:list_of_float, 'coords', tagid(tag))
     else
       tk_send_without_enc('coords', tagid(tag), *(args.flatten))
       self
@@ -200,6 +200,7 @@ class Tk::Canvas<TkWindow
             TkcItem::CItemID_TBL.mutex.synchronize{
               tbl.delete(item.id)
             }
+            TkComm._release_bind_callbacks(self.path, [item.id.to_s])
           end
         }
       }
@@ -216,7 +217,7 @@ class Tk::Canvas<TkWindow
   alias deltag dtag
 
   def find(mode, *args)
-    list(tk_send_without_enc('find', mode, *args)).collect!{|id|
+    tk_send_typed(:list_of_int, 'find', mode, *args).collect!{|id|
       TkcItem.id2obj(self, id)
     }
   end
@@ -768,6 +769,8 @@ class TkcItem<TkObject
     CItemID_TBL.mutex.synchronize{
       CItemID_TBL[@path].delete(@id) if CItemID_TBL[@path]
     }
+    # Tk removes the bindings of the deleted item
+    TkComm._release_bind_callbacks(@path, [@id.to_s])
     self
   end
   alias remove  delete
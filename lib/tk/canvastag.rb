@@ -282,7 +282,14 @@ class TkcTag<TkObject
     self
   end
   alias remove  delete
-  alias destroy delete
+
+  # bindings of a tag remain after deleting its items :
+  # destroy removes them (and their callbacks) too
+  def destroy
+    delete
+    TkComm._release_bind_callbacks(@cpath, [@id.to_s], true)
+    self
+  end
 
   def set_to_above(target)
     @c.addtag_above(@id, target)
@@ -364,6 +371,9 @@ class TkcTagString<TkcTag
       tk_call_without_enc(@c.path, "addtag", @id, mode, *args)
     end
   end
+
+  # a named tag (e.g. 'all', 'current') may be shared : keep its bindings
+  alias destroy delete
 end
 TkcNamedTag = TkcTagString
 
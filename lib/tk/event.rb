@@ -455,34 +455,66 @@ module TkEvent
 
   ###############################################
 
+  # callback id of the bind command 'cmd' (a String is used as is).
+  # The block converts the substituted arguments to the arguments of cmd.
+  def _install_bind_cmd(cmd, extra_args_tbl, &conv_args)
+    if cmd.kind_of?(String)
+      cmd
+    elsif cmd.kind_of?(TkCallbackEntry)
+      install_cmd(cmd)
+    else
+      install_cmd(proc{|*arg|
+        ex_args = []
+        extra_args_tbl.reverse_each{|conv| ex_args << conv.call(arg.pop)}
+        begin
+          TkUtil.eval_cmd(cmd, *(ex_args.concat(conv_args.call(arg))))
+        rescue Exception=>e
+          if TkCore::INTERP.kind_of?(TclTkIp)
+            fail e
+          else
+            # MultiTkIp
+            fail Exception, "#{e.class}: #{e.message.dup}"
+          end
+        end
+      })
+    end
+  end
+  private :_install_bind_cmd
+
   def install_bind_for_event_class(klass, cmd, *args)
     extra_args_tbl = klass._get_extra_args_tbl
 
-    if args.compact.size > 0
+    # bind(seq, fields: [:x, :y]){|ev| ...}
+    #   --> substitute the given fields only (the others of ev are nil)
+    if args.last.kind_of?(Hash) && args.last.key?(:fields)
+      fields = args.pop[:fields]
+    else
+      fields = nil
+    end
+
+    if fields && !args.compact.empty?
+      fail ArgumentError, "fields: and substitution arguments are exclusive"
+    end
+
+    if fields
+      args = fields.collect{|field| klass._sym2subst(field)}.join(' ')
+      keys = klass._get_subst_key(args).freeze
+      all_keys = klass._get_all_subst_keys[0]
+      if keys.empty? || !keys.each_char.all?{|key| all_keys.include?(key)}
+        fail ArgumentError, "unknown event fields #{fields.inspect}"
+      end
+
+      id = _install_bind_cmd(cmd, extra_args_tbl){|arg|
+        [klass._scan_new(keys, arg)]
+      }
+    elsif args.compact.size > 0
       args.map!{|arg| klass._sym2subst(arg)}
       args = args.join(' ')
       keys = klass._get_subst_key(args)
 
-      if cmd.kind_of?(String)
-        id = cmd
-      elsif cmd.kind_of?(TkCallbackEntry)
-        id = install_cmd(cmd)
-      else
-        id = install_cmd(proc{|*arg|
-          ex_args = []
-          extra_args_tbl.reverse_each{|conv| ex_args << conv.call(arg.pop)}
-          begin
-            TkUtil.eval_cmd(cmd, *(ex_args.concat(klass.scan_args(keys, arg))))
-          rescue Exception=>e
-            if TkCore::INTERP.kind_of?(TclTkIp)
-              fail e
-            else
-              # MultiTkIp
-              fail Exception, "#{e.class}: #{e.message.dup}"
-            end
-          end
-        })
-      end
+      id = _install_bind_cmd(cmd, extra_args_tbl){|arg|
+        klass.scan_args(keys, arg)
+      }
     elsif cmd.respond_to?(:arity) && cmd.arity == 0  # args.size == 0
       args = ''
       if cmd.kind_of?(String)
@@ -505,27 +537,12 @@ module TkEvent
       end
     else
       keys, args = klass._get_all_subst_keys
+      keys.freeze
 
-      if cmd.kind_of?(String)
-        id = cmd
-      elsif cmd.kind_of?(TkCallbackEntry)
-        id = install_cmd(cmd)
-      else
-        id = install_cmd(proc{|*arg|
-          ex_args = []
-          extra_args_tbl.reverse_each{|conv| ex_args << conv.call(arg.pop)}
-          begin
-            TkUtil.eval_cmd(cmd, *(ex_args << klass.new(*klass.scan_args(keys, arg))))
-          rescue Exception=>e
-            if TkCore::INTERP.kind_of?(TclTkIp)
-              fail e
-            else
-              # MultiTkIp
-              fail Exception, "#{e.class}: #{e.message.dup}"
-            end
-          end
-        })
-      end
+      # the fields are converted when they are read
+      id = _install_bind_cmd(cmd, extra_args_tbl){|arg|
+        [klass._scan_new(keys, arg)]
+      }
     end
 
     if TkCore::INTERP.kind_of?(TclTkIp)
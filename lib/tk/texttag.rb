@@ -239,6 +239,8 @@ class TkTextTag<TkObject
     TTagID_TBL.mutex.synchronize{
       TTagID_TBL[@tpath].delete(@id) if TTagID_TBL[@tpath]
     }
+    # 'tag delete' removes the bindings of the tag
+    TkComm._release_bind_callbacks(@tpath, [@id.to_s])
     self
   end
 end
@@ -0,0 +1,191 @@
+# frozen_string_literal: true
+
+# Tests for the registry of Ruby callbacks called from Tcl
+#
+# Key C functions exercised:
+#   - TkCore.callback (TkCore.callback_profile, per-callback statistics)
+#   - tk_install_cmd_core, tk_do_callback (TkUtil callback slots)
+#   - TkComm._release_bind_callbacks (callbacks released with their owners)
+
+$LOAD_PATH.unshift(File.expand_path('../lib', __dir__))
+
+require 'minitest/autorun'
+require_relative 'tk_test_helper'
+
+class TestCallbacks < Minitest::Test
+  include TkTestHelper
+
+  # Per-callback profile (TkCore.callback_profile)
+  def test_callback_profile
+    assert_tk_test("callback_profile should count calls per callback id") do
+      <<~RUBY
+        require 'tk'
+        root = TkRoot.new { withdraw }
+        button = TkButton.new(root)
+        button.bind('Button-1') { Array.new(10) { Object.new } }
+
+        TkCore.reset_callback_profile
+        TkCore.set_callback_profile_mode(true)
+        3.times { Tk.event_generate(button, 'Button-1', :when=>:now) }
+        TkCore.set_callback_profile_mode(false)
+        Tk.event_generate(button, 'Button-1', :when=>:now)
+
+        profile = TkCore.callback_profile
+        id, prof = profile.find { |_, v| v[:sequence] == '<Button-1>' }
+        raise "Expected a profile entry, got \#{profile.inspect}" unless id
+        raise "Expected path \#{button.path}, got \#{prof[:path]}" unless prof[:path] == button.path
+        raise "Expected 3 calls, got \#{prof[:count]}" unless prof[:count] == 3
+        raise "Bad time" unless prof[:total] >= prof[:max] && prof[:max] >= 0
+        raise "Expected allocations" unless prof[:allocations] >= 30
+
+        # a released callback is merged by its binding
+        TkCore.set_callback_profile_mode(true)
+        button.bind('Button-1') { }
+        2.times { Tk.event_generate(button, 'Button-1', :when=>:now) }
+        TkCore.set_callback_profile_mode(false)
+        profile = TkCore.callback_profile
+        released = profile[[button.path, '<Button-1>']]
+        raise "Expected a released entry, got \#{profile.inspect}" unless released && released[:count] == 3
+        raise "Released id should be gone" if profile.key?(id)
+        _, live = profile.find { |k, v| k.kind_of?(String) && v[:sequence] == '<Button-1>' }
+        raise "Expected 2 calls of the new callback" unless live && live[:count] == 2
+
+        TkCore.reset_callback_profile
+        raise "Expected empty profile" unless TkCore.callback_profile.empty?
+
+        root.destroy
+      RUBY
+    end
+  end
+
+  # TkUtil callback slots (exercises tk_install_cmd_core, tk_do_callback)
+  def test_callback_slots_reuse
+    assert_tk_test("TkUtil callback slots should be reused") do
+      <<~RUBY
+        require 'tk'
+        root = TkRoot.new { withdraw }
+
+        script = TkUtil.install_cmd(proc { |x| "got \#{x}" })
+        ret = Tk.ip_eval("\#{script} a")
+        raise "Expected 'got a', got \#{ret}" unless ret == "got a"
+        TkUtil.uninstall_cmd(script)
+
+        # a stale id must not call the callback which reuses the slot
+        other = TkUtil.install_cmd(proc { "other" })
+        raise "Expected new id" if other == script
+        begin
+          Tk.ip_eval("\#{script} a")
+          raise "Expected error for stale id"
+        rescue RuntimeError => e
+          raise "Unexpected: \#{e.message}" unless e.message.include?("unknown command ID")
+        end
+        TkUtil.uninstall_cmd(other)
+
+        size = TkUtil._callback_slots_size
+        10.times do
+          ids = Array.new(500) { TkUtil.install_cmd(proc {}) }
+          ids.each { |id| TkUtil.uninstall_cmd(id) }
+        end
+        grown = TkUtil._callback_slots_size - size
+        raise "Slots grew by \#{grown}" unless grown <= 500
+
+        # ids of TkComm.install_cmd (bindings) reuse the slots too
+        button = TkButton.new(root)
+        size = TkUtil._callback_slots_size
+        2000.times { button.bind('Button-1') { } }
+        grown = TkUtil._callback_slots_size - size
+        raise "Slots grew by \#{grown} for bindings" unless grown <= 1
+        tbl_size = TkCore::INTERP.tk_cmd_tbl.size
+        100.times { button.bind('Button-1') { } }
+        raise "tk_cmd_tbl grew" unless TkCore::INTERP.tk_cmd_tbl.size == tbl_size
+
+        # a repeated uninstall_cmd keeps the callback which reuses the slot
+        stale = TkComm.install_cmd(proc { "stale" })
+        TkComm.uninstall_cmd(stale)
+        fresh = TkComm.install_cmd(proc { "fresh" })
+        raise "Expected new id" if fresh == stale
+        TkComm.uninstall_cmd(stale)
+        raise "Lost fresh callback" unless Tk.ip_eval(fresh) == "fresh"
+        TkComm.uninstall_cmd(fresh)
+
+        # an Integer is a callback like the others (not a free slot)
+        num = TkUtil.install_cmd(42)
+        raise "Expected 42" unless TkUtil.uninstall_cmd(num) == 42
+
+        root.destroy
+      RUBY
+    end
+  end
+
+  # Callbacks released with their owners (TkComm._release_bind_callbacks)
+  def test_bind_callbacks_released
+    assert_tk_test("bind callbacks should be released with their owners") do
+      <<~RUBY
+        require 'tk'
+        root = TkRoot.new { withdraw }
+        tbl = TkCore::INTERP.tk_cmd_tbl
+        base = tbl.size
+
+        canvas = TkCanvas.new(root)
+        items = Array.new(20) { TkcRectangle.new(canvas, 0, 0, 10, 10) }
+        items.each { |item| item.bind('Button-1') { } }
+        raise "Expected 20 callbacks" unless tbl.size == base + 20
+        items.each(&:delete)
+        raise "Item callbacks leaked: \#{tbl.size - base}" unless tbl.size == base
+
+        # replacing a binding releases the old callback
+        b = TkButton.new(root)
+        5.times { b.bind('Enter') { } }
+        raise "Replaced callbacks leaked" unless tbl.size == base + 1
+        b.bind_append('Enter') { }
+        raise "Expected appended callback" unless tbl.size == base + 2
+        b.bind_remove('Enter')
+        raise "Removed callbacks leaked" unless tbl.size == base
+
+        text = TkText.new(root)
+        tag = TkTextTag.new(text)
+        tag.bind('Button-1') { }
+        tag.destroy
+        raise "Tag callbacks leaked" unless tbl.size == base
+
+        # canvas tag bindings outlive the items : only destroy removes them
+        ctag = TkcTag.new(canvas)
+        ctag.bind('Button-1') { }
+        TkcRectangle.new(canvas, 0, 0, 5, 5, tags: [ctag])
+        ctag.delete
+        raise "Tag callback released by delete" unless tbl.size == base + 1
+        raise "Tag binding removed by delete" if Tk.ip_eval("\#{canvas.path} bind \#{ctag.id} <Button-1>").empty?
+        ctag.destroy
+        raise "Tag callback leaked by destroy" unless tbl.size == base
+        raise "Tag binding kept by destroy" unless Tk.ip_eval("\#{canvas.path} bind \#{ctag.id} <Button-1>").empty?
+        TkcTagAll.new(canvas).bind('Enter') { }
+        TkcTagAll.new(canvas).destroy
+        raise "Bindings of 'all' released" unless tbl.size == base + 1
+        TkcTagAll.new(canvas).bind_remove('Enter')
+        raise "Bindings of 'all' leaked" unless tbl.size == base
+
+        # a script given to bind is not owned by the binding
+        base = tbl.size
+        script = Tk.install_cmd(proc { })
+        b.bind('Leave', script)
+        b.bind('Leave') { }
+        raise "Script callback released" unless tbl.size == base + 2
+        Tk.uninstall_cmd(script)
+        b.bind_remove('Leave')
+        raise "Leave callbacks leaked" unless tbl.size == base
+
+        # destroying a parent releases the bindings of its descendants
+        f = TkFrame.new(root)
+        inner = TkFrame.new(f)
+        TkButton.new(inner).bind('Enter') { }
+        TkcOval.new(TkCanvas.new(inner), 0, 0, 5, 5).bind('Enter') { }
+        raise "Expected 2 callbacks" unless tbl.size == base + 2
+        f.destroy
+        Tk.update
+        raise "Descendant callbacks leaked: \#{tbl.size - base}" unless tbl.size == base
+
+        root.destroy
+      RUBY
+    end
+  end
+end
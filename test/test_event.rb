@@ -0,0 +1,109 @@
+# frozen_string_literal: true
+
+# Tests for the event fields of bind callbacks (%-substitution)
+#
+# Key C functions exercised:
+#   - install_bind_for_event_class (bind fields:, partial %-substitution)
+#   - cbsubst_scan_new, cbsubst_attr_reader (packed, lazily converted Event)
+#   - cbsubst_convert (native CallbackSubst converters)
+
+$LOAD_PATH.unshift(File.expand_path('../lib', __dir__))
+
+require 'minitest/autorun'
+require_relative 'tk_test_helper'
+
+class TestEvent < Minitest::Test
+  include TkTestHelper
+
+  # Only the declared event fields are substituted (bind fields:)
+  def test_bind_event_fields
+    assert_tk_test("bind fields: should substitute only the given fields") do
+      <<~RUBY
+        require 'tk'
+        root = TkRoot.new { withdraw }
+        f = TkFrame.new(root, width: 50, height: 50).pack
+        root.deiconify
+        Tk.update
+
+        got = nil
+        f.bind('Button-1', fields: [:x, :y]) { |e| got = e }
+        Tk.event_generate(f, 'Button-1', x: 5, y: 7, when: :now)
+        raise "Callback not called" unless got
+        raise "Expected x/y 5/7, got \#{got.x}/\#{got.y}" unless got.x == 5 && got.y == 7
+        raise "Unrequested keysym set" unless got.keysym.nil?
+        raise "Unrequested widget set" unless got.widget.nil?
+
+        begin
+          f.bind('Motion', fields: [:no_such_field]) { }
+          raise "Expected ArgumentError"
+        rescue ArgumentError
+        end
+
+        # fields: and explicit substitutions do not mix
+        begin
+          f.bind('Motion', proc { }, '%x', fields: [:y])
+          raise "Expected ArgumentError for fields: with '%x'"
+        rescue ArgumentError
+        end
+
+        root.destroy
+      RUBY
+    end
+  end
+
+  # Event fields are kept raw and converted on first read (_scan_new)
+  def test_event_packed_fields
+    assert_tk_test("packed Event fields should convert lazily") do
+      <<~RUBY
+        require 'tk'
+        root = TkRoot.new { withdraw }
+        f = TkFrame.new(root, width: 50, height: 50).pack
+        root.deiconify
+        Tk.update
+
+        got = nil
+        f.bind('Button-1') { |e| got = e }
+        Tk.event_generate(f, 'Button-1', x: 5, y: 7, when: :now)
+        raise "Callback not called" unless got
+        raise "Expected x/y 5/7, got \#{got.x}/\#{got.y}" unless got.x == 5 && got.y == 7
+        raise "Expected widget \#{f.path}" unless got.widget == f
+        raise "Expected cached value" unless got.x.equal?(got.x)
+        raise "Expected alias" unless got.button == got.num
+        raise "dup lost fields" unless got.dup.y == 7
+
+        # objects built by new keep their fields in instance variables
+        ev = TkEvent::Event.new(1, ?a, 2)
+        raise "Expected serial 1" unless ev.serial == 1
+
+        root.destroy
+      RUBY
+    end
+  end
+
+  # Native converters give the same values as the TkComm procs
+  def test_cbsubst_native_converters
+    assert_tk_test("native converters should match the TkComm procs") do
+      <<~RUBY
+        require 'tk'
+        root = TkRoot.new { withdraw }
+        b = TkButton.new(root)
+
+        keys = 'xyc#WEKd'
+        vals = ['12', '-3', '??', '010', b.path, '1', 'Return', '{a b}']
+        ret = TkEvent::Event.scan_args(keys, vals)
+        expected = [12, -3, '??', 8, b, true, 'Return', 'a b']
+        raise "Expected \#{expected.inspect}, got \#{ret.inspect}" unless ret == expected
+
+        ret = TkEvent::Event.scan_args('xyE', ['1.5', '0x10', 'no'])
+        raise "Unexpected \#{ret.inspect}" unless ret == [1.5, 16, false]
+
+        # long numbers do not overflow the fast path
+        big = ['999999999', '-2147483649', '123456789012345678', '99999999999999999999']
+        ret = TkEvent::Event.scan_args('xyXY', big)
+        raise "Unexpected \#{ret.inspect}" unless ret == big.map(&:to_i)
+
+        root.destroy
+      RUBY
+    end
+  end
+end
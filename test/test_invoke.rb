@@ -0,0 +1,180 @@
+# frozen_string_literal: true
+
+# Tests for the arguments, results and caches of TclTkIp#_invoke/_eval
+#
+# Key C functions exercised:
+#   - get_obj_from_value, tk_conv_invoke_args (typed _invoke arguments)
+#   - ip_invoke_typed, ip_get_result_typed (typed _invoke results)
+#   - rbtk_get_interned_obj (interned Tcl_Objs of frozen string arguments)
+#   - rbtk_eval_cache_get (LRU cache of compiled _eval scripts)
+
+$LOAD_PATH.unshift(File.expand_path('../lib', __dir__))
+
+require 'minitest/autorun'
+require_relative 'tk_test_helper'
+
+class TestInvoke < Minitest::Test
+  include TkTestHelper
+
+  # Numbers and numeric lists reach Tcl as typed objects
+  def test_invoke_typed_arguments
+    assert_tk_test("typed arguments should keep their values") do
+      <<~RUBY
+        require 'tk'
+        root = TkRoot.new { withdraw }
+        ip = TkCore::INTERP
+
+        ip._invoke('set', 'typed_v', 42)
+        rep = ip._eval('tcl::unsupported::representation $typed_v')
+        raise "Expected an int object: \#{rep}" unless rep.include?('int')
+
+        ret = ip._invoke('list', 1, 2.5, [3, [4, 5]], 2**70)
+        raise "Unexpected list: \#{ret}" unless ret == '1 2.5 {3 {4 5}} 1180591620717411303424'
+
+        c = TkCanvas.new(root)
+        line = TkcLine.new(c, [0, 0, 10.5, 20, 30, 40])
+        coords = line.coords
+        raise "Unexpected coords \#{coords.inspect}" unless coords == [0.0, 0.0, 10.5, 20.0, 30.0, 40.0]
+        raise "Expected width 3" unless TkcLine.new(c, 1, 2, 3, 4, width: 3).cget(:width).to_f == 3.0
+
+        begin
+          ip._invoke('list', [1, {a: 1}])
+          raise "Expected TypeError"
+        rescue TypeError
+        end
+
+        # a self-containing array is refused, not walked forever
+        rec = [1]
+        rec << rec
+        begin
+          ip._invoke('list', rec)
+          raise "Expected ArgumentError from _invoke"
+        rescue ArgumentError
+        end
+        begin
+          Tk.tk_call('list', rec)
+          raise "Expected ArgumentError from tk_call"
+        rescue ArgumentError
+        end
+
+        root.destroy
+      RUBY
+    end
+  end
+
+  # Results read from the Tcl result object (_invoke_typed)
+  def test_invoke_typed_results
+    assert_tk_test("_invoke_typed should return Ruby values") do
+      <<~RUBY
+        require 'tk'
+        root = TkRoot.new { withdraw }
+        ip = TkCore::INTERP
+
+        raise "int" unless ip._invoke_typed(:int, 'expr', '6*7') == 42
+        raise "float" unless ip._invoke_typed(:float, 'expr', '1/4.0') == 0.25
+        raise "list" unless ip._invoke_typed(:list, 'list', 'a b', 'c') == ['a b', 'c']
+        raise "list_of_int" unless ip._invoke_typed(:list_of_int, 'list', 1, 2) == [1, 2]
+        dict = ip._invoke_typed(:dict, 'dict', 'create', 'k', 'v')
+        raise "dict \#{dict.inspect}" unless dict == {'k' => 'v'}
+
+        begin
+          ip._invoke_typed(:int, 'list', 'x')
+          raise "Expected TypeError"
+        rescue TypeError
+        end
+
+        # canvas queries use the typed results
+        c = TkCanvas.new(root)
+        r = TkcRectangle.new(c, 10, 20, 30, 40)
+        raise "coords \#{r.coords.inspect}" unless r.coords == [10.0, 20.0, 30.0, 40.0]
+        raise "bbox" unless c.bbox(r).all? { |v| v.kind_of?(Integer) }
+        raise "find" unless c.find_all == [r]
+
+        root.destroy
+      RUBY
+    end
+  end
+
+  # Frozen strings and symbols share interned Tcl_Objs
+  def test_interned_arguments
+    assert_tk_test("interned arguments should keep their values") do
+      <<~RUBY
+        require 'tk'
+        root = TkRoot.new { withdraw }
+        ip = TkCore::INTERP
+
+        l = TkLabel.new(root, text: 'a')
+        opt = '-text'.freeze
+        100.times do |i|
+          ip._invoke(l.path, :configure, opt, "v\#{i}")
+        end
+        raise "cget" unless ip._invoke(l.path, :cget, opt) == 'v99'
+        raise "keys" unless l.cget(:text) == 'v99'
+
+        # shared object used as a number and as a string
+        n = '42'.freeze
+        raise "expr" unless ip._invoke('expr', n, '+', 1) == '43'
+        raise "cat" unless ip._invoke('string', 'cat', n, 'x') == '42x'
+
+        # many different strings
+        2000.times { |i| ip._invoke('set', 'v', "s\#{i}".freeze) }
+        raise "set" unless ip._invoke('set', 'v') == 's1999'
+
+        # non-ASCII frozen strings are still converted
+        l.configure(text: "\u00e9t\u00e9".freeze)
+        raise "utf8 \#{l.cget(:text).inspect}" unless l.cget(:text) == "\u00e9t\u00e9"
+
+        root.destroy
+      RUBY
+    end
+  end
+
+  # Repeated _eval scripts reuse their compiled objects
+  def test_eval_cache
+    assert_tk_test("_eval should reuse cached scripts") do
+      <<~RUBY
+        require 'tk'
+        root = TkRoot.new { withdraw }
+        ip = TkCore::INTERP
+
+        size = TclTkLib.get_eval_cache_size
+        raise "default size" unless size > 0
+
+        TclTkLib.reset_eval_cache_stats
+        script = 'set x 0; foreach i {1 2 3} {incr x $i}; set x'
+        3.times { raise "eval" unless ip._eval(script) == '6' }
+        st = TclTkLib.eval_cache_stats
+        raise "stats \#{st.inspect}" unless st[:hits] >= 2 && st[:misses] >= 1
+
+        # redefined procs are seen by a cached script
+        ip._eval('proc cache_f {} {return 1}')
+        raise "f1" unless ip._eval('cache_f') == '1'
+        ip._eval('proc cache_f {} {return 2}')
+        raise "f2" unless ip._eval('cache_f') == '2'
+
+        # errors from a cached script
+        2.times do
+          begin
+            ip._eval('error oops')
+            raise "Expected error"
+          rescue RuntimeError => e
+            raise "message" unless e.message == 'oops'
+          end
+        end
+
+        TclTkLib.set_eval_cache_size(2)
+        begin
+          TclTkLib.reset_eval_cache_stats
+          10.times { |i| ip._eval("set v\#{i} \#{i}") }
+          raise "evictions" unless TclTkLib.eval_cache_stats[:evictions] >= 8
+          TclTkLib.set_eval_cache_size(0)
+          raise "no cache" unless ip._eval(script) == '6'
+        ensure
+          TclTkLib.set_eval_cache_size(size)
+        end
+
+        root.destroy
+      RUBY
+    end
+  end
+end
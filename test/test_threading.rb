@@ -7,6 +7,18 @@
 #   - ip_ruby_cmd (widget callbacks - Tcl calling Ruby)
 #   - tcl_protect_core (exception handling)
 #   - ip_eval_real, tk_funcall (Tcl eval round-trips)
+#   - evq_completion_signal, evq_completion_release (woken, abandoned callers)
+#   - ip_invoke_async, ip_eval_async (TclTkIp::Future)
+#   - ip_invoke_batch (many commands in one queued request)
+#   - ip_invoke_nowait (fire-and-forget requests, errors to bgerror)
+#   - ip_invoke_coalesced (last-write-wins requests by key)
+#   - evq_ring_push, evq_ring_drain_handler (submission ring, overflow)
+#   - call_DoOneEvent (eventloop without the GVL, set_eventloop_nogvl)
+#   - ip_rbUpdateWithinObjCmd (Tk.update_within, update with a time budget)
+#   - eventloop_adapt (adaptive eventloop weight)
+#   - lib_eventloop_stats (TclTkLib.eventloop_stats counters/histograms)
+#   - jank_report (TclTkLib.set_callback_jank_threshold, slow callbacks)
+#   - ip_callback_cmd (native Tcl command per installed callback)
 
 $LOAD_PATH.unshift(File.expand_path('../lib', __dir__))
 
@@ -294,4 +306,572 @@ class TestThreading < Minitest::Test
       RUBY
     end
   end
+
+  # Thread queueing requests without waiting (exercises TclTkIp::Future)
+  def test_thread_tcl_invoke_async
+    assert_tk_test("Thread should get results of async invoke/eval") do
+      <<~RUBY
+        require 'tk'
+        root = TkRoot.new { withdraw }
+
+        interp = TkCore::INTERP
+        values = nil
+        error = nil
+
+        t = Thread.new do
+          futures = 10.times.map { |i| interp._invoke_async("set", "asyncvar", i.to_s) }
+          futures << interp._eval_async("expr {3 * 7}")
+          values = futures.map(&:value)
+          begin
+            interp._eval_async("error boom").value
+          rescue => e
+            error = e
+          end
+        end
+
+        start = Time.now
+        while Time.now - start < 0.3
+          Tk.update
+          sleep 0.01
+        end
+
+        t.join(1)
+        expected = (0..9).map(&:to_s) << "21"
+        raise "Expected \#{expected}, got \#{values.inspect}" unless values == expected
+        raise "Expected RuntimeError, got \#{error.inspect}" unless error.is_a?(RuntimeError)
+
+        # on the eventloop thread, the future is already complete
+        f = interp._invoke_async("set", "asyncvar")
+        raise "Future should be done" unless f.done? && f.wait(0).equal?(f)
+        raise "Expected '9', got '\#{f.value}'" unless f.value == "9"
+
+        root.destroy
+      RUBY
+    end
+  end
+
+  # Future#value without an eventloop, or called on the Tk thread
+  def test_future_value_without_eventloop
+    assert_tk_test("Future#value should give up or serve its request") do
+      <<~RUBY
+        require 'tk'
+        root = TkRoot.new { withdraw }
+        interp = TkCore::INTERP
+
+        # no eventloop : value on another thread raises instead of hanging
+        f = nil
+        t = Thread.new do
+          f = interp._invoke_async("set", "fv", "5")
+          begin
+            f.value
+            nil
+          rescue RuntimeError => e
+            e
+          end
+        end
+        raise "value did not return" unless t.join(2)
+        raise "Expected RuntimeError, got \#{t.value.inspect}" unless t.value
+        raise "Expected done" unless f.done?
+        raise "Expected the error again" unless (f.value rescue :raised) == :raised
+        # the queued request itself still runs on the Tk thread
+        Tk.update
+        raise "Expected '5'" unless interp._invoke("set", "fv") == "5"
+
+        # on the Tk thread, value processes the queued request itself
+        f = Thread.new { interp._invoke_async("set", "fv", "6") }.value
+        raise "Expected '6'" unless f.value == "6"
+        g = Thread.new { interp._eval_async("after 200; set fv 7") }.value
+        raise "Expected timeout" unless g.wait(0.01).nil? || g.done?
+        raise "Expected '7'" unless g.wait(2).equal?(g) && g.value == "7"
+
+        root.destroy
+      RUBY
+    end
+  end
+
+  # Callers woken by the completion signal, or interrupted while waiting
+  # (exercises evq_completion_signal, evq_completion_release)
+  def test_thread_invoke_interrupted
+    assert_tk_test("Interrupted cross-thread calls should not break later calls") do
+      <<~RUBY
+        require 'tk'
+        root = TkRoot.new { withdraw }
+
+        interp = TkCore::INTERP
+        base = TclTkLib.eventloop_stats[:completions_in_use]
+        pending = alive = values = ready = results = elapsed = left = nil
+
+        t = Thread.new do
+          sleep 0.1
+          # keep the eventloop busy, so that the callers below have to wait
+          interp._invoke_nowait("ruby", "sleep 0.3")
+          sleep 0.05
+          waiters = 6.times.map do |i|
+            Thread.new do
+              Thread.current.report_on_exception = false
+              case i % 3
+              when 0 then interp._invoke("set", "iv\#{i}", "x")
+              when 1 then interp._eval("set iv\#{i} x")
+              else interp._get_global_var("tcl_version")
+              end
+            end
+          end
+          sleep 0.05
+          pending = TclTkLib.eventloop_stats[:completions_in_use] - base
+          waiters.each_with_index { |w, i| i.even? ? w.raise(RuntimeError, "stop") : w.kill }
+          waiters.each { |w| w.join(1) rescue nil }
+          alive = waiters.count(&:alive?)
+          values = waiters.map { |w| w.value rescue $!.class }
+
+          # the abandoned requests still run; later calls are signalled
+          ready = interp._invoke("info", "exists", "iv0")
+          start = Time.now
+          results = 300.times.map { |i| interp._invoke("set", "rt", i.to_s) }
+          elapsed = Time.now - start
+          left = TclTkLib.eventloop_stats[:completions_in_use] - base
+          root.destroy
+        end
+
+        Tk.mainloop
+        t.join(1)
+
+        raise "Expected 6 waiting callers, got \#{pending}" unless pending == 6
+        raise "Callers still alive: \#{alive}" unless alive == 0
+        expected = [RuntimeError, nil] * 3
+        raise "Expected \#{expected}, got \#{values.inspect}" unless values == expected
+        raise "Abandoned request did not run" unless ready == "1"
+        raise "Bad results" unless results == (0...300).map(&:to_s)
+        # polling took about 3 ms per call
+        raise "Round trips too slow: \#{elapsed}" unless elapsed < 0.5
+        raise "Completions not freed: \#{left}" unless left == 0
+      RUBY
+    end
+  end
+
+  # Thread running many commands by one request (exercises ip_invoke_batch)
+  def test_thread_tcl_invoke_batch
+    assert_tk_test("Thread should get results of a command batch") do
+      <<~RUBY
+        require 'tk'
+        root = TkRoot.new { withdraw }
+
+        interp = TkCore::INTERP
+        results = nil
+
+        t = Thread.new do
+          cmds = 20.times.map { |i| ["set", "batchvar\#{i}", i.to_s] }
+          cmds << ["error", "boom"] << ["expr", "{3 * 7}"]
+          results = interp._invoke_batch(cmds)
+        end
+
+        start = Time.now
+        while Time.now - start < 0.3
+          Tk.update
+          sleep 0.01
+        end
+
+        t.join(1)
+        raise "Expected 22 results, got \#{results.inspect}" unless results && results.size == 22
+        raise "Unexpected values \#{results.inspect}" unless results[0, 20] == (0..19).map(&:to_s)
+        raise "Expected RuntimeError, got \#{results[20].inspect}" unless results[20].is_a?(RuntimeError)
+        raise "Expected '21', got '\#{results[21]}'" unless results[21] == "21"
+
+        root.destroy
+      RUBY
+    end
+  end
+
+  # Thread pushing updates without waiting (exercises ip_invoke_nowait)
+  def test_thread_tcl_invoke_nowait
+    assert_tk_test("Nowait invokes should run in order and report errors") do
+      <<~RUBY
+        require 'tk'
+        root = TkRoot.new { withdraw }
+
+        interp = TkCore::INTERP
+        errors = []
+        TkBgError.set_handler { |msg| errors << msg }
+
+        t = Thread.new do
+          100.times { |i| interp._invoke_nowait("lappend", "nowaitvar", i.to_s) }
+          interp._invoke_nowait("error", "boom")
+        end
+
+        start = Time.now
+        while Time.now - start < 0.3
+          Tk.update
+          sleep 0.01
+        end
+
+        t.join(1)
+        result = interp._eval("set nowaitvar")
+        raise "Unexpected order: \#{result}" unless result == (0..99).to_a.join(" ")
+        raise "Expected bgerror 'boom', got \#{errors.inspect}" unless errors == ["boom"]
+
+        root.destroy
+      RUBY
+    end
+  end
+
+  # Requests of many threads through the submission ring (evq_ring_push)
+  def test_submission_ring_order
+    assert_tk_test("Requests should keep their order through the ring") do
+      <<~RUBY
+        require 'tk'
+        root = TkRoot.new { withdraw }
+        interp = TkCore::INTERP
+
+        # more requests than the ring (1024 cells) : wraps and falls back
+        # to the Tcl event queue while the Tk thread is not processing
+        n = 1500
+        2.times do |round|
+          4.times { |k| interp._invoke("set", "ring\#{round}_\#{k}", "") }
+          producers = 4.times.map do |k|
+            Thread.new do
+              n.times { |i| interp._invoke_nowait("lappend", "ring\#{round}_\#{k}", i) }
+            end
+          end
+          producers.each(&:join)
+
+          start = Time.now
+          until 4.times.all? { |k| interp._invoke("llength", interp._invoke("set", "ring\#{round}_\#{k}")).to_i == n } ||
+                Time.now - start > 5
+            Tk.update
+          end
+
+          4.times do |k|
+            list = interp._invoke("set", "ring\#{round}_\#{k}").split.map(&:to_i)
+            raise "round \#{round} producer \#{k} out of order" unless list == (0...n).to_a
+          end
+        end
+
+        # synchronous calls between queued ones keep the order, too
+        interp._invoke("set", "ring_mixed", "")
+        t = Thread.new do
+          100.times do |i|
+            interp._invoke_nowait("lappend", "ring_mixed", i)
+            interp._invoke("lappend", "ring_mixed", "s\#{i}") if i % 10 == 9
+          end
+        end
+        start = Time.now
+        while t.alive? && Time.now - start < 5
+          Tk.update
+        end
+        t.join(1)
+        expected = 100.times.flat_map { |i| i % 10 == 9 ? [i.to_s, "s\#{i}"] : [i.to_s] }
+        raise "mixed out of order" unless interp._invoke("set", "ring_mixed").split == expected
+
+        root.destroy
+      RUBY
+    end
+  end
+
+  # Thread updating a widget many times (exercises ip_invoke_coalesced)
+  def test_thread_tcl_invoke_coalesced
+    assert_tk_test("Coalesced invokes should apply only the last value") do
+      <<~RUBY
+        require 'tk'
+        root = TkRoot.new { withdraw }
+
+        interp = TkCore::INTERP
+        label = TkLabel.new(root, text: "")
+        interp._eval('set coalesce_count 0')
+        interp._eval('proc count_set {w v} { incr ::coalesce_count; $w configure -text $v }')
+
+        t = Thread.new do
+          1000.times do |i|
+            interp._invoke_coalesced([label.path, "text"], "count_set", label.path, i.to_s)
+          end
+        end
+        t.join(1)
+
+        start = Time.now
+        while Time.now - start < 0.2
+          Tk.update
+          sleep 0.01
+        end
+
+        raise "Expected '999', got '\#{label.cget(:text)}'" unless label.cget(:text) == "999"
+        count = interp._eval('set coalesce_count').to_i
+        raise "Expected coalesced calls, got \#{count}" unless count >= 1 && count < 1000
+
+        root.destroy
+      RUBY
+    end
+  end
+
+  # Coalesced requests after the first flush, with and without an eventloop
+  def test_invoke_coalesced_after_flush
+    assert_tk_test("Coalesced invokes after a flush should be applied") do
+      <<~RUBY
+        require 'tk'
+        root = TkRoot.new { withdraw }
+        interp = TkCore::INTERP
+
+        pump = lambda do |sec|
+          start = Time.now
+          while Time.now - start < sec
+            Tk.update
+            sleep 0.01
+          end
+        end
+
+        t = Thread.new do
+          interp._invoke("set", "co", "0")
+          interp._invoke_coalesced(:co, "set", "co", "1")
+        end
+        pump.call(0.2)
+        t.join(1)
+        raise "first: \#{interp._invoke('set', 'co')}" unless interp._invoke("set", "co") == "1"
+
+        t = Thread.new { interp._invoke_coalesced(:co, "set", "co", "2") }
+        pump.call(0.2)
+        t.join(1)
+        raise "second: \#{interp._invoke('set', 'co')}" unless interp._invoke("set", "co") == "2"
+
+        # on the Tk thread, nothing pending : invoked at once
+        interp._invoke_coalesced(:co, "set", "co", "3")
+        raise "direct" unless interp._invoke("set", "co") == "3"
+
+        # the same argument types as _invoke
+        list = [1, 2.5, :sym, ["x", 2]]
+        t = Thread.new { interp._invoke_coalesced(:co, "set", "co", list) }
+        t.join(1)
+        list << "late"
+        pump.call(0.2)
+        got = interp._invoke("set", "co")
+        raise "typed: \#{got}" unless got == interp._invoke("list", 1, 2.5, :sym, ["x", 2])
+
+        root.destroy
+      RUBY
+    end
+  end
+
+  # Mainloop waiting for events without the GVL (exercises nogvl_DoOneEvent)
+  def test_eventloop_nogvl
+    assert_tk_test("Threads and callbacks should run on the nogvl eventloop") do
+      <<~RUBY
+        require 'tk'
+        root = TkRoot.new { withdraw }
+
+        interp = TkCore::INTERP
+        Tk.set_eventloop_nogvl(true)
+        raise "nogvl mode should be on" unless Tk.get_eventloop_nogvl
+
+        ticks = 0
+        timer = TkTimer.new(10, -1) { ticks += 1 }
+        timer.start
+
+        work = nil
+        result = nil
+        t = Thread.new do
+          sleep 0.1
+          x = 0
+          200_000.times { |i| x += i }
+          work = x
+          result = interp._eval("expr {3 * 7}")
+          sleep 0.1
+          root.destroy
+        end
+
+        Tk.mainloop
+        t.join(1)
+        timer.stop
+        Tk.set_eventloop_nogvl(false)
+
+        raise "Expected worker result, got \#{work.inspect}" unless work == 19999900000
+        raise "Expected '21', got '\#{result}'" unless result == "21"
+        raise "Expected timer callbacks, got \#{ticks}" unless ticks > 0
+      RUBY
+    end
+  end
+
+  # Bounded update under a flood of events (exercises update_within)
+  def test_update_within
+    assert_tk_test("Tk.update_within should stop at the time budget") do
+      <<~RUBY
+        require 'tk'
+        root = TkRoot.new { withdraw }
+
+        interp = TkCore::INTERP
+        interp._eval('proc spin {} { incr ::spins; after 0 spin; after 1 }')
+        interp._eval('set spins 0; after 0 spin')
+
+        start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        remains, rest = Tk.update_within(20)
+        elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+
+        raise "Expected remaining work" unless remains == true
+        raise "Expected the budget to be used, got \#{rest}" unless rest <= 0
+        raise "Budget overrun: \#{elapsed}" unless elapsed < 0.5
+        raise "Expected some events" unless interp._eval('set spins').to_i > 0
+
+        interp._eval('foreach id [after info] { after cancel $id }')
+        remains, rest = Tk.update_within(20)
+        raise "Expected no remaining work" unless remains == false
+        raise "Expected the rest of the budget, got \#{rest}" unless rest > 0 && rest <= 20
+
+        # a plain update in a callback is not cut off by the outer budget
+        interp._eval('proc chain {} { if {[incr ::nested] < 5} { after idle chain } }')
+        interp._eval('set nested 0')
+        Tk.after(0) {
+          interp._eval('after 30; after idle chain')
+          Tk.update
+        }
+        Tk.update_within(10)
+        raise "Expected a full nested update" unless interp._eval('set nested') == "5"
+
+        root.destroy
+      RUBY
+    end
+  end
+
+  # Eventloop tuning its weight with other threads (exercises eventloop_adapt)
+  def test_eventloop_adaptive
+    assert_tk_test("Adaptive weight should keep the term within the target") do
+      <<~RUBY
+        require 'tk'
+        root = TkRoot.new { withdraw }
+
+        interp = TkCore::INTERP
+        Tk.set_eventloop_adaptive(2)
+        raise "Expected target 2.0" unless Tk.get_eventloop_adaptive == 2.0
+
+        interp._eval('proc busy {} { after 0 busy; after 1 }; after 0 busy')
+
+        t = Thread.new do
+          100.times { |i| interp._invoke("set", "adaptvar", i.to_s) }
+          sleep 0.3
+          root.destroy
+        end
+
+        Tk.mainloop
+        t.join(1)
+        Tk.set_eventloop_adaptive(nil)
+        interp._eval('foreach id [after info] { after cancel $id }')
+
+        loop_max, no_event_tick = Tk.get_eventloop_weight
+        raise "loop_max not reduced: \#{loop_max}" unless loop_max < 800
+        raise "bad no_event_tick: \#{no_event_tick}" unless (1..10).include?(no_event_tick)
+        raise "Adaptive mode should be off" unless Tk.get_eventloop_adaptive.nil?
+
+        begin
+          Tk.set_eventloop_adaptive(0)
+          raise "Expected ArgumentError for a target of 0"
+        rescue ArgumentError
+        end
+        raise "Adaptive mode should stay off" unless Tk.get_eventloop_adaptive.nil?
+      RUBY
+    end
+  end
+
+  # Eventloop statistics (exercises lib_eventloop_stats)
+  def test_eventloop_stats
+    assert_tk_test("eventloop_stats should count events and requests") do
+      <<~RUBY
+        require 'tk'
+        root = TkRoot.new { withdraw }
+
+        interp = TkCore::INTERP
+        TclTkLib.reset_eventloop_stats
+        TclTkLib.set_eventloop_stats_mode(true)
+
+        fired = 0
+        TkTimer.new(5, 10) { fired += 1 }.start
+
+        t = Thread.new do
+          50.times { |i| interp._invoke("set", "statsvar", i.to_s) }
+          sleep 0.2
+          root.destroy
+        end
+
+        Tk.mainloop
+        t.join(1)
+        TclTkLib.set_eventloop_stats_mode(false)
+
+        st = TclTkLib.eventloop_stats
+        raise "Expected events, got \#{st.inspect}" unless st[:events] > 0
+        raise "Expected callbacks, got \#{st[:callbacks]}" unless st[:callbacks] >= fired && fired > 0
+        raise "Expected 50 requests, got \#{st[:requests]}" unless st[:requests] >= 50
+        raise "Bad histogram" unless st[:event_time_histogram].sum == st[:events]
+        raise "Bad time" unless st[:ruby_time] >= 0 && st[:tcl_time] >= 0
+
+        TclTkLib.reset_eventloop_stats
+        raise "Expected reset" unless TclTkLib.eventloop_stats[:events] == 0
+      RUBY
+    end
+  end
+
+  # Jank detector of slow callbacks (exercises jank_report, jank_watchdog_body)
+  def test_callback_jank_detector
+    assert_tk_test("slow callbacks should be logged with id and backtrace") do
+      <<~RUBY
+        require 'tk'
+        root = TkRoot.new { withdraw }
+
+        threads = Thread.list.size
+        hooked = []
+        TclTkLib.clear_callback_jank_log
+        TclTkLib.set_callback_jank_hook(proc { |info| hooked << info })
+        TclTkLib.set_callback_jank_threshold(20)
+
+        def slow_callback
+          sleep 0.1
+        end
+        TkTimer.new(5, 1) { slow_callback }.start
+        TkTimer.new(5, 1) { }.start
+
+        start = Time.now
+        while Time.now - start < 0.3
+          Tk.update
+          sleep 0.01
+        end
+        TclTkLib.set_callback_jank_threshold(nil)
+        TclTkLib.set_callback_jank_hook(nil)
+
+        log = TclTkLib.callback_jank_log
+        raise "Expected 1 slow callback, got \#{log.inspect}" unless log.size == 1
+        info = log.first
+        raise "Bad id \#{info[:id].inspect}" unless info[:id].is_a?(String) && info[:id].start_with?("c")
+        raise "Bad command \#{info[:command].inspect}" unless info[:command].include?(info[:id])
+        raise "Bad time \#{info[:time]}" unless info[:time] >= 0.02
+        bt = info[:backtrace]
+        raise "Expected backtrace" unless bt && bt.any? { |l| l.include?("slow_callback") }
+        raise "Expected hook call" unless hooked == log
+        raise "Expected no threshold" unless TclTkLib.get_callback_jank_threshold.nil?
+        raise "Watchdog thread left" unless Thread.list.size == threads
+
+        root.destroy
+      RUBY
+    end
+  end
+
+  # Native command per callback (exercises ip_callback_cmd)
+  def test_native_callback_command
+    assert_tk_test("installed callbacks should be native Tcl commands") do
+      <<~RUBY
+        require 'tk'
+        root = TkRoot.new { withdraw }
+
+        args = nil
+        script = TkComm.install_cmd(proc { |*a| args = a; "ok" })
+        name, id = script.split
+        raise "Unexpected script \#{script}" unless name == "rb_out_\#{id}"
+        raise "Expected a command" if Tk.ip_eval("info commands \#{name}").empty?
+
+        ret = Tk.ip_eval("\#{script} a {b c}")
+        raise "Expected ok, got \#{ret}" unless ret == "ok"
+        raise "Bad args \#{args.inspect}" unless args == ["a", "b c"]
+
+        # called from a thread other than the eventloop
+        t = Thread.new { Tk.ip_eval("\#{script} x") }
+        raise "Bad result from thread" unless t.value == "ok"
+
+        TkComm.uninstall_cmd(script)
+        raise "Expected no command" unless Tk.ip_eval("info commands \#{name}").empty?
+
+        root.destroy
+      RUBY
+    end
+  end
 end
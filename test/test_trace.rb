@@ -0,0 +1,56 @@
+# frozen_string_literal: true
+
+# Tests for the trace of the hot paths (TclTkLib.start_trace)
+#
+# Key C functions exercised:
+#   - rbtk_trace_add (begin/end events in the ring buffer)
+#   - lib_trace_json (Chrome trace event format)
+
+$LOAD_PATH.unshift(File.expand_path('../lib', __dir__))
+
+require 'minitest/autorun'
+require_relative 'tk_test_helper'
+
+class TestTrace < Minitest::Test
+  include TkTestHelper
+
+  # Tracing of the hot paths (exercises lib_start_trace, lib_trace_json)
+  def test_trace_json
+    assert_tk_test("trace_json should dump begin/end events") do
+      <<~RUBY
+        require 'tk'
+        require 'json'
+        root = TkRoot.new { withdraw }
+
+        interp = TkCore::INTERP
+        TclTkLib.start_trace(1000)
+
+        t = Thread.new do
+          10.times { |i| interp._invoke("set", "tracevar", i.to_s) }
+        end
+        TkTimer.new(5, 5) { }.start
+
+        start = Time.now
+        while Time.now - start < 0.2
+          Tk.update
+          sleep 0.01
+        end
+        t.join(1)
+        TclTkLib.stop_trace
+
+        events = JSON.parse(TclTkLib.trace_json)["traceEvents"]
+        names = events.map { |e| e["name"] }
+        %w[ip_invoke_core callback].each do |name|
+          raise "Expected \#{name} in \#{names.uniq}" unless names.include?(name)
+        end
+        raise "Bad phase" unless events.all? { |e| %w[B E].include?(e["ph"]) }
+        raise "Ring overflow" unless events.size <= 1000
+
+        TclTkLib.clear_trace
+        raise "Expected no events" unless JSON.parse(TclTkLib.trace_json)["traceEvents"].empty?
+
+        root.destroy
+      RUBY
+    end
+  end
+end